@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "TinyFTPAddress.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		// SO_REUSEADDR on Windows lets any socket bind a port that is already listening, a second instance
+		// would take passive ports a draining one still serves. Nobody else may bind ours.
+		typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_EXCLUSIVEADDRUSE> exclusive_address_use;
+	}
+
+	void listenDualStack(asio::ip::tcp::acceptor& acceptor, unsigned short port, asio::error_code& ec)
+	{
+		acceptor.open(asio::ip::tcp::v6(), ec);
+		if (!ec)
+			acceptor.set_option(asio::ip::v6_only(false), ec);
+		if (ec)
+		{
+			if (acceptor.is_open())
+			{
+				asio::error_code ignored_ec;
+				acceptor.close(ignored_ec);
+			}
+			acceptor.open(asio::ip::tcp::v4(), ec);
+			if (ec)
+				return;
+			acceptor.set_option(exclusive_address_use(true), ec);
+			if (!ec)
+				acceptor.bind(asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port), ec);
+		}
+		else
+		{
+			acceptor.set_option(exclusive_address_use(true), ec);
+			if (!ec)
+				acceptor.bind(asio::ip::tcp::endpoint(asio::ip::tcp::v6(), port), ec);
+		}
+		if (!ec)
+			acceptor.listen(asio::socket_base::max_listen_connections, ec);
+	}
+
+	TinyFTPAddressParseResult parsePortArgument(const char* arg, asio::ip::tcp::endpoint& endpoint)
+	{
+		unsigned int h1, h2, h3, h4, p1, p2;
+		char tail;
+		if (sscanf(arg, "%u,%u,%u,%u,%u,%u%c", &h1, &h2, &h3, &h4, &p1, &p2, &tail) != 6)
+			return ADDRESS_SYNTAX_ERROR;
+		if (h1 > 255 || h2 > 255 || h3 > 255 || h4 > 255 || p1 > 255 || p2 > 255)
+			return ADDRESS_SYNTAX_ERROR;
+
+		asio::ip::address_v4::bytes_type bytes = { (unsigned char)h1, (unsigned char)h2, (unsigned char)h3, (unsigned char)h4 };
+		endpoint = asio::ip::tcp::endpoint(asio::ip::address_v4(bytes), (unsigned short)(p1 * 256 + p2));
+		return ADDRESS_OK;
+	}
+
+	TinyFTPAddressParseResult parseEprtArgument(const char* arg, asio::ip::tcp::endpoint& endpoint)
+	{
+		// delimiter is whatever the client put first, usually '|'
+		char delimiter = arg[0];
+		if (delimiter < 33 || delimiter > 126)
+			return ADDRESS_SYNTAX_ERROR;
+
+		const char* fields[3];
+		size_t lengths[3];
+		const char* cur = arg + 1;
+		for (int i = 0; i < 3; ++i)
+		{
+			const char* next = strchr(cur, delimiter);
+			if (!next)
+				return ADDRESS_SYNTAX_ERROR;
+			fields[i] = cur;
+			lengths[i] = next - cur;
+			cur = next + 1;
+		}
+		if (*cur != 0)
+			return ADDRESS_SYNTAX_ERROR;
+
+		std::string protocol(fields[0], lengths[0]);
+		if (protocol != "1" && protocol != "2")
+			return ADDRESS_UNSUPPORTED_PROTOCOL;
+
+		asio::error_code ec;
+		asio::ip::address address = asio::ip::make_address(std::string(fields[1], lengths[1]), ec);
+		if (ec || (protocol == "1") != address.is_v4())
+			return ADDRESS_SYNTAX_ERROR;
+
+		std::string portString(fields[2], lengths[2]);
+		char* portEnd = nullptr;
+		unsigned long port = strtoul(portString.c_str(), &portEnd, 10);
+		if (portString.empty() || *portEnd != 0 || port == 0 || port > 65535)
+			return ADDRESS_SYNTAX_ERROR;
+
+		endpoint = asio::ip::tcp::endpoint(address, (unsigned short)port);
+		return ADDRESS_OK;
+	}
+
+	bool toIPv4(const asio::ip::address& address, asio::ip::address_v4& addressV4)
+	{
+		if (address.is_v4())
+		{
+			addressV4 = address.to_v4();
+			return true;
+		}
+		if (address.to_v6().is_v4_mapped())
+		{
+			addressV4 = asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+			return true;
+		}
+		return false;
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef IK80_TINYFTPADDRESS_H_
+#define IK80_TINYFTPADDRESS_H_
+
+#include <asio/ip/tcp.hpp>
+#include <asio/ip/v6_only.hpp>
+
+namespace TinyWinFTP
+{
+	enum TinyFTPAddressParseResult
+	{
+		ADDRESS_OK = 0,
+		ADDRESS_SYNTAX_ERROR,
+		ADDRESS_UNSUPPORTED_PROTOCOL
+	};
+
+	/// Opens, binds and starts listening on port for both IPv6 and IPv4 clients.
+	/// Falls back to IPv4 only if the host has no IPv6 stack. The port is bound with SO_EXCLUSIVEADDRUSE,
+	/// so it fails while another socket, ours or anybody's, still holds it.
+	void listenDualStack(asio::ip::tcp::acceptor& acceptor, unsigned short port, asio::error_code& ec);
+
+	/// Parses RFC 959 PORT argument h1,h2,h3,h4,p1,p2.
+	TinyFTPAddressParseResult parsePortArgument(const char* arg, asio::ip::tcp::endpoint& endpoint);
+
+	/// Parses RFC 2428 EPRT argument <d>proto<d>address<d>port<d>.
+	TinyFTPAddressParseResult parseEprtArgument(const char* arg, asio::ip::tcp::endpoint& endpoint);
+
+	/// Returns IPv4 form of address, unwrapping v4-mapped IPv6 addresses of dual-stack sockets.
+	/// False if address is a real IPv6 one and can't be put into a 227 reply.
+	bool toIPv4(const asio::ip::address& address, asio::ip::address_v4& addressV4);
+}
+
+#endif // IK80_TINYFTPADDRESS_H_
@@ -0,0 +1,171 @@
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "TinyFTPArchive.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const size_t NAME_LENGTH = 100;
+		const size_t PREFIX_LENGTH = 155;
+		const uint64_t FILETIME_UNIX_EPOCH = 116444736000000000ull;
+		// largest size the 11 octal digits of the size field hold
+		const uint64_t MAX_OCTAL_SIZE = 077777777777ull;
+
+		struct TarHeader
+		{
+			char name[100];
+			char mode[8];
+			char uid[8];
+			char gid[8];
+			char size[12];
+			char mtime[12];
+			char checksum[8];
+			char typeflag;
+			char linkname[100];
+			char magic[6];
+			char version[2];
+			char uname[32];
+			char gname[32];
+			char devmajor[8];
+			char devminor[8];
+			char prefix[155];
+			char padding[12];
+		};
+		static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "tar header is one block");
+
+		void putOctal(char* field, size_t length, uint64_t value)
+		{
+			char digits[24];
+			snprintf(digits, sizeof(digits), "%0*llo", (int)(length - 1), (unsigned long long)value);
+			memcpy(field, digits, length - 1);
+			field[length - 1] = 0;
+		}
+
+		void putSize(char* field, uint64_t size)
+		{
+			if (size <= MAX_OCTAL_SIZE)
+			{
+				putOctal(field, 12, size);
+				return;
+			}
+			// GNU base-256: high bit set, big endian binary in the rest of the field
+			memset(field, 0, 12);
+			field[0] = (char)0x80;
+			for (int i = 11; i > 3; --i, size >>= 8)
+				field[i] = (char)(size & 0xff);
+		}
+
+		void appendHeader(const std::string& name, const std::string& prefix, char typeflag, uint64_t size, uint64_t lastWriteTime, std::string& out)
+		{
+			TarHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.name, name.data(), std::min(name.size(), NAME_LENGTH));
+			memcpy(header.prefix, prefix.data(), std::min(prefix.size(), PREFIX_LENGTH));
+			putOctal(header.mode, sizeof(header.mode), typeflag == '5' ? 0755 : 0644);
+			putOctal(header.uid, sizeof(header.uid), 0);
+			putOctal(header.gid, sizeof(header.gid), 0);
+			putSize(header.size, size);
+			putOctal(header.mtime, sizeof(header.mtime), lastWriteTime > FILETIME_UNIX_EPOCH ? (lastWriteTime - FILETIME_UNIX_EPOCH) / 10000000 : 0);
+			header.typeflag = typeflag;
+			memcpy(header.magic, "ustar", 6);
+			memcpy(header.version, "00", 2);
+			memcpy(header.uname, "root", 4);
+			memcpy(header.gname, "root", 4);
+
+			// computed with the checksum field itself taken as spaces
+			memset(header.checksum, ' ', sizeof(header.checksum));
+			unsigned int checksum = 0;
+			for (size_t i = 0; i < sizeof(header); ++i)
+				checksum += (unsigned char)reinterpret_cast<const char*>(&header)[i];
+			snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+			header.checksum[7] = ' ';
+
+			out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		}
+
+		void collect(TinyFTPFileSystem& fileSystem, const std::string& directory, const std::string& namePrefix, std::vector<TinyFTPArchiveMember>& members)
+		{
+			std::vector<TinyFTPFileInfo> entries;
+			if (!fileSystem.list(directory, entries))
+				return;
+			for (const TinyFTPFileInfo& entry : entries)
+			{
+				TinyFTPArchiveMember member;
+				member.name = namePrefix + entry.name + (entry.isDirectory ? "/" : "");
+				member.path = directory + "\\" + entry.name;
+				member.isDirectory = entry.isDirectory;
+				member.lastWriteTime = entry.lastWriteTime;
+				members.push_back(member);
+				// a junction goes in as an empty directory, following it could loop back up the tree
+				if (entry.isDirectory && !entry.isReparsePoint)
+					collect(fileSystem, member.path, member.name, members);
+			}
+		}
+	}
+
+	bool collectArchiveMembers(TinyFTPFileSystem& fileSystem, const std::string& directory, const std::string& pattern, std::vector<TinyFTPArchiveMember>& members)
+	{
+		if (pattern.empty())
+		{
+			TinyFTPFileInfo info;
+			if (!fileSystem.stat(directory, info))
+				return false;
+			if (info.isDirectory)
+				collect(fileSystem, directory, std::string(), members);
+			else
+			{
+				// a single file, archived under its own name
+				TinyFTPArchiveMember member;
+				member.name = directory.substr(directory.find_last_of('\\') + 1);
+				member.path = directory;
+				member.lastWriteTime = info.lastWriteTime;
+				members.push_back(member);
+			}
+			return true;
+		}
+
+		std::vector<TinyFTPFileInfo> entries;
+		if (!fileSystem.list(directory, pattern, entries))
+			return false;
+		for (const TinyFTPFileInfo& entry : entries)
+		{
+			if (entry.isDirectory)
+				continue;
+			TinyFTPArchiveMember member;
+			member.name = entry.name;
+			member.path = directory + "\\" + entry.name;
+			member.lastWriteTime = entry.lastWriteTime;
+			members.push_back(member);
+		}
+		return true;
+	}
+
+	void appendTarHeader(const TinyFTPArchiveMember& member, uint64_t size, std::string& out)
+	{
+		char typeflag = member.isDirectory ? '5' : '0';
+		const std::string& name = member.name;
+		if (name.size() <= NAME_LENGTH)
+		{
+			appendHeader(name, std::string(), typeflag, size, member.lastWriteTime, out);
+			return;
+		}
+
+		// ustar splits long names at a slash into prefix and name
+		size_t split = name.find_last_of('/', std::min(PREFIX_LENGTH, name.size() - 2));
+		if (split != std::string::npos && split && name.size() - split - 1 <= NAME_LENGTH)
+		{
+			appendHeader(name.substr(split + 1), name.substr(0, split), typeflag, size, member.lastWriteTime, out);
+			return;
+		}
+
+		// GNU tar and libarchive take the name from a record of its own
+		appendHeader("././@LongLink", std::string(), 'L', name.size() + 1, 0, out);
+		out.append(name);
+		out.append(1 + tarPadding(name.size() + 1), 0);
+		appendHeader(name.substr(0, NAME_LENGTH), std::string(), typeflag, size, member.lastWriteTime, out);
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef IK80_TINYFTPARCHIVE_H_
+#define IK80_TINYFTPARCHIVE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "TinyFTPFileSystem.h"
+
+namespace TinyWinFTP
+{
+	const size_t TAR_BLOCK_SIZE = 512;
+
+	/// One entry of a SITE MGET stream.
+	struct TinyFTPArchiveMember
+	{
+		// inside the archive, '/' separated, directories end with '/'
+		std::string name;
+		// translated path to open
+		std::string path;
+		bool isDirectory = false;
+		uint64_t lastWriteTime = 0;
+	};
+
+	/// Everything below directory, directories before their contents, or with a pattern only the files
+	/// directly in it whose names match. A plain file without a pattern is the only member.
+	/// False if directory doesn't exist or can't be listed.
+	bool collectArchiveMembers(TinyFTPFileSystem& fileSystem, const std::string& directory, const std::string& pattern, std::vector<TinyFTPArchiveMember>& members);
+
+	/// Appends the ustar header for member holding size bytes, preceded by a GNU long name record
+	/// when the name doesn't fit the header. Sizes from 8 GB up use the GNU base-256 size field.
+	void appendTarHeader(const TinyFTPArchiveMember& member, uint64_t size, std::string& out);
+
+	/// Zero bytes that round size up to a whole block.
+	inline size_t tarPadding(uint64_t size)
+	{
+		return (size_t)((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+	}
+}
+
+#endif // IK80_TINYFTPARCHIVE_H_
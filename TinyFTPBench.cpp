@@ -0,0 +1,663 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/connect.hpp>
+#include <asio/read.hpp>
+#include <asio/read_until.hpp>
+#include <asio/write.hpp>
+#include <asio/streambuf.hpp>
+#include <asio/buffers_iterator.hpp>
+#include <asio/system_error.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <psapi.h>
+
+// ftpbench: drives concurrent FTP sessions against a server (normally TinyWinFTP on loopback) and reports
+// operations per second, latency percentiles per command, throughput and CPU seconds per GB moved, or
+// holds many idle sessions open and reports what they cost the server's memory.
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	enum BenchOp
+	{
+		OP_RETR,
+		OP_STOR,
+		OP_LIST,
+		OP_SIZE,
+		OP_MDTM,
+		OP_CHURN,
+		OP_COUNT
+	};
+
+	const char* OP_NAMES[OP_COUNT] = { "retr", "stor", "list", "size", "mdtm", "churn" };
+
+	const size_t DATA_BUFFER_SIZE = 1024 * 1024;
+	// idle runs log in this many sessions at a time, few enough for the server's listen backlog
+	const size_t IDLE_OPENERS = 64;
+	// a connection the server's backlog dropped looks established but never gets its 220
+	const std::chrono::seconds LOGIN_TIMEOUT(10);
+	// one source address runs out of ephemeral ports, idle runs against loopback spread over 127.0.0.x
+	const size_t CONNECTIONS_PER_SOURCE = 16000;
+
+	struct BenchConfig
+	{
+		std::string host = "127.0.0.1";
+		std::string port = "21";
+		std::string user = "anonymous";
+		std::string password = "ftpbench@";
+		unsigned int sessions = 8;
+		unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+		unsigned int duration = 10;
+		std::vector<BenchOp> ops;
+		// RETR, SIZE and MDTM target; uploaded first unless it is already on the server
+		std::string file = "ftpbench.bin";
+		bool uploadFile = true;
+		uint64_t fileSize = 64 * 1024 * 1024;
+		std::string listDirectory = "/";
+		DWORD serverPid = 0;
+		// the same run again against a second server, e.g. one started with --buffered-uploads
+		std::string comparePort;
+		DWORD comparePid = 0;
+		// instead of a load run: this many logged-in sessions left idle for the duration
+		size_t idleSessions = 0;
+	};
+
+	// what one session measured, merged after the run
+	struct BenchResults
+	{
+		// microseconds per completed operation
+		std::vector<uint32_t> latencies[OP_COUNT];
+		uint64_t errors[OP_COUNT] = {};
+		uint64_t bytesDown = 0;
+		uint64_t bytesUp = 0;
+
+		void merge(const BenchResults& other)
+		{
+			for (int op = 0; op < OP_COUNT; ++op)
+			{
+				latencies[op].insert(latencies[op].end(), other.latencies[op].begin(), other.latencies[op].end());
+				errors[op] += other.errors[op];
+			}
+			bytesDown += other.bytesDown;
+			bytesUp += other.bytesUp;
+		}
+	};
+
+	/// One control connection and the data connections of its commands, passive mode only.
+	class BenchClient
+	{
+	public:
+		BenchClient(asio::io_context& io, const asio::ip::tcp::endpoint& in_endpoint)
+			: control(io),
+			endpoint(in_endpoint)
+		{
+		}
+
+		/// Local address of the control connection, before connect().
+		void bindSource(const asio::ip::address& address)
+		{
+			control.open(endpoint.protocol());
+			control.bind(asio::ip::tcp::endpoint(address, 0));
+		}
+
+		asio::awaitable<void> connect(const BenchConfig& config)
+		{
+			co_await control.async_connect(endpoint, asio::use_awaitable);
+			control.set_option(asio::ip::tcp::no_delay(true));
+			co_await expect(220);
+			int code = co_await command("USER " + config.user);
+			if (code == 331)
+				code = co_await command("PASS " + config.password);
+			if (code != 230)
+				throw std::runtime_error("login refused");
+			if (co_await command("TYPE I") != 200)
+				throw std::runtime_error("TYPE I refused");
+		}
+
+		void close()
+		{
+			asio::error_code ignored_ec;
+			control.close(ignored_ec);
+		}
+
+		asio::awaitable<void> quit()
+		{
+			co_await command("QUIT");
+			asio::error_code ignored_ec;
+			control.close(ignored_ec);
+		}
+
+		/// Sends a command, returns the code of its reply.
+		asio::awaitable<int> command(const std::string& line)
+		{
+			std::string request = line + "\r\n";
+			co_await asio::async_write(control, asio::buffer(request), asio::use_awaitable);
+			co_return co_await readReply();
+		}
+
+		asio::awaitable<uint64_t> retr(const std::string& file, std::vector<char>& buffer)
+		{
+			asio::ip::tcp::socket data = co_await openPassive();
+			co_await startTransfer("RETR " + file);
+			uint64_t bytes = co_await drain(data, buffer);
+			co_await expect(226);
+			co_return bytes;
+		}
+
+		asio::awaitable<void> stor(const std::string& file, uint64_t size, const std::vector<char>& buffer)
+		{
+			asio::ip::tcp::socket data = co_await openPassive();
+			co_await startTransfer("STOR " + file);
+			for (uint64_t sent = 0; sent < size; )
+			{
+				size_t chunk = (size_t)std::min<uint64_t>(buffer.size(), size - sent);
+				co_await asio::async_write(data, asio::buffer(buffer.data(), chunk), asio::use_awaitable);
+				sent += chunk;
+			}
+			data.shutdown(asio::ip::tcp::socket::shutdown_send);
+			data.close();
+			co_await expect(226);
+		}
+
+		asio::awaitable<uint64_t> list(const std::string& directory, std::vector<char>& buffer)
+		{
+			asio::ip::tcp::socket data = co_await openPassive();
+			co_await startTransfer("LIST " + directory);
+			uint64_t bytes = co_await drain(data, buffer);
+			co_await expect(226);
+			co_return bytes;
+		}
+
+	private:
+		asio::awaitable<int> readReply()
+		{
+			// multi-line replies end with the line that has a space after the code
+			std::string first = co_await readLine();
+			if (first.size() < 4)
+				throw std::runtime_error("short reply");
+			if (first[3] == '-')
+			{
+				std::string end = first.substr(0, 3) + " ";
+				for (std::string line = co_await readLine(); line.compare(0, 4, end); line = co_await readLine())
+					;
+			}
+			co_return atoi(first.c_str());
+		}
+
+		asio::awaitable<std::string> readLine()
+		{
+			size_t length = co_await asio::async_read_until(control, replies, "\r\n", asio::use_awaitable);
+			std::string line(asio::buffers_begin(replies.data()), asio::buffers_begin(replies.data()) + length - 2);
+			replies.consume(length);
+			co_return line;
+		}
+
+		asio::awaitable<void> expect(int code)
+		{
+			int received = co_await readReply();
+			if (received != code)
+				throw std::runtime_error("unexpected reply " + std::to_string(received));
+		}
+
+		asio::awaitable<void> startTransfer(const std::string& line)
+		{
+			int code = co_await command(line);
+			if (code != 150 && code != 125)
+				throw std::runtime_error(line + " refused with " + std::to_string(code));
+		}
+
+		// EPSV, the data connection goes to the control connection's address
+		asio::awaitable<asio::ip::tcp::socket> openPassive()
+		{
+			std::string request = "EPSV\r\n";
+			co_await asio::async_write(control, asio::buffer(request), asio::use_awaitable);
+			std::string reply = co_await readLine();
+			size_t portStart = reply.find("(|||");
+			if (reply.compare(0, 3, "229") || portStart == std::string::npos)
+				throw std::runtime_error("EPSV refused");
+			unsigned long port = strtoul(reply.c_str() + portStart + 4, 0, 10);
+			asio::ip::tcp::socket data(control.get_executor());
+			co_await data.async_connect(asio::ip::tcp::endpoint(endpoint.address(), (unsigned short)port), asio::use_awaitable);
+			co_return data;
+		}
+
+		asio::awaitable<uint64_t> drain(asio::ip::tcp::socket& data, std::vector<char>& buffer)
+		{
+			uint64_t bytes = 0;
+			for (;;)
+			{
+				asio::error_code e;
+				size_t received = co_await data.async_read_some(asio::buffer(buffer), asio::redirect_error(asio::use_awaitable, e));
+				bytes += received;
+				if (e == asio::error::eof)
+					break;
+				if (e)
+					throw asio::system_error(e);
+			}
+			co_return bytes;
+		}
+
+		asio::ip::tcp::socket control;
+		asio::ip::tcp::endpoint endpoint;
+		asio::streambuf replies;
+	};
+
+	uint32_t microsSince(Clock::time_point start)
+	{
+		return (uint32_t)std::min<int64_t>(UINT32_MAX, std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+	}
+
+	/// Runs the configured commands round robin until the deadline. A failed command counts as an error and
+	/// the session starts over on a new connection.
+	asio::awaitable<void> runSession(asio::io_context& io, const BenchConfig& config, asio::ip::tcp::endpoint endpoint, unsigned int index,
+		Clock::time_point deadline, BenchResults& results)
+	{
+		std::vector<char> buffer(DATA_BUFFER_SIZE, (char)('a' + index % 26));
+		std::string storName = "ftpbench-" + std::to_string(index) + ".bin";
+		std::unique_ptr<BenchClient> client;
+		// sessions start at different commands so a mixed run mixes at every moment
+		size_t next = index;
+		while (Clock::now() < deadline)
+		{
+			BenchOp op = config.ops[next++ % config.ops.size()];
+			try
+			{
+				if (!client && op != OP_CHURN)
+				{
+					client.reset(new BenchClient(io, endpoint));
+					co_await client->connect(config);
+				}
+				Clock::time_point start = Clock::now();
+				switch (op)
+				{
+				case OP_RETR:
+					results.bytesDown += co_await client->retr(config.file, buffer);
+					break;
+				case OP_STOR:
+					co_await client->stor(storName, config.fileSize, buffer);
+					results.bytesUp += config.fileSize;
+					break;
+				case OP_LIST:
+					results.bytesDown += co_await client->list(config.listDirectory, buffer);
+					break;
+				case OP_SIZE:
+					if (co_await client->command("SIZE " + config.file) != 213)
+						throw std::runtime_error("SIZE failed");
+					break;
+				case OP_MDTM:
+					if (co_await client->command("MDTM " + config.file) != 213)
+						throw std::runtime_error("MDTM failed");
+					break;
+				case OP_CHURN:
+				{
+					// a whole session: connect, log in, log out
+					client.reset();
+					BenchClient churned(io, endpoint);
+					co_await churned.connect(config);
+					co_await churned.quit();
+					break;
+				}
+				default:
+					break;
+				}
+				results.latencies[op].push_back(microsSince(start));
+			}
+			catch (const std::exception&)
+			{
+				++results.errors[op];
+				client.reset();
+			}
+		}
+		if (client)
+		{
+			try
+			{
+				co_await client->quit();
+			}
+			catch (const std::exception&)
+			{
+			}
+		}
+	}
+
+	// uploads the RETR/SIZE/MDTM file once before the clock starts
+	asio::awaitable<void> prepare(asio::io_context& io, const BenchConfig& config, asio::ip::tcp::endpoint endpoint, bool& ok)
+	{
+		try
+		{
+			BenchClient client(io, endpoint);
+			co_await client.connect(config);
+			std::vector<char> buffer(DATA_BUFFER_SIZE, 'x');
+			co_await client.stor(config.file, config.fileSize, buffer);
+			co_await client.quit();
+			ok = true;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "ftpbench: upload of " << config.file << " failed: " << e.what() << std::endl;
+		}
+	}
+
+	// logs in sessions one after the other until all of them are taken, a failed one stays empty
+	asio::awaitable<void> openIdleSessions(asio::io_context& io, const BenchConfig& config, asio::ip::tcp::endpoint endpoint,
+		std::vector<std::shared_ptr<BenchClient> >& clients, size_t& next, size_t& opened)
+	{
+		asio::steady_timer timer(io);
+		while (next < clients.size())
+		{
+			size_t index = next++;
+			std::shared_ptr<BenchClient> client = std::make_shared<BenchClient>(io, endpoint);
+			timer.expires_after(LOGIN_TIMEOUT);
+			timer.async_wait([client](const asio::error_code& e)
+			{
+				if (!e)
+					client->close();
+			});
+			try
+			{
+				// the first ones from wherever the system picks, then 127.0.0.2, 127.0.0.3, ...
+				if (index >= CONNECTIONS_PER_SOURCE && endpoint.address().is_v4() && endpoint.address().is_loopback())
+					client->bindSource(asio::ip::address_v4(asio::ip::address_v4::loopback().to_uint() + (uint32_t)(index / CONNECTIONS_PER_SOURCE)));
+				co_await client->connect(config);
+				// nothing to cancel: the timeout got there first and closes it
+				if (!timer.cancel())
+					continue;
+				clients[index] = std::move(client);
+				++opened;
+			}
+			catch (const std::exception&)
+			{
+				timer.cancel();
+			}
+		}
+	}
+
+	struct MemoryUsage
+	{
+		uint64_t workingSet = 0;
+		uint64_t privateBytes = 0;
+	};
+
+	bool memoryUsage(HANDLE process, MemoryUsage& usage)
+	{
+		PROCESS_MEMORY_COUNTERS_EX counters;
+		if (!process || !GetProcessMemoryInfo(process, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+			return false;
+		usage.workingSet = counters.WorkingSetSize;
+		usage.privateBytes = counters.PrivateUsage;
+		return true;
+	}
+
+	void printMemory(const char* what, uint64_t before, uint64_t after, size_t sessions)
+	{
+		printf("server %s %.1f MB before, %.1f MB with the sessions, %.2f KB per session\n", what, before / (1024.0 * 1024.0),
+			after / (1024.0 * 1024.0), ((double)after - (double)before) / 1024.0 / sessions);
+	}
+
+	// kernel plus user time, -1 if it can't be read
+	double cpuSeconds(HANDLE process)
+	{
+		FILETIME creationTime, exitTime, kernelTime, userTime;
+		if (!process || !GetProcessTimes(process, &creationTime, &exitTime, &kernelTime, &userTime))
+			return -1;
+		uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) + kernelTime.dwLowDateTime;
+		uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) + userTime.dwLowDateTime;
+		return (kernel + user) / 1e7;
+	}
+
+	void printCpu(const char* who, double seconds, double gigabytes)
+	{
+		if (seconds < 0)
+			return;
+		if (gigabytes > 0)
+			printf("%s cpu %.2f s, %.3f s/GB\n", who, seconds, seconds / gigabytes);
+		else
+			printf("%s cpu %.2f s\n", who, seconds);
+	}
+
+	uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction)
+	{
+		if (sorted.empty())
+			return 0;
+		return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+	}
+
+	bool parseOps(const char* list, std::vector<BenchOp>& ops)
+	{
+		std::string names(list);
+		size_t begin = 0;
+		while (begin <= names.size())
+		{
+			size_t end = names.find(',', begin);
+			if (end == std::string::npos)
+				end = names.size();
+			std::string name = names.substr(begin, end - begin);
+			if (name == "mixed")
+			{
+				for (int op = 0; op < OP_COUNT; ++op)
+					ops.push_back((BenchOp)op);
+			}
+			else
+			{
+				const char** found = std::find(OP_NAMES, OP_NAMES + OP_COUNT, name);
+				if (found == OP_NAMES + OP_COUNT)
+					return false;
+				ops.push_back((BenchOp)(found - OP_NAMES));
+			}
+			begin = end + 1;
+		}
+		return !ops.empty();
+	}
+
+	/// One run against host:port; prepares the RETR file, drives the sessions until the duration is up and
+	/// prints the results. serverPid, if set, is the process whose CPU time is charged to the run.
+	bool runBenchmark(const BenchConfig& config, const std::string& port, DWORD serverPid, double& serverSecondsPerGigabyte)
+	{
+		asio::io_context io;
+		asio::error_code ec;
+		asio::ip::tcp::resolver resolver(io);
+		asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(config.host, port, ec);
+		if (ec || endpoints.empty())
+		{
+			std::cout << "ftpbench: can't resolve " << config.host << ":" << port << std::endl;
+			return false;
+		}
+		asio::ip::tcp::endpoint endpoint = endpoints.begin()->endpoint();
+
+		bool needsFile = std::find_if(config.ops.begin(), config.ops.end(), [](BenchOp op) { return op == OP_RETR || op == OP_SIZE || op == OP_MDTM; }) != config.ops.end();
+		if (needsFile && config.uploadFile)
+		{
+			bool prepared = false;
+			asio::co_spawn(io, prepare(io, config, endpoint, prepared), asio::detached);
+			io.run();
+			io.restart();
+			if (!prepared)
+				return false;
+		}
+
+		HANDLE serverProcess = serverPid ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, serverPid) : 0;
+		double clientCpuStart = cpuSeconds(GetCurrentProcess());
+		double serverCpuStart = cpuSeconds(serverProcess);
+
+		std::cout << "ftpbench: " << config.sessions << " sessions on " << config.threads << " threads, " << config.duration << " s against "
+			<< endpoint << std::endl;
+		std::vector<BenchResults> sessionResults(config.sessions);
+		Clock::time_point start = Clock::now();
+		Clock::time_point deadline = start + std::chrono::seconds(config.duration);
+		for (unsigned int i = 0; i < config.sessions; ++i)
+			asio::co_spawn(io, runSession(io, config, endpoint, i, deadline, sessionResults[i]), asio::detached);
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < config.threads; ++i)
+			threads.emplace_back([&io]() { io.run(); });
+		for (std::thread& thread : threads)
+			thread.join();
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+		double clientCpu = cpuSeconds(GetCurrentProcess()) - clientCpuStart;
+		double serverCpu = serverProcess ? cpuSeconds(serverProcess) - serverCpuStart : -1;
+		if (serverProcess)
+			CloseHandle(serverProcess);
+
+		BenchResults results;
+		for (const BenchResults& session : sessionResults)
+			results.merge(session);
+
+		printf("%-6s %10s %8s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "p50 us", "p99 us", "p999 us");
+		for (int op = 0; op < OP_COUNT; ++op)
+		{
+			std::vector<uint32_t>& latencies = results.latencies[op];
+			if (latencies.empty() && !results.errors[op])
+				continue;
+			std::sort(latencies.begin(), latencies.end());
+			printf("%-6s %10llu %8llu %10.1f %10u %10u %10u\n", OP_NAMES[op], (unsigned long long)latencies.size(), (unsigned long long)results.errors[op],
+				latencies.size() / elapsed, percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999));
+		}
+		double gigabytes = (results.bytesDown + results.bytesUp) / (1024.0 * 1024.0 * 1024.0);
+		printf("download %.1f MB/s, upload %.1f MB/s\n", results.bytesDown / elapsed / (1024 * 1024), results.bytesUp / elapsed / (1024 * 1024));
+		printCpu("client", clientCpu, gigabytes);
+		printCpu("server", serverCpu, gigabytes);
+		if (serverCpu >= 0 && gigabytes > 0)
+			serverSecondsPerGigabyte = serverCpu / gigabytes;
+		return true;
+	}
+
+	/// Opens config.idleSessions logged-in control connections, leaves them idle for the duration and reports
+	/// what they cost the server's memory. The server's --idle-timeout has to be longer than the run.
+	bool runIdleSessions(const BenchConfig& config)
+	{
+		asio::io_context io;
+		asio::error_code ec;
+		asio::ip::tcp::resolver resolver(io);
+		asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(config.host, config.port, ec);
+		if (ec || endpoints.empty())
+		{
+			std::cout << "ftpbench: can't resolve " << config.host << ":" << config.port << std::endl;
+			return false;
+		}
+		asio::ip::tcp::endpoint endpoint = endpoints.begin()->endpoint();
+
+		HANDLE serverProcess = config.serverPid ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, config.serverPid) : 0;
+		MemoryUsage before, idle;
+		bool haveMemory = memoryUsage(serverProcess, before);
+
+		std::cout << "ftpbench: opening " << config.idleSessions << " idle sessions against " << endpoint << std::endl;
+		std::vector<std::shared_ptr<BenchClient> > clients(config.idleSessions);
+		size_t next = 0;
+		size_t opened = 0;
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < std::min(IDLE_OPENERS, config.idleSessions); ++i)
+			asio::co_spawn(io, openIdleSessions(io, config, endpoint, clients, next, opened), asio::detached);
+		io.run();
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		printf("%llu sessions logged in, %llu failed, in %.1f s; idle for %u s\n", (unsigned long long)opened,
+			(unsigned long long)(config.idleSessions - opened), elapsed, config.duration);
+
+		std::this_thread::sleep_for(std::chrono::seconds(config.duration));
+		haveMemory = haveMemory && memoryUsage(serverProcess, idle);
+		if (serverProcess)
+			CloseHandle(serverProcess);
+		if (haveMemory && opened)
+		{
+			printMemory("working set", before.workingSet, idle.workingSet, opened);
+			printMemory("private bytes", before.privateBytes, idle.privateBytes, opened);
+		}
+		return opened == config.idleSessions;
+	}
+
+	void printUsage(const char* argv0)
+	{
+		std::cout << "Usage: " << argv0 << " [--host <Address>] [--port <Port>] [--user <Name>] [--password <Password>]"
+			<< " [--sessions <N>] [--threads <N>] [--duration <s>]"
+			<< " [--ops <retr,stor,list,size,mdtm,churn|mixed>] [--file <Name>] [--existing-file] [--size <KB>]"
+			<< " [--list-dir <Path>] [--server-pid <Pid>] [--compare-port <Port>] [--compare-pid <Pid>] [--idle-sessions <N>]" << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	BenchConfig config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--host") && i + 1 < argc)
+			config.host = argv[++i];
+		else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+			config.port = argv[++i];
+		else if (!strcmp(argv[i], "--user") && i + 1 < argc)
+			config.user = argv[++i];
+		else if (!strcmp(argv[i], "--password") && i + 1 < argc)
+			config.password = argv[++i];
+		else if (!strcmp(argv[i], "--sessions") && i + 1 < argc)
+			config.sessions = (unsigned int)std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			config.threads = (unsigned int)std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+			config.duration = (unsigned int)std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--ops") && i + 1 < argc)
+		{
+			if (!parseOps(argv[++i], config.ops))
+			{
+				printUsage(argv[0]);
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "--file") && i + 1 < argc)
+			config.file = argv[++i];
+		else if (!strcmp(argv[i], "--existing-file"))
+			config.uploadFile = false;
+		else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+			config.fileSize = (uint64_t)std::max(0, atoi(argv[++i])) * 1024;
+		else if (!strcmp(argv[i], "--list-dir") && i + 1 < argc)
+			config.listDirectory = argv[++i];
+		else if (!strcmp(argv[i], "--server-pid") && i + 1 < argc)
+			config.serverPid = (DWORD)strtoul(argv[++i], 0, 10);
+		else if (!strcmp(argv[i], "--compare-port") && i + 1 < argc)
+			config.comparePort = argv[++i];
+		else if (!strcmp(argv[i], "--compare-pid") && i + 1 < argc)
+			config.comparePid = (DWORD)strtoul(argv[++i], 0, 10);
+		else if (!strcmp(argv[i], "--idle-sessions") && i + 1 < argc)
+			config.idleSessions = (size_t)strtoul(argv[++i], 0, 10);
+		else
+		{
+			printUsage(argv[0]);
+			return -1;
+		}
+	}
+	if (config.ops.empty())
+		config.ops.push_back(OP_RETR);
+
+	if (config.idleSessions)
+		return runIdleSessions(config) ? 0 : -1;
+
+	double serverSecondsPerGigabyte = -1;
+	if (!runBenchmark(config, config.port, config.serverPid, serverSecondsPerGigabyte))
+		return -1;
+	if (config.comparePort.empty())
+		return 0;
+	double compareSecondsPerGigabyte = -1;
+	std::cout << std::endl;
+	if (!runBenchmark(config, config.comparePort, config.comparePid, compareSecondsPerGigabyte))
+		return -1;
+	if (serverSecondsPerGigabyte >= 0 && compareSecondsPerGigabyte >= 0)
+		printf("\nserver cpu per GB: %.3f s on port %s, %.3f s on port %s\n", serverSecondsPerGigabyte, config.port.c_str(),
+			compareSecondsPerGigabyte, config.comparePort.c_str());
+	return 0;
+}
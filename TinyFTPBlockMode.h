@@ -0,0 +1,61 @@
+#ifndef IK80_TINYFTPBLOCKMODE_H_
+#define IK80_TINYFTPBLOCKMODE_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+
+namespace TinyWinFTP
+{
+	/// RFC 959 block mode (MODE B): every block is a descriptor byte and a 16 bit big endian count, then
+	/// count bytes of data. The last block of a transfer carries BLOCK_EOF, which is what lets the data
+	/// connection stay open for the next one.
+	const size_t BLOCK_HEADER_SIZE = 3;
+	// largest multiple of 4K a count holds, keeps the file ranges of a download page aligned
+	const size_t BLOCK_DATA_SIZE = 61440;
+
+	const unsigned char BLOCK_EOR = 0x80;
+	const unsigned char BLOCK_EOF = 0x40;
+	const unsigned char BLOCK_SUSPECT = 0x20;
+	const unsigned char BLOCK_RESTART = 0x10;
+
+	/// Blocks size bytes take, at least one so an empty file still gets its EOF block.
+	inline uint64_t blockCount(uint64_t size)
+	{
+		return size ? (size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE : 1;
+	}
+
+	/// Header of the block with the given index of a size byte transfer.
+	inline void setBlockHeader(unsigned char* header, uint64_t size, uint64_t block)
+	{
+		uint64_t offset = block * BLOCK_DATA_SIZE;
+		size_t count = (size_t)std::min<uint64_t>(BLOCK_DATA_SIZE, size - offset);
+		header[0] = block + 1 == blockCount(size) ? BLOCK_EOF : 0;
+		header[1] = (unsigned char)(count >> 8);
+		header[2] = (unsigned char)count;
+	}
+
+	inline size_t blockLength(const unsigned char* header)
+	{
+		return ((size_t)header[1] << 8) | header[2];
+	}
+
+	/// Appends size bytes of data as blocks, for listings and other replies built in memory. Without eof the
+	/// last block isn't marked, more of the same transfer follows.
+	inline void appendBlocks(const char* data, size_t size, std::string& out, bool eof = true)
+	{
+		uint64_t blocks = blockCount(size);
+		for (uint64_t block = 0; block < blocks; ++block)
+		{
+			unsigned char header[BLOCK_HEADER_SIZE];
+			setBlockHeader(header, size, block);
+			if (!eof)
+				header[0] = 0;
+			out.append(reinterpret_cast<const char*>(header), BLOCK_HEADER_SIZE);
+			out.append(data + block * BLOCK_DATA_SIZE, blockLength(header));
+		}
+	}
+}
+
+#endif // IK80_TINYFTPBLOCKMODE_H_
@@ -0,0 +1,69 @@
+#include <chrono>
+
+#include <asio/post.hpp>
+
+#include "TinyFTPBlockingPool.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		uint64_t microsSince(std::chrono::steady_clock::time_point start)
+		{
+			return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	const char* blockingOpName(TinyFTPBlockingOp op)
+	{
+		static const char* NAMES[BLOCKING_OP_COUNT] = { "stat", "list", "delete", "mkdir", "rmdir", "rename", "open" };
+		return op < BLOCKING_OP_COUNT ? NAMES[op] : "?";
+	}
+
+	TinyFTPBlockingPool::TinyFTPBlockingPool(size_t threads)
+		: pool(threads ? threads : 1)
+	{
+	}
+
+	void TinyFTPBlockingPool::post(TinyFTPBlockingOp op, std::function<void()> work)
+	{
+		Counters& opCounters = counters[op];
+		++opCounters.queued;
+		std::chrono::steady_clock::time_point queuedAt = std::chrono::steady_clock::now();
+		asio::post(pool, [&opCounters, queuedAt, work]()
+		{
+			--opCounters.queued;
+			opCounters.waitMicros += microsSince(queuedAt);
+			std::chrono::steady_clock::time_point startedAt = std::chrono::steady_clock::now();
+			work();
+			uint64_t runMicros = microsSince(startedAt);
+			opCounters.runMicros += runMicros;
+			uint64_t maxRunMicros = opCounters.maxRunMicros;
+			while (runMicros > maxRunMicros && !opCounters.maxRunMicros.compare_exchange_weak(maxRunMicros, runMicros))
+				;
+			++opCounters.completed;
+		});
+	}
+
+	void TinyFTPBlockingPool::stop()
+	{
+		pool.stop();
+	}
+
+	void TinyFTPBlockingPool::join()
+	{
+		pool.join();
+	}
+
+	TinyFTPBlockingPool::Stats TinyFTPBlockingPool::getStats(TinyFTPBlockingOp op)
+	{
+		Counters& opCounters = counters[op];
+		Stats stats;
+		stats.queued = opCounters.queued;
+		stats.completed = opCounters.completed;
+		stats.waitMicros = opCounters.waitMicros;
+		stats.runMicros = opCounters.runMicros;
+		stats.maxRunMicros = opCounters.maxRunMicros;
+		return stats;
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef IK80_TINYFTPBLOCKINGPOOL_H_
+#define IK80_TINYFTPBLOCKINGPOOL_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include <asio/thread_pool.hpp>
+
+namespace TinyWinFTP
+{
+	enum TinyFTPBlockingOp
+	{
+		BLOCKING_STAT,
+		BLOCKING_LIST,
+		BLOCKING_DELETE,
+		BLOCKING_MKDIR,
+		BLOCKING_RMDIR,
+		BLOCKING_RENAME,
+		BLOCKING_OPEN,
+		BLOCKING_OP_COUNT
+	};
+
+	const char* blockingOpName(TinyFTPBlockingOp op);
+
+	/// Filesystem metadata calls (stat, directory listings, delete, mkdir, rmdir, rename) take as long as the
+	/// storage behind them, and a slow share would hold up every session of an io thread. They run on these
+	/// threads instead; the session waits for the result like it waits for a transfer. Kept apart from the
+	/// worker pool so a burst of them can't queue behind compression or hashing, or the other way round.
+	class TinyFTPBlockingPool
+	{
+	public:
+		explicit TinyFTPBlockingPool(size_t threads);
+
+		void post(TinyFTPBlockingOp op, std::function<void()> work);
+
+		/// Finishes what is running, drops what is queued.
+		void stop();
+		void join();
+
+		struct Stats
+		{
+			// waiting for a thread right now
+			uint64_t queued;
+			uint64_t completed;
+			// sums over completed calls, microseconds
+			uint64_t waitMicros;
+			uint64_t runMicros;
+			uint64_t maxRunMicros;
+		};
+		Stats getStats(TinyFTPBlockingOp op);
+
+	private:
+		struct Counters
+		{
+			std::atomic<uint64_t> queued{ 0 };
+			std::atomic<uint64_t> completed{ 0 };
+			std::atomic<uint64_t> waitMicros{ 0 };
+			std::atomic<uint64_t> runMicros{ 0 };
+			std::atomic<uint64_t> maxRunMicros{ 0 };
+		};
+
+		asio::thread_pool pool;
+		Counters counters[BLOCKING_OP_COUNT];
+
+		TinyFTPBlockingPool(const TinyFTPBlockingPool& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPBLOCKINGPOOL_H_
@@ -0,0 +1,343 @@
+#include <iostream>
+#include <sstream>
+
+#include <asio/post.hpp>
+#include <asio/write.hpp>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include "TinyFTPCompression.h"
+
+namespace TinyWinFTP
+{
+	TinyFTPCompressor::TinyFTPCompressor(TinyFTPCompressionEngine in_engine, int level) : engine(in_engine), stream(0)
+	{
+		if (engine == COMPRESSION_ZSTD)
+		{
+			ZSTD_CCtx* cctx = ZSTD_createCCtx();
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+			stream = cctx;
+		}
+		else
+		{
+			z_stream* zs = new z_stream();
+			if (deflateInit(zs, level) != Z_OK)
+			{
+				delete zs;
+				zs = 0;
+			}
+			stream = zs;
+		}
+	}
+
+	TinyFTPCompressor::~TinyFTPCompressor()
+	{
+		if (!stream)
+			return;
+		if (engine == COMPRESSION_ZSTD)
+			ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(stream));
+		else
+		{
+			deflateEnd(static_cast<z_stream*>(stream));
+			delete static_cast<z_stream*>(stream);
+		}
+	}
+
+	bool TinyFTPCompressor::compress(const char* in, size_t len, bool finish, std::vector<char>& out)
+	{
+		if (!stream)
+			return false;
+
+		if (engine == COMPRESSION_ZSTD)
+		{
+			ZSTD_CCtx* cctx = static_cast<ZSTD_CCtx*>(stream);
+			ZSTD_inBuffer input = { in, len, 0 };
+			for (;;)
+			{
+				size_t outStart = out.size();
+				out.resize(outStart + ZSTD_CStreamOutSize());
+				ZSTD_outBuffer output = { out.data() + outStart, ZSTD_CStreamOutSize(), 0 };
+				size_t remaining = ZSTD_compressStream2(cctx, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+				out.resize(outStart + output.pos);
+				if (ZSTD_isError(remaining))
+					return false;
+				if (finish ? remaining == 0 : input.pos == input.size)
+					return true;
+			}
+		}
+
+		z_stream* zs = static_cast<z_stream*>(stream);
+		zs->next_in = (Bytef*)in;
+		zs->avail_in = (uInt)len;
+		for (;;)
+		{
+			size_t outStart = out.size();
+			size_t outChunk = deflateBound(zs, zs->avail_in) + 64;
+			out.resize(outStart + outChunk);
+			zs->next_out = (Bytef*)out.data() + outStart;
+			zs->avail_out = (uInt)outChunk;
+			int result = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+			out.resize(outStart + outChunk - zs->avail_out);
+			if (result == Z_STREAM_ERROR)
+				return false;
+			if (finish ? result == Z_STREAM_END : zs->avail_in == 0)
+				return true;
+		}
+	}
+
+	bool TinyFTPCompressor::compressAll(TinyFTPCompressionEngine engine, int level, const std::string& in, std::string& out)
+	{
+		TinyFTPCompressor compressor(engine, level);
+		std::vector<char> compressed;
+		if (!compressor.compress(in.data(), in.size(), true, compressed))
+			return false;
+		out.assign(compressed.begin(), compressed.end());
+		return true;
+	}
+
+	TinyFTPCompressionCache::TinyFTPCompressionCache(const std::string& in_cacheDir, unsigned int in_minHits)
+		: cacheDir(in_cacheDir), minHits(in_minHits), temporarySerial(0)
+	{
+		while (cacheDir.size() > 1 && (*cacheDir.rbegin() == '\\' || *cacheDir.rbegin() == '/'))
+			cacheDir = cacheDir.substr(0, cacheDir.size() - 1);
+		if (!cacheDir.empty())
+		{
+			CreateDirectoryA(cacheDir.c_str(), 0);
+			std::cout << "Compression cache in " << cacheDir << ", files cached after " << minHits << " requests" << std::endl;
+		}
+	}
+
+	bool TinyFTPCompressionCache::lookup(const std::string& filename, TinyFTPCompressionEngine engine, int level, std::string& cachedFilename, bool& shouldStore)
+	{
+		shouldStore = false;
+		if (!isEnabled())
+			return false;
+
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes) || (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			return false;
+
+		// a changed file gets a new key, stale copies are simply never looked up again
+		std::ostringstream key;
+		key << filename << '|' << attributes.nFileSizeHigh << ':' << attributes.nFileSizeLow
+			<< '|' << attributes.ftLastWriteTime.dwHighDateTime << ':' << attributes.ftLastWriteTime.dwLowDateTime
+			<< '|' << engine << '|' << level;
+		std::string keyString = key.str();
+
+		char nameBuf[64];
+		snprintf(nameBuf, sizeof(nameBuf), "\\%016llx.%s", (unsigned long long)std::hash<std::string>()(keyString), engine == COMPRESSION_ZSTD ? "zst" : "z");
+		cachedFilename = cacheDir + nameBuf;
+
+		if (GetFileAttributesA(cachedFilename.c_str()) != INVALID_FILE_ATTRIBUTES)
+			return true;
+
+		std::lock_guard<std::mutex> hitsGuard(hitsMutex);
+		if (hits.size() >= MAX_TRACKED_FILES)
+			hits.clear();
+		unsigned int& fileHits = hits[keyString];
+		++fileHits;
+		if (fileHits >= minHits)
+		{
+			// whoever crosses the threshold stores it, others keep compressing on the fly meanwhile
+			shouldStore = (fileHits == minHits);
+		}
+		return false;
+	}
+
+	std::string TinyFTPCompressionCache::temporaryName(const std::string& cachedFilename)
+	{
+		std::lock_guard<std::mutex> hitsGuard(hitsMutex);
+		return cachedFilename + ".tmp" + std::to_string(++temporarySerial);
+	}
+
+	void TinyFTPCompressionCache::commit(const std::string& temporaryFilename, const std::string& cachedFilename, bool success)
+	{
+		if (!success || !MoveFileExA(temporaryFilename.c_str(), cachedFilename.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			DeleteFileA(temporaryFilename.c_str());
+			return;
+		}
+		std::cout << "Compression cache: stored " << cachedFilename << std::endl;
+	}
+
+	TinyFTPCompressedSender::TinyFTPCompressedSender(asio::io_context& io_context, asio::thread_pool& in_workerPool, std::shared_ptr<TinyFTPStream> in_dataSocket,
+		TinyFTPCompressionEngine engine, int level, std::function<void(bool)> in_onComplete)
+		: service(io_context),
+		workerPool(in_workerPool),
+		dataSocket(in_dataSocket),
+		compressor(engine, level),
+		onComplete(in_onComplete),
+		sourceFile(INVALID_HANDLE_VALUE),
+		cacheFile(INVALID_HANDLE_VALUE),
+		cache(0),
+		cacheFailed(false),
+		readBuffer(CHUNK_SIZE),
+		producing(false),
+		writing(false),
+		lastChunkWritten(false),
+		completed(false),
+		completedOk(false),
+		pendingEndOfFile(false)
+	{
+		spareChunks.reserve(3);
+	}
+
+	TinyFTPCompressedSender::~TinyFTPCompressedSender()
+	{
+		if (sourceFile != INVALID_HANDLE_VALUE)
+			CloseHandle(sourceFile);
+		if (cacheFile != INVALID_HANDLE_VALUE)
+			CloseHandle(cacheFile);
+	}
+
+	bool TinyFTPCompressedSender::start(const std::string& filename, TinyFTPCompressionCache* in_cache, const std::string& in_cachedFilename)
+	{
+		sourceFile = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		if (sourceFile == INVALID_HANDLE_VALUE)
+			return false;
+		if (in_cache && !in_cachedFilename.empty())
+		{
+			cache = in_cache;
+			cachedFilename = in_cachedFilename;
+			temporaryFilename = cache->temporaryName(cachedFilename);
+			cacheFile = ::CreateFileA(temporaryFilename.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			cacheFailed = (cacheFile == INVALID_HANDLE_VALUE);
+		}
+		produce();
+		return true;
+	}
+
+	void TinyFTPCompressedSender::produce()
+	{
+		producing = true;
+		std::shared_ptr<TinyFTPCompressedSender> self = shared_from_this();
+		std::shared_ptr<std::vector<char> > chunk;
+		if (spareChunks.empty())
+			chunk = std::make_shared<std::vector<char> >();
+		else
+		{
+			chunk = std::move(spareChunks.back());
+			spareChunks.pop_back();
+			chunk->clear();
+		}
+		asio::post(workerPool, [self, chunk]()
+		{
+			DWORD bytesRead = 0;
+			bool ok = ::ReadFile(self->sourceFile, self->readBuffer.data(), (DWORD)self->readBuffer.size(), &bytesRead, 0) != FALSE;
+			bool endOfFile = ok && bytesRead == 0;
+			if (ok)
+				ok = self->compressor.compress(self->readBuffer.data(), bytesRead, endOfFile, *chunk);
+			if (ok && self->cacheFile != INVALID_HANDLE_VALUE && !chunk->empty())
+			{
+				DWORD bytesWritten = 0;
+				if (!::WriteFile(self->cacheFile, chunk->data(), (DWORD)chunk->size(), &bytesWritten, 0) || bytesWritten != chunk->size())
+				{
+					CloseHandle(self->cacheFile);
+					self->cacheFile = INVALID_HANDLE_VALUE;
+					self->cacheFailed = true;
+				}
+			}
+			asio::post(self->service, [self, chunk, endOfFile, ok]()
+			{
+				self->onProduced(chunk, endOfFile, ok);
+			});
+		});
+	}
+
+	void TinyFTPCompressedSender::onProduced(std::shared_ptr<std::vector<char> > chunk, bool endOfFile, bool ok)
+	{
+		producing = false;
+		// the transfer ended while this chunk was compressed, the data connection may be gone;
+		// the worker is done with the cache file now, so finish it here
+		if (completed)
+		{
+			finishCache();
+			return;
+		}
+		if (!ok)
+		{
+			std::cout << "Data channel: compression: read or compress failed" << std::endl;
+			// with a write in flight onWritten sees nothing produced and gives up
+			if (!writing)
+				complete(false);
+			return;
+		}
+
+		if (!writing)
+		{
+			startWrite(chunk, endOfFile);
+			if (!endOfFile)
+				produce();
+		}
+		else
+		{
+			// socket is busy, park it and let the next write completion pick it up
+			pendingChunk = chunk;
+			pendingEndOfFile = endOfFile;
+		}
+	}
+
+	void TinyFTPCompressedSender::startWrite(std::shared_ptr<std::vector<char> > chunk, bool endOfFile)
+	{
+		writing = true;
+		std::shared_ptr<TinyFTPCompressedSender> self = shared_from_this();
+		asio::async_write(*dataSocket, asio::buffer(chunk->data(), chunk->size()), [self, chunk, endOfFile](const asio::error_code& e, std::size_t)
+		{
+			if (endOfFile)
+				self->lastChunkWritten = true;
+			self->spareChunks.push_back(chunk);
+			self->onWritten(e);
+		});
+	}
+
+	void TinyFTPCompressedSender::onWritten(const asio::error_code& e)
+	{
+		writing = false;
+		if (completed)
+			return;
+		if (e)
+		{
+			std::cout << "Data channel: compression: write error" << std::endl;
+			complete(false);
+			return;
+		}
+
+		if (pendingChunk)
+		{
+			std::shared_ptr<std::vector<char> > chunk = pendingChunk;
+			pendingChunk.reset();
+			startWrite(chunk, pendingEndOfFile);
+			if (!pendingEndOfFile)
+				produce();
+		}
+		else if (lastChunkWritten)
+			complete(true);
+		else if (!producing)
+			complete(false); // producer gave up while we were writing
+	}
+
+	void TinyFTPCompressedSender::complete(bool ok)
+	{
+		if (completed)
+			return;
+		completed = true;
+		completedOk = ok;
+		// a worker job may still be writing the cache file, onProduced finishes it then
+		if (!producing)
+			finishCache();
+		onComplete(ok);
+	}
+
+	void TinyFTPCompressedSender::finishCache()
+	{
+		if (cacheFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(cacheFile);
+			cacheFile = INVALID_HANDLE_VALUE;
+		}
+		if (cache)
+			cache->commit(temporaryFilename, cachedFilename, completedOk && !cacheFailed);
+		cache = 0;
+	}
+}
@@ -0,0 +1,131 @@
+#ifndef IK80_TINYFTPCOMPRESSION_H_
+#define IK80_TINYFTPCOMPRESSION_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/thread_pool.hpp>
+
+#include "TinyFTPStream.h"
+
+namespace TinyWinFTP
+{
+	enum TinyFTPCompressionEngine
+	{
+		COMPRESSION_DEFLATE = 0, // MODE Z proper, zlib stream
+		COMPRESSION_ZSTD         // OPTS MODE Z ENGINE ZSTD
+	};
+
+	/// Streaming compressor for MODE Z, one per transfer.
+	class TinyFTPCompressor
+	{
+	public:
+		TinyFTPCompressor(TinyFTPCompressionEngine engine, int level);
+		~TinyFTPCompressor();
+
+		/// Compresses len bytes and appends whatever comes out to out, finish ends the stream.
+		bool compress(const char* in, size_t len, bool finish, std::vector<char>& out);
+
+		/// One shot compression for small payloads like listings.
+		static bool compressAll(TinyFTPCompressionEngine engine, int level, const std::string& in, std::string& out);
+
+	private:
+		TinyFTPCompressionEngine engine;
+		void* stream;
+
+		TinyFTPCompressor(const TinyFTPCompressor& other) = delete;
+		TinyFTPCompressor(TinyFTPCompressor&& other) = delete;
+	};
+
+	/// Precompressed copies of frequently downloaded files, keyed by path, size, mtime, engine and level.
+	class TinyFTPCompressionCache
+	{
+	public:
+		/// Empty directory disables the cache.
+		TinyFTPCompressionCache(const std::string& cacheDir, unsigned int minHits);
+
+		bool isEnabled() const
+		{
+			return !cacheDir.empty();
+		}
+
+		/// Counts a request for filename. Returns true and the cached copy if there is one,
+		/// otherwise tells whether the file is popular enough for the transfer to store a copy.
+		bool lookup(const std::string& filename, TinyFTPCompressionEngine engine, int level, std::string& cachedFilename, bool& shouldStore);
+
+		/// Temporary name to compress into, commit() moves it in place once the transfer is done.
+		std::string temporaryName(const std::string& cachedFilename);
+		void commit(const std::string& temporaryFilename, const std::string& cachedFilename, bool success);
+
+	private:
+		static const size_t MAX_TRACKED_FILES = 65536;
+
+		std::string cacheDir;
+		unsigned int minHits;
+
+		std::mutex hitsMutex;
+		std::unordered_map<std::string, unsigned int> hits;
+		unsigned int temporarySerial;
+	};
+
+	/// Streams a file through a compressor on the worker pool into the data socket.
+	/// At most one chunk is being compressed while one is written, so a slow client throttles the workers.
+	class TinyFTPCompressedSender
+		: public std::enable_shared_from_this<TinyFTPCompressedSender>
+	{
+	public:
+		static const size_t CHUNK_SIZE = 256 * 1024;
+
+		TinyFTPCompressedSender(asio::io_context& io_context, asio::thread_pool& workerPool, std::shared_ptr<TinyFTPStream> dataSocket,
+			TinyFTPCompressionEngine engine, int level, std::function<void(bool)> onComplete);
+		~TinyFTPCompressedSender();
+
+		/// Opens filename and starts streaming. With a cache, a copy of the compressed stream
+		/// is written next to it and committed as cachedFilename if the whole transfer succeeds.
+		bool start(const std::string& filename, TinyFTPCompressionCache* cache, const std::string& cachedFilename);
+
+	private:
+		void produce();
+		void onProduced(std::shared_ptr<std::vector<char> > chunk, bool endOfFile, bool ok);
+		void startWrite(std::shared_ptr<std::vector<char> > chunk, bool endOfFile);
+		void onWritten(const asio::error_code& e);
+		void complete(bool ok);
+		void finishCache();
+
+		asio::io_context& service;
+		asio::thread_pool& workerPool;
+		// shared, the session drops its data connection when the transfer fails while a chunk is still being compressed
+		std::shared_ptr<TinyFTPStream> dataSocket;
+		TinyFTPCompressor compressor;
+		std::function<void(bool)> onComplete;
+
+		// only touched by the worker job, one job at a time; the cache file is closed and committed
+		// on the io thread once no job is in flight
+		HANDLE sourceFile;
+		HANDLE cacheFile;
+		TinyFTPCompressionCache* cache;
+		std::string cachedFilename;
+		std::string temporaryFilename;
+		bool cacheFailed;
+		std::vector<char> readBuffer;
+
+		// only touched on the io thread
+		bool producing;
+		bool writing;
+		bool lastChunkWritten;
+		bool completed;
+		bool completedOk;
+		std::shared_ptr<std::vector<char> > pendingChunk;
+		bool pendingEndOfFile;
+		// written chunks, produce() refills them; one compressing, one parked and one on the wire at most
+		std::vector<std::shared_ptr<std::vector<char> > > spareChunks;
+	};
+}
+
+#endif // IK80_TINYFTPCOMPRESSION_H_
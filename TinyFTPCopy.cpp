@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <iostream>
+
+#include <asio/post.hpp>
+
+#include <winioctl.h>
+
+#include "TinyFTPCopy.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		// one FSCTL_DUPLICATE_EXTENTS_TO_FILE call must stay below 4 GB, progress is reported between calls
+		const uint64_t CLONE_CHUNK_SIZE = 1024ull * 1024 * 1024;
+
+		struct ProgressContext
+		{
+			TinyFTPCopyProgress* onProgress;
+			ULONGLONG lastReport;
+		};
+
+		DWORD CALLBACK copyProgressRoutine(LARGE_INTEGER totalFileSize, LARGE_INTEGER totalBytesTransferred, LARGE_INTEGER, LARGE_INTEGER,
+			DWORD, DWORD, HANDLE, HANDLE, LPVOID data)
+		{
+			ProgressContext* context = (ProgressContext*)data;
+			ULONGLONG now = GetTickCount64();
+			if (now - context->lastReport < PROGRESS_INTERVAL_MS)
+				return PROGRESS_CONTINUE;
+			context->lastReport = now;
+			return (*context->onProgress)(totalBytesTransferred.QuadPart, totalFileSize.QuadPart) ? PROGRESS_CONTINUE : PROGRESS_CANCEL;
+		}
+
+		// false when the volume can't clone, the caller falls back to a real copy then
+		bool cloneFile(const std::string& fromFilename, const std::string& toFilename, TinyFTPCopyProgress& onProgress, bool& cancelled)
+		{
+			HANDLE source = ::CreateFileA(fromFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			if (source == INVALID_HANDLE_VALUE)
+				return false;
+
+			DWORD volumeFlags = 0;
+			FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+			DWORD bytesReturned = 0;
+			LARGE_INTEGER fileSize;
+			if (!GetVolumeInformationByHandleW(source, 0, 0, 0, 0, &volumeFlags, 0, 0) || !(volumeFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING)
+				|| !DeviceIoControl(source, FSCTL_GET_INTEGRITY_INFORMATION, 0, 0, &integrity, sizeof(integrity), &bytesReturned, 0)
+				|| !GetFileSizeEx(source, &fileSize))
+			{
+				CloseHandle(source);
+				return false;
+			}
+
+			HANDLE target = ::CreateFileA(toFilename.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+			if (target == INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(source);
+				return false;
+			}
+
+			// cloned ranges have to lie inside the target and be cluster aligned, the last one may run past EOF
+			FILE_END_OF_FILE_INFO endOfFile;
+			endOfFile.EndOfFile = fileSize;
+			bool ok = SetFileInformationByHandle(target, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)) != FALSE;
+
+			uint64_t clusterSize = integrity.ClusterSizeInBytes;
+			uint64_t totalBytes = fileSize.QuadPart;
+			ULONGLONG lastReport = GetTickCount64();
+			for (uint64_t offset = 0; ok && offset < totalBytes; offset += CLONE_CHUNK_SIZE)
+			{
+				uint64_t chunkBytes = std::min(CLONE_CHUNK_SIZE, totalBytes - offset);
+				chunkBytes = (chunkBytes + clusterSize - 1) / clusterSize * clusterSize;
+
+				DUPLICATE_EXTENTS_DATA duplicateExtents;
+				duplicateExtents.FileHandle = source;
+				duplicateExtents.SourceFileOffset.QuadPart = offset;
+				duplicateExtents.TargetFileOffset.QuadPart = offset;
+				duplicateExtents.ByteCount.QuadPart = chunkBytes;
+				ok = DeviceIoControl(target, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &duplicateExtents, sizeof(duplicateExtents), 0, 0, &bytesReturned, 0) != FALSE;
+
+				ULONGLONG now = GetTickCount64();
+				if (ok && now - lastReport >= PROGRESS_INTERVAL_MS)
+				{
+					lastReport = now;
+					if (!onProgress(std::min(offset + chunkBytes, totalBytes), totalBytes))
+					{
+						cancelled = true;
+						ok = false;
+					}
+				}
+			}
+
+			if (!ok)
+			{
+				// half cloned target goes away with the handle
+				FILE_DISPOSITION_INFO disposition;
+				disposition.DeleteFile = TRUE;
+				SetFileInformationByHandle(target, FileDispositionInfo, &disposition, sizeof(disposition));
+			}
+			CloseHandle(target);
+			CloseHandle(source);
+			return ok;
+		}
+	}
+
+	void copyFileAsync(asio::thread_pool& pool, const std::string& fromFilename, const std::string& toFilename,
+		TinyFTPCopyProgress onProgress, TinyFTPCopyDone onDone)
+	{
+		asio::post(pool, [fromFilename, toFilename, onProgress, onDone]() mutable
+		{
+			bool cancelled = false;
+			if (cloneFile(fromFilename, toFilename, onProgress, cancelled))
+			{
+				std::cout << "Copy: cloned " << fromFilename << " to " << toFilename << std::endl;
+				onDone(true, true);
+				return;
+			}
+			if (cancelled)
+			{
+				onDone(false, false);
+				return;
+			}
+
+			ProgressContext context = { &onProgress, GetTickCount64() };
+			BOOL cancel = FALSE;
+			bool ok = CopyFileExA(fromFilename.c_str(), toFilename.c_str(), copyProgressRoutine, &context, &cancel, COPY_FILE_FAIL_IF_EXISTS) != FALSE;
+			std::cout << "Copy: " << fromFilename << " to " << toFilename << (ok ? " done" : " failed") << std::endl;
+			onDone(ok, false);
+		});
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef IK80_TINYFTPCOPY_H_
+#define IK80_TINYFTPCOPY_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include <asio/thread_pool.hpp>
+
+namespace TinyWinFTP
+{
+	/// Called from the worker every PROGRESS_INTERVAL_MS while a copy runs, returning false cancels it.
+	typedef std::function<bool(uint64_t copiedBytes, uint64_t totalBytes)> TinyFTPCopyProgress;
+	/// cloned tells whether the copy shares extents with the source instead of holding its own data.
+	typedef std::function<void(bool ok, bool cloned)> TinyFTPCopyDone;
+
+	const unsigned int PROGRESS_INTERVAL_MS = 1000;
+
+	/// Copies a file on the worker pool without moving the data through the client, the target must not exist yet.
+	/// On volumes with block refcounting (ReFS) the target is a block clone of the source, only metadata is written.
+	/// Everywhere else CopyFileEx does the copy, which offloads it to the storage (ODX) where that is available.
+	void copyFileAsync(asio::thread_pool& pool, const std::string& fromFilename, const std::string& toFilename,
+		TinyFTPCopyProgress onProgress, TinyFTPCopyDone onDone);
+}
+
+#endif // IK80_TINYFTPCOPY_H_
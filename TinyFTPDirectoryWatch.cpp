@@ -0,0 +1,96 @@
+#include <iostream>
+#include <vector>
+
+#include "TinyFTPDirectoryWatch.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const DWORD NOTIFY_BUFFER_SIZE = 64 * 1024;
+	}
+
+	TinyFTPDirectoryWatch::TinyFTPDirectoryWatch(const std::string& in_root, std::function<void(const std::string& path)> in_onChange,
+		std::function<void()> in_onLost, std::function<void()> in_onFailed)
+		: root(in_root),
+		onChange(in_onChange),
+		onLost(in_onLost),
+		onFailed(in_onFailed),
+		watchedDirectory(INVALID_HANDLE_VALUE),
+		stopEvent(0)
+	{
+	}
+
+	TinyFTPDirectoryWatch::~TinyFTPDirectoryWatch()
+	{
+		if (watcher.joinable())
+		{
+			SetEvent(stopEvent);
+			watcher.join();
+		}
+		if (watchedDirectory != INVALID_HANDLE_VALUE)
+			CloseHandle(watchedDirectory);
+		if (stopEvent)
+			CloseHandle(stopEvent);
+	}
+
+	bool TinyFTPDirectoryWatch::start()
+	{
+		watchedDirectory = CreateFileA(root.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+		stopEvent = CreateEventA(0, TRUE, FALSE, 0);
+		if (watchedDirectory == INVALID_HANDLE_VALUE || !stopEvent)
+		{
+			std::cout << "Can't watch " << root << ", error " << GetLastError() << std::endl;
+			return false;
+		}
+		watcher = std::thread([this] { watch(); });
+		return true;
+	}
+
+	void TinyFTPDirectoryWatch::watch()
+	{
+		std::vector<DWORD> buffer(NOTIFY_BUFFER_SIZE / sizeof(DWORD));
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = CreateEventA(0, TRUE, FALSE, 0);
+		HANDLE events[2] = { overlapped.hEvent, stopEvent };
+		for (;;)
+		{
+			ResetEvent(overlapped.hEvent);
+			if (!ReadDirectoryChangesW(watchedDirectory, buffer.data(), NOTIFY_BUFFER_SIZE, TRUE,
+				FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, 0, &overlapped, 0))
+			{
+				std::cout << "Watch on " << root << " failed, error " << GetLastError() << std::endl;
+				onFailed();
+				break;
+			}
+			DWORD bytes = 0;
+			if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0)
+			{
+				CancelIoEx(watchedDirectory, &overlapped);
+				GetOverlappedResult(watchedDirectory, &overlapped, &bytes, TRUE);
+				break;
+			}
+			if (!GetOverlappedResult(watchedDirectory, &overlapped, &bytes, FALSE) || !bytes)
+			{
+				// more changes than the buffer holds, no telling which files they were
+				onLost();
+				continue;
+			}
+
+			const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer.data());
+			for (;;)
+			{
+				// paths are ANSI everywhere else in the server
+				int nameLength = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(WCHAR), 0, 0, 0, 0);
+				std::string name(nameLength, 0);
+				WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(WCHAR), &name[0], nameLength, 0, 0);
+				onChange(root + "\\" + name);
+				if (!info->NextEntryOffset)
+					break;
+				info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const char*>(info) + info->NextEntryOffset);
+			}
+		}
+		CloseHandle(overlapped.hEvent);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef IK80_TINYFTPDIRECTORYWATCH_H_
+#define IK80_TINYFTPDIRECTORYWATCH_H_
+
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace TinyWinFTP
+{
+	/// ReadDirectoryChangesW on a tree, on a thread of its own: names, sizes and write times of everything below
+	/// root. Tells what changed by path, or that changes were lost when more came than its buffer holds.
+	class TinyFTPDirectoryWatch
+	{
+	public:
+		// all three are called on the watch thread; onFailed is the last call
+		TinyFTPDirectoryWatch(const std::string& root, std::function<void(const std::string& path)> onChange,
+			std::function<void()> onLost, std::function<void()> onFailed);
+		~TinyFTPDirectoryWatch();
+
+		/// False if root can't be watched.
+		bool start();
+
+	private:
+		void watch();
+
+		std::string root;
+		std::function<void(const std::string& path)> onChange;
+		std::function<void()> onLost;
+		std::function<void()> onFailed;
+
+		HANDLE watchedDirectory;
+		HANDLE stopEvent;
+		std::thread watcher;
+
+		TinyFTPDirectoryWatch(const TinyFTPDirectoryWatch& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPDIRECTORYWATCH_H_
@@ -0,0 +1,182 @@
+#include <iostream>
+#include <vector>
+
+#include <ctype.h>
+
+#include <asio/post.hpp>
+
+#include "TinyFTPFileCache.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char LONG_PATH_PREFIX[] = "\\\\?\\";
+
+		bool readSmallFile(const std::string& filename, uint64_t maxFileSize, std::string& content)
+		{
+			HANDLE file = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER size;
+			DWORD bytesRead = 0;
+			bool ok = GetFileSizeEx(file, &size) && (uint64_t)size.QuadPart <= maxFileSize;
+			if (ok)
+			{
+				content.resize((size_t)size.QuadPart);
+				ok = content.empty() || (ReadFile(file, &content[0], (DWORD)content.size(), &bytesRead, 0) && bytesRead == content.size());
+			}
+			CloseHandle(file);
+			return ok;
+		}
+	}
+
+	TinyFTPFileCache::TinyFTPFileCache(const std::string& in_root, uint64_t in_budgetBytes, uint64_t in_maxFileSize)
+		: root(in_root),
+		budgetBytes(in_budgetBytes),
+		maxFileSize(in_maxFileSize),
+		usedBytes(0),
+		generation(0),
+		hits(0),
+		misses(0)
+	{
+		if (!isEnabled())
+			return;
+		watch.reset(new TinyFTPDirectoryWatch(root, [this](const std::string& path)
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			invalidateKey(keyFor(path));
+		}, [this]()
+		{
+			invalidateAll();
+		}, [this]()
+		{
+			std::cout << "Small file cache: watch failed, cache off" << std::endl;
+			invalidateAll();
+			budgetBytes = 0;
+		}));
+		if (!watch->start())
+		{
+			// without notifications changes made outside the server would go unnoticed
+			std::cout << "Small file cache: can't watch " << root << ", cache off" << std::endl;
+			watch.reset();
+			budgetBytes = 0;
+			return;
+		}
+		std::cout << "Small file cache: " << budgetBytes << " bytes for files up to " << maxFileSize << " bytes" << std::endl;
+	}
+
+	TinyFTPFileCache::~TinyFTPFileCache()
+	{
+		// the watch thread calls back into the cache
+		watch.reset();
+	}
+
+	std::string TinyFTPFileCache::keyFor(const std::string& filename)
+	{
+		size_t begin = filename.compare(0, sizeof(LONG_PATH_PREFIX) - 1, LONG_PATH_PREFIX) ? 0 : sizeof(LONG_PATH_PREFIX) - 1;
+		std::string key(filename, begin);
+		for (char& c : key)
+			c = (char)tolower((unsigned char)c);
+		return key;
+	}
+
+	bool TinyFTPFileCache::lookup(const std::string& filename, std::shared_ptr<const std::string>& content)
+	{
+		std::string key = keyFor(filename);
+		std::lock_guard<std::mutex> guard(mutex);
+		std::map<std::string, Entry>::iterator it = entries.find(key);
+		if (it == entries.end())
+		{
+			++misses;
+			return false;
+		}
+		lru.splice(lru.begin(), lru, it->second.lruPosition);
+		content = it->second.content;
+		++hits;
+		return true;
+	}
+
+	void TinyFTPFileCache::fillAsync(asio::thread_pool& pool, const std::string& filename)
+	{
+		std::string key = keyFor(filename);
+		uint64_t fillGeneration;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			if (entries.count(key) || !filling.insert(key).second)
+				return;
+			fillGeneration = generation;
+		}
+		asio::post(pool, [this, filename, key, fillGeneration]()
+		{
+			fill(filename, key, fillGeneration);
+		});
+	}
+
+	void TinyFTPFileCache::fill(const std::string& filename, const std::string& key, uint64_t fillGeneration)
+	{
+		std::shared_ptr<std::string> content = std::make_shared<std::string>();
+		bool ok = readSmallFile(filename, maxFileSize, *content);
+
+		std::lock_guard<std::mutex> guard(mutex);
+		filling.erase(key);
+		// changed while we read it, what we have may be half old half new
+		if (!ok || fillGeneration != generation || entries.count(key) || content->size() > budgetBytes)
+			return;
+		while (usedBytes + content->size() > budgetBytes && !lru.empty())
+			erase(entries.find(lru.back()));
+		lru.push_front(key);
+		Entry& entry = entries[key];
+		entry.content = content;
+		entry.lruPosition = lru.begin();
+		usedBytes += content->size();
+	}
+
+	void TinyFTPFileCache::erase(std::map<std::string, Entry>::iterator it)
+	{
+		usedBytes -= it->second.content->size();
+		lru.erase(it->second.lruPosition);
+		entries.erase(it);
+	}
+
+	void TinyFTPFileCache::invalidate(const std::string& filename)
+	{
+		if (!isEnabled())
+			return;
+		std::lock_guard<std::mutex> guard(mutex);
+		invalidateKey(keyFor(filename));
+	}
+
+	void TinyFTPFileCache::invalidateKey(const std::string& key)
+	{
+		++generation;
+		std::map<std::string, Entry>::iterator it = entries.find(key);
+		if (it != entries.end())
+			erase(it);
+		// a directory, everything below sorts right after its prefix
+		std::string prefix = key + "\\";
+		it = entries.lower_bound(prefix);
+		while (it != entries.end() && !it->first.compare(0, prefix.size(), prefix))
+			erase(it++);
+	}
+
+	void TinyFTPFileCache::invalidateAll()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		++generation;
+		entries.clear();
+		lru.clear();
+		usedBytes = 0;
+	}
+
+	TinyFTPFileCache::Stats TinyFTPFileCache::getStats()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		Stats stats;
+		stats.hits = hits;
+		stats.misses = misses;
+		stats.files = entries.size();
+		stats.bytes = usedBytes;
+		return stats;
+	}
+}
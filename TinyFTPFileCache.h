@@ -0,0 +1,95 @@
+#ifndef IK80_TINYFTPFILECACHE_H_
+#define IK80_TINYFTPFILECACHE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <asio/thread_pool.hpp>
+
+#include "TinyFTPDirectoryWatch.h"
+
+namespace TinyWinFTP
+{
+	/// Contents of small files kept in memory, so a RETR of one is a lookup and a single write instead of
+	/// open, size, TransmitFile and close. Least recently used files go when the byte budget is full.
+	/// A miss is served from disk as usual and the file is read into the cache on the worker pool.
+	/// Entries are dropped on STOR, DELE, RNFR/RNTO and RMD through this server and on any change a
+	/// ReadDirectoryChangesW watch on docRoot reports, so edits made behind the server's back show up too.
+	class TinyFTPFileCache
+	{
+	public:
+		/// budgetBytes 0 disables the cache.
+		TinyFTPFileCache(const std::string& root, uint64_t budgetBytes, uint64_t maxFileSize);
+		~TinyFTPFileCache();
+
+		bool isEnabled() const
+		{
+			return budgetBytes != 0;
+		}
+
+		uint64_t getMaxFileSize() const
+		{
+			return maxFileSize;
+		}
+
+		/// Content of filename if it is cached.
+		bool lookup(const std::string& filename, std::shared_ptr<const std::string>& content);
+		/// Reads filename into the cache on the worker pool unless it is already on its way.
+		void fillAsync(asio::thread_pool& pool, const std::string& filename);
+		/// Drops filename and, when it is a directory, everything below it.
+		void invalidate(const std::string& filename);
+
+		struct Stats
+		{
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t files;
+			uint64_t bytes;
+		};
+		Stats getStats();
+
+	private:
+		struct Entry
+		{
+			std::shared_ptr<const std::string> content;
+			std::list<std::string>::iterator lruPosition;
+		};
+
+		// lower case, without \\?\, like the filesystem compares names
+		static std::string keyFor(const std::string& filename);
+		void fill(const std::string& filename, const std::string& key, uint64_t generation);
+		// caller holds mutex
+		void erase(std::map<std::string, Entry>::iterator it);
+		void invalidateKey(const std::string& key);
+		void invalidateAll();
+
+		std::string root;
+		// dropped to 0 by the watcher if notifications stop working
+		std::atomic<uint64_t> budgetBytes;
+		uint64_t maxFileSize;
+
+		std::mutex mutex;
+		std::map<std::string, Entry> entries;
+		std::list<std::string> lru;
+		std::set<std::string> filling;
+		uint64_t usedBytes;
+		// bumped by every invalidation, a fill that raced with one is thrown away
+		uint64_t generation;
+
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+
+		std::unique_ptr<TinyFTPDirectoryWatch> watch;
+
+		TinyFTPFileCache(const TinyFTPFileCache& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPFILECACHE_H_
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+
+#include <ctype.h>
+#include <string.h>
+
+#include "TinyFTPFileSystem.h"
+#include "TinyFTPServerConfig.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char LONG_PATH_PREFIX[] = "\\\\?\\";
+
+		uint64_t toTicks(const FILETIME& time)
+		{
+			return ((uint64_t)time.dwHighDateTime << 32) + time.dwLowDateTime;
+		}
+
+		bool isDotEntry(const char* name)
+		{
+			return !strcmp(name, ".") || !strcmp(name, "..");
+		}
+
+		bool readWholeFile(const std::string& filename, std::string& content)
+		{
+			HANDLE file = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER size;
+			bool ok = GetFileSizeEx(file, &size) != FALSE;
+			if (ok)
+			{
+				content.resize((size_t)size.QuadPart);
+				size_t offset = 0;
+				while (ok && offset < content.size())
+				{
+					DWORD bytesRead = 0;
+					DWORD bytesToRead = (DWORD)std::min<size_t>(content.size() - offset, 64 * 1024 * 1024);
+					ok = ReadFile(file, &content[offset], bytesToRead, &bytesRead, 0) && bytesRead;
+					offset += bytesRead;
+				}
+			}
+			CloseHandle(file);
+			return ok;
+		}
+	}
+
+	bool TinyFTPLocalFileSystem::stat(const std::string& path, TinyFTPFileInfo& info)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+			return false;
+		size_t slash = path.find_last_of('\\');
+		info.name = slash == std::string::npos ? path : path.substr(slash + 1);
+		info.isDirectory = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		info.readOnly = (attributes.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0;
+		info.isReparsePoint = (attributes.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+		info.size = ((uint64_t)attributes.nFileSizeHigh << 32) + attributes.nFileSizeLow;
+		info.lastWriteTime = toTicks(attributes.ftLastWriteTime);
+		return true;
+	}
+
+	bool TinyFTPLocalFileSystem::list(const std::string& directory, const std::string& pattern, std::vector<TinyFTPFileInfo>& entries)
+	{
+		// the filesystem filters by the pattern, no 8.3 names are fetched and directory entries come in big batches
+		WIN32_FIND_DATAA ffd;
+		HANDLE hFind = FindFirstFileExA((directory + "\\" + (pattern.empty() ? "*" : pattern)).c_str(), FindExInfoBasic, &ffd,
+			FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH);
+		if (INVALID_HANDLE_VALUE == hFind)
+			// nothing matching the pattern is an empty listing, not a missing directory
+			return !pattern.empty() && GetLastError() == ERROR_FILE_NOT_FOUND;
+		do
+		{
+			if (isDotEntry(ffd.cFileName))
+				continue;
+			// Windows matches the short names as well, *.htm would bring in .html files
+			if (!pattern.empty() && !matchesPattern(pattern, ffd.cFileName))
+				continue;
+			TinyFTPFileInfo info;
+			info.name = ffd.cFileName;
+			info.isDirectory = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			info.readOnly = (ffd.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0;
+			info.isReparsePoint = (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+			info.size = ((uint64_t)ffd.nFileSizeHigh << 32) + ffd.nFileSizeLow;
+			info.lastWriteTime = toTicks(ffd.ftLastWriteTime);
+			entries.push_back(std::move(info));
+		} while (FindNextFileA(hFind, &ffd) != 0);
+		FindClose(hFind);
+		return true;
+	}
+
+	bool TinyFTPLocalFileSystem::removeFile(const std::string& path)
+	{
+		return DeleteFileA(path.c_str()) != FALSE;
+	}
+
+	bool TinyFTPLocalFileSystem::makeDirectory(const std::string& path)
+	{
+		return CreateDirectoryA(path.c_str(), 0) != FALSE;
+	}
+
+	bool TinyFTPLocalFileSystem::removeDirectory(const std::string& path)
+	{
+		return RemoveDirectoryA(path.c_str()) != FALSE;
+	}
+
+	bool TinyFTPLocalFileSystem::rename(const std::string& fromPath, const std::string& toPath)
+	{
+		// what the CRT's rename does, minus the path conversion that breaks \\?\ names
+		return MoveFileExA(fromPath.c_str(), toPath.c_str(), MOVEFILE_COPY_ALLOWED) != FALSE;
+	}
+
+	bool TinyFTPLocalFileSystem::openRead(const std::string& path, asio::windows::random_access_handle& file, std::shared_ptr<const std::string>& content, uint64_t& size)
+	{
+		content.reset();
+		asio::error_code ec;
+		file.assign(::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
+		LARGE_INTEGER fileSize;
+		if (!file.is_open() || !GetFileSizeEx(file.native_handle(), &fileSize))
+		{
+			if (file.is_open())
+				file.close();
+			return false;
+		}
+		size = fileSize.QuadPart;
+		return true;
+	}
+
+	bool TinyFTPLocalFileSystem::openWrite(const std::string& path, size_t alignment, bool& unbuffered, asio::windows::random_access_handle& file, std::shared_ptr<std::string>& content)
+	{
+		content.reset();
+		asio::error_code ec;
+		if (unbuffered)
+		{
+			// bypass the cache, disk DMAs straight out of our buffers instead of copying them into the cache first
+			file.assign(::CreateFileA(path.c_str(), GENERIC_WRITE, 0, 0,
+				CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, 0), ec);
+			FILE_STORAGE_INFO storageInfo;
+			if (file.is_open() && GetFileInformationByHandleEx(file.native_handle(), FileStorageInfo, &storageInfo, sizeof(storageInfo))
+				&& storageInfo.LogicalBytesPerSector && storageInfo.LogicalBytesPerSector <= alignment && alignment % storageInfo.LogicalBytesPerSector == 0)
+				return true;
+			std::cout << "Data channel: filesystem rejects unbuffered writes, falling back to buffered" << std::endl;
+			if (file.is_open())
+				file.close();
+			unbuffered = false;
+		}
+		file.assign(::CreateFileA(path.c_str(), GENERIC_WRITE, 0, 0,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
+		return file.is_open();
+	}
+
+	void TinyFTPLocalFileSystem::finishWrite(const std::string& path, std::shared_ptr<std::string>& content, bool ok)
+	{
+		// the data is in the file already
+	}
+
+	TinyFTPMemoryFileSystem::TinyFTPMemoryFileSystem(const std::string& root)
+		: rootKey(keyFor(root))
+	{
+		Node& rootNode = nodes[rootKey];
+		rootNode.name = nameOf(root);
+		rootNode.isDirectory = true;
+		rootNode.lastWriteTime = now();
+		load(root, rootKey);
+		std::cout << "Memory filesystem: " << nodes.size() << " entries, " << totalBytes() << " bytes loaded from " << root << std::endl;
+	}
+
+	void TinyFTPMemoryFileSystem::load(const std::string& directory, const std::string& key)
+	{
+		WIN32_FIND_DATAA ffd;
+		HANDLE hFind = FindFirstFileA((directory + "\\*").c_str(), &ffd);
+		if (INVALID_HANDLE_VALUE == hFind)
+			return;
+		do
+		{
+			if (isDotEntry(ffd.cFileName))
+				continue;
+			std::string path = directory + "\\" + ffd.cFileName;
+			std::string childKey = keyFor(key + "\\" + ffd.cFileName);
+			Node node;
+			node.name = ffd.cFileName;
+			node.isDirectory = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			node.lastWriteTime = toTicks(ffd.ftLastWriteTime);
+			if (!node.isDirectory)
+			{
+				std::shared_ptr<std::string> content = std::make_shared<std::string>();
+				if (!readWholeFile(path, *content))
+				{
+					std::cout << "Memory filesystem: can't read " << path << ", skipped" << std::endl;
+					continue;
+				}
+				node.content = content;
+			}
+			nodes[childKey] = node;
+			if (node.isDirectory)
+				load(path, childKey);
+		} while (FindNextFileA(hFind, &ffd) != 0);
+		FindClose(hFind);
+	}
+
+	std::string TinyFTPMemoryFileSystem::keyFor(const std::string& path)
+	{
+		size_t begin = path.compare(0, sizeof(LONG_PATH_PREFIX) - 1, LONG_PATH_PREFIX) ? 0 : sizeof(LONG_PATH_PREFIX) - 1;
+		size_t end = path.size();
+		while (end > begin + 1 && path[end - 1] == '\\')
+			--end;
+		std::string key(path, begin, end - begin);
+		// NTFS semantics, names match case-insensitively
+		for (char& c : key)
+			c = (char)tolower((unsigned char)c);
+		return key;
+	}
+
+	std::string TinyFTPMemoryFileSystem::parentOf(const std::string& key)
+	{
+		size_t slash = key.find_last_of('\\');
+		return slash == std::string::npos ? std::string() : key.substr(0, slash);
+	}
+
+	std::string TinyFTPMemoryFileSystem::nameOf(const std::string& path)
+	{
+		size_t end = path.find_last_not_of('\\');
+		if (end == std::string::npos)
+			return std::string();
+		size_t slash = path.find_last_of('\\', end);
+		return path.substr(slash == std::string::npos ? 0 : slash + 1, end - (slash == std::string::npos ? 0 : slash + 1) + 1);
+	}
+
+	uint64_t TinyFTPMemoryFileSystem::now()
+	{
+		FILETIME time;
+		GetSystemTimeAsFileTime(&time);
+		return toTicks(time);
+	}
+
+	bool TinyFTPMemoryFileSystem::hasDirectory(const std::string& key)
+	{
+		std::map<std::string, Node>::const_iterator it = nodes.find(key);
+		return it != nodes.end() && it->second.isDirectory;
+	}
+
+	uint64_t TinyFTPMemoryFileSystem::totalBytes()
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		uint64_t total = 0;
+		for (const std::pair<const std::string, Node>& entry : nodes)
+			if (entry.second.content)
+				total += entry.second.content->size();
+		return total;
+	}
+
+	bool TinyFTPMemoryFileSystem::stat(const std::string& path, TinyFTPFileInfo& info)
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		std::map<std::string, Node>::const_iterator it = nodes.find(keyFor(path));
+		if (it == nodes.end())
+			return false;
+		info.name = it->second.name;
+		info.isDirectory = it->second.isDirectory;
+		info.readOnly = false;
+		info.size = it->second.content ? it->second.content->size() : 0;
+		info.lastWriteTime = it->second.lastWriteTime;
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::list(const std::string& directory, const std::string& pattern, std::vector<TinyFTPFileInfo>& entries)
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		std::string key = keyFor(directory);
+		if (!hasDirectory(key))
+			return false;
+		// children sort right after their parent's prefix, grandchildren are skipped
+		std::string prefix = key + "\\";
+		for (std::map<std::string, Node>::const_iterator it = nodes.lower_bound(prefix); it != nodes.end() && !it->first.compare(0, prefix.size(), prefix); ++it)
+		{
+			if (it->first.find('\\', prefix.size()) != std::string::npos)
+				continue;
+			if (!pattern.empty() && !matchesPattern(pattern, it->second.name))
+				continue;
+			TinyFTPFileInfo info;
+			info.name = it->second.name;
+			info.isDirectory = it->second.isDirectory;
+			info.size = it->second.content ? it->second.content->size() : 0;
+			info.lastWriteTime = it->second.lastWriteTime;
+			entries.push_back(std::move(info));
+		}
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::removeFile(const std::string& path)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::map<std::string, Node>::iterator it = nodes.find(keyFor(path));
+		if (it == nodes.end() || it->second.isDirectory)
+			return false;
+		nodes.erase(it);
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::makeDirectory(const std::string& path)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::string key = keyFor(path);
+		if (nodes.count(key) || !hasDirectory(parentOf(key)))
+			return false;
+		Node& node = nodes[key];
+		node.name = nameOf(path);
+		node.isDirectory = true;
+		node.lastWriteTime = now();
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::removeDirectory(const std::string& path)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::string key = keyFor(path);
+		std::map<std::string, Node>::iterator it = nodes.find(key);
+		if (it == nodes.end() || !it->second.isDirectory || key == rootKey)
+			return false;
+		std::map<std::string, Node>::iterator child = nodes.lower_bound(key + "\\");
+		if (child != nodes.end() && !child->first.compare(0, key.size() + 1, key + "\\"))
+			return false;
+		nodes.erase(it);
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::rename(const std::string& fromPath, const std::string& toPath)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::string fromKey = keyFor(fromPath), toKey = keyFor(toPath);
+		std::map<std::string, Node>::iterator it = nodes.find(fromKey);
+		if (it == nodes.end() || fromKey == rootKey || nodes.count(toKey) || !hasDirectory(parentOf(toKey))
+			|| !toKey.compare(0, fromKey.size() + 1, fromKey + "\\"))
+			return false;
+
+		Node node = it->second;
+		node.name = nameOf(toPath);
+		nodes.erase(it);
+		nodes[toKey] = node;
+		// a directory takes its subtree along
+		std::string prefix = fromKey + "\\";
+		it = nodes.lower_bound(prefix);
+		while (it != nodes.end() && !it->first.compare(0, prefix.size(), prefix))
+		{
+			nodes[toKey + it->first.substr(fromKey.size())] = it->second;
+			it = nodes.erase(it);
+		}
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::openRead(const std::string& path, asio::windows::random_access_handle& file, std::shared_ptr<const std::string>& content, uint64_t& size)
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		std::map<std::string, Node>::const_iterator it = nodes.find(keyFor(path));
+		if (it == nodes.end() || it->second.isDirectory)
+			return false;
+		content = it->second.content;
+		size = content->size();
+		return true;
+	}
+
+	bool TinyFTPMemoryFileSystem::openWrite(const std::string& path, size_t alignment, bool& unbuffered, asio::windows::random_access_handle& file, std::shared_ptr<std::string>& content)
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		std::string key = keyFor(path);
+		if (hasDirectory(key) || !hasDirectory(parentOf(key)))
+			return false;
+		unbuffered = false;
+		content = std::make_shared<std::string>();
+		return true;
+	}
+
+	void TinyFTPMemoryFileSystem::finishWrite(const std::string& path, std::shared_ptr<std::string>& content, bool ok)
+	{
+		std::shared_ptr<const std::string> finished = std::move(content);
+		if (!ok || !finished)
+			return;
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::string key = keyFor(path);
+		// the directory may have gone while the upload ran
+		if (hasDirectory(key) || !hasDirectory(parentOf(key)))
+			return;
+		Node& node = nodes[key];
+		node.name = nameOf(path);
+		node.isDirectory = false;
+		node.lastWriteTime = now();
+		node.content = finished;
+	}
+
+	bool matchesPattern(const std::string& pattern, const std::string& name)
+	{
+		// greedy with one backtrack point: the last * takes one more character whenever the rest fails
+		size_t p = 0, n = 0, starP = std::string::npos, starN = 0;
+		while (n < name.size())
+		{
+			if (p < pattern.size() && (pattern[p] == '?' || tolower((unsigned char)pattern[p]) == tolower((unsigned char)name[n])))
+			{
+				++p;
+				++n;
+			}
+			else if (p < pattern.size() && pattern[p] == '*')
+			{
+				starP = p++;
+				starN = n;
+			}
+			else if (starP != std::string::npos)
+			{
+				p = starP + 1;
+				n = ++starN;
+			}
+			else
+				return false;
+		}
+		while (p < pattern.size() && pattern[p] == '*')
+			++p;
+		return p == pattern.size();
+	}
+
+	std::unique_ptr<TinyFTPFileSystem> createFileSystem(const TinyFTPServerConfig& config)
+	{
+		if (config.memoryFileSystem)
+			return std::unique_ptr<TinyFTPFileSystem>(new TinyFTPMemoryFileSystem(config.docRoot));
+		return std::unique_ptr<TinyFTPFileSystem>(new TinyFTPLocalFileSystem());
+	}
+}
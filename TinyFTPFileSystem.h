@@ -0,0 +1,141 @@
+#ifndef IK80_TINYFTPFILESYSTEM_H_
+#define IK80_TINYFTPFILESYSTEM_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include <asio/windows/random_access_handle.hpp>
+
+namespace TinyWinFTP
+{
+	struct TinyFTPServerConfig;
+
+	/// A directory entry or the result of stat.
+	struct TinyFTPFileInfo
+	{
+		std::string name;
+		bool isDirectory = false;
+		bool readOnly = false;
+		// junction or symbolic link; tree walks list it but don't go into it, it may point back up the tree
+		bool isReparsePoint = false;
+		uint64_t size = 0;
+		// FILETIME ticks, UTC
+		uint64_t lastWriteTime = 0;
+	};
+
+	/// Everything the handler and the session do with files. Paths are the translated ones, docRoot included.
+	/// Calls come from every io thread at once.
+	class TinyFTPFileSystem
+	{
+	public:
+		virtual ~TinyFTPFileSystem()
+		{
+		}
+
+		/// False where paths don't name real files: HASH, SITE CPFR/CPTO, MODE Z RETR and upload digests need real ones.
+		virtual bool isLocal() const = 0;
+
+		virtual bool stat(const std::string& path, TinyFTPFileInfo& info) = 0;
+		/// Entries of directory without . and .., false if it can't be read. A pattern (matchesPattern) is
+		/// applied while the directory is read, so what doesn't match is never copied out.
+		virtual bool list(const std::string& directory, const std::string& pattern, std::vector<TinyFTPFileInfo>& entries) = 0;
+		bool list(const std::string& directory, std::vector<TinyFTPFileInfo>& entries)
+		{
+			return list(directory, std::string(), entries);
+		}
+		virtual bool removeFile(const std::string& path) = 0;
+		virtual bool makeDirectory(const std::string& path) = 0;
+		virtual bool removeDirectory(const std::string& path) = 0;
+		virtual bool rename(const std::string& fromPath, const std::string& toPath) = 0;
+
+		/// RETR: assigns an overlapped handle to file, or hands out the content when the file lives in memory.
+		virtual bool openRead(const std::string& path, asio::windows::random_access_handle& file, std::shared_ptr<const std::string>& content, uint64_t& size) = 0;
+		/// STOR: creates or truncates path. unbuffered asks for FILE_FLAG_NO_BUFFERING with writes in alignment multiples
+		/// and tells whether it was granted. Without a handle the data goes into content and shows up at path with finishWrite.
+		virtual bool openWrite(const std::string& path, size_t alignment, bool& unbuffered, asio::windows::random_access_handle& file, std::shared_ptr<std::string>& content) = 0;
+		virtual void finishWrite(const std::string& path, std::shared_ptr<std::string>& content, bool ok) = 0;
+	};
+
+	/// Files on disk through Win32.
+	class TinyFTPLocalFileSystem : public TinyFTPFileSystem
+	{
+	public:
+		bool isLocal() const override
+		{
+			return true;
+		}
+		bool stat(const std::string& path, TinyFTPFileInfo& info) override;
+		using TinyFTPFileSystem::list;
+		bool list(const std::string& directory, const std::string& pattern, std::vector<TinyFTPFileInfo>& entries) override;
+		bool removeFile(const std::string& path) override;
+		bool makeDirectory(const std::string& path) override;
+		bool removeDirectory(const std::string& path) override;
+		bool rename(const std::string& fromPath, const std::string& toPath) override;
+		bool openRead(const std::string& path, asio::windows::random_access_handle& file, std::shared_ptr<const std::string>& content, uint64_t& size) override;
+		bool openWrite(const std::string& path, size_t alignment, bool& unbuffered, asio::windows::random_access_handle& file, std::shared_ptr<std::string>& content) override;
+		void finishWrite(const std::string& path, std::shared_ptr<std::string>& content, bool ok) override;
+	};
+
+	/// A tree held in RAM, loaded from root at startup; nothing is written back. RETR goes straight from the
+	/// shared content to the socket, a STOR replaces the content only once it completed, so running downloads
+	/// of the old version keep theirs.
+	class TinyFTPMemoryFileSystem : public TinyFTPFileSystem
+	{
+	public:
+		explicit TinyFTPMemoryFileSystem(const std::string& root);
+
+		bool isLocal() const override
+		{
+			return false;
+		}
+		bool stat(const std::string& path, TinyFTPFileInfo& info) override;
+		using TinyFTPFileSystem::list;
+		bool list(const std::string& directory, const std::string& pattern, std::vector<TinyFTPFileInfo>& entries) override;
+		bool removeFile(const std::string& path) override;
+		bool makeDirectory(const std::string& path) override;
+		bool removeDirectory(const std::string& path) override;
+		bool rename(const std::string& fromPath, const std::string& toPath) override;
+		bool openRead(const std::string& path, asio::windows::random_access_handle& file, std::shared_ptr<const std::string>& content, uint64_t& size) override;
+		bool openWrite(const std::string& path, size_t alignment, bool& unbuffered, asio::windows::random_access_handle& file, std::shared_ptr<std::string>& content) override;
+		void finishWrite(const std::string& path, std::shared_ptr<std::string>& content, bool ok) override;
+
+		uint64_t totalBytes();
+
+	private:
+		struct Node
+		{
+			std::string name;
+			bool isDirectory = false;
+			uint64_t lastWriteTime = 0;
+			std::shared_ptr<const std::string> content;
+		};
+
+		// lower case, without \\?\ and trailing backslashes; the parent of a key is everything before its last backslash
+		static std::string keyFor(const std::string& path);
+		static std::string parentOf(const std::string& key);
+		static std::string nameOf(const std::string& path);
+		static uint64_t now();
+		// caller holds the lock
+		bool hasDirectory(const std::string& key);
+		void load(const std::string& directory, const std::string& key);
+
+		std::string rootKey;
+		std::shared_mutex mutex;
+		std::map<std::string, Node> nodes;
+
+		TinyFTPMemoryFileSystem(const TinyFTPMemoryFileSystem& other) = delete;
+	};
+
+	/// DOS style wildcards, * and ?, compared case-insensitively like NTFS names.
+	bool matchesPattern(const std::string& pattern, const std::string& name);
+
+	/// The backend the config asks for.
+	std::unique_ptr<TinyFTPFileSystem> createFileSystem(const TinyFTPServerConfig& config);
+}
+
+#endif // IK80_TINYFTPFILESYSTEM_H_
@@ -0,0 +1,224 @@
+#ifndef IK80_TINYFTPHANDLERALLOCATOR_H_
+#define IK80_TINYFTPHANDLERALLOCATOR_H_
+
+#include <cstddef>
+#include <new>
+#include <array>
+#include <utility>
+
+#include <asio/experimental/channel_traits.hpp>
+
+namespace TinyWinFTP
+{
+
+	/// Memory for the state of a session's outstanding asynchronous operations.
+	/// A session never has more than a handful of operations in flight (control read, data read, disk write, timers),
+	/// each slot keeps the largest block it was asked for, so after the first transfer nothing goes to the heap.
+	/// Not thread safe: all operations of a session complete on its io_context's single thread, the control socket
+	/// included since the server accepts it onto that io_context.
+	///
+	/// What still allocates, by design: one co_spawn frame per transfer and per data connection, taken from asio's
+	/// per-thread recycling cache like the frames of each co_await; the transfer state itself; and in MODE Z the
+	/// two posts per chunk to the worker pool and back, whose memory asio recycles per thread, so a post freed on
+	/// the other thread comes from the heap next time. ftpmicrobench's BM_UploadSteadyState checks the rest.
+	class TinyFTPHandlerMemory
+	{
+	public:
+		static const std::size_t SLOT_COUNT = 6;
+		static const std::size_t SLOT_GRANULARITY = 128;
+
+		TinyFTPHandlerMemory()
+		{
+		}
+
+		~TinyFTPHandlerMemory()
+		{
+			for (Slot& slot : slots)
+				::operator delete(slot.memory);
+		}
+
+		void* allocate(std::size_t size)
+		{
+			for (Slot& slot : slots)
+			{
+				if (!slot.inUse && slot.size >= size)
+				{
+					slot.inUse = true;
+					return slot.memory;
+				}
+			}
+			// no free slot is big enough, grow one, rounded so slightly bigger operations don't regrow it
+			for (Slot& slot : slots)
+			{
+				if (!slot.inUse)
+				{
+					::operator delete(slot.memory);
+					slot.size = (size + SLOT_GRANULARITY - 1) / SLOT_GRANULARITY * SLOT_GRANULARITY;
+					slot.memory = ::operator new(slot.size);
+					slot.inUse = true;
+					return slot.memory;
+				}
+			}
+			return ::operator new(size);
+		}
+
+		void deallocate(void* pointer)
+		{
+			for (Slot& slot : slots)
+			{
+				if (slot.memory == pointer)
+				{
+					slot.inUse = false;
+					return;
+				}
+			}
+			::operator delete(pointer);
+		}
+
+	private:
+		struct Slot
+		{
+			void* memory = nullptr;
+			std::size_t size = 0;
+			bool inUse = false;
+		};
+		std::array<Slot, SLOT_COUNT> slots;
+
+		TinyFTPHandlerMemory(const TinyFTPHandlerMemory& other) = delete;
+		TinyFTPHandlerMemory& operator=(const TinyFTPHandlerMemory& other) = delete;
+	};
+
+	/// Allocator handing out TinyFTPHandlerMemory, attach it to a handler or completion token with asio::bind_allocator.
+	template <typename T>
+	class TinyFTPHandlerAllocator
+	{
+	public:
+		typedef T value_type;
+
+		explicit TinyFTPHandlerAllocator(TinyFTPHandlerMemory& in_memory) noexcept : memory(&in_memory)
+		{
+		}
+
+		template <typename U>
+		TinyFTPHandlerAllocator(const TinyFTPHandlerAllocator<U>& other) noexcept : memory(other.memory)
+		{
+		}
+
+		bool operator==(const TinyFTPHandlerAllocator& other) const noexcept
+		{
+			return memory == other.memory;
+		}
+
+		bool operator!=(const TinyFTPHandlerAllocator& other) const noexcept
+		{
+			return memory != other.memory;
+		}
+
+		T* allocate(std::size_t n) const
+		{
+			return static_cast<T*>(memory->allocate(sizeof(T) * n));
+		}
+
+		void deallocate(T* pointer, std::size_t /*n*/) const
+		{
+			memory->deallocate(pointer);
+		}
+
+	private:
+		template <typename> friend class TinyFTPHandlerAllocator;
+
+		TinyFTPHandlerMemory* memory;
+	};
+
+	/// FIFO of at most Capacity values stored in place, the buffer of a channel whose max_buffer_size is Capacity.
+	/// asio's default std::deque gets a new node every few values, this never touches the heap.
+	template <typename T, std::size_t Capacity>
+	class TinyFTPFixedRing
+	{
+	public:
+		TinyFTPFixedRing()
+			: head(0),
+			count(0)
+		{
+		}
+
+		~TinyFTPFixedRing()
+		{
+			clear();
+		}
+
+		std::size_t size() const noexcept
+		{
+			return count;
+		}
+
+		bool empty() const noexcept
+		{
+			return count == 0;
+		}
+
+		T& front() noexcept
+		{
+			return *slot(head);
+		}
+
+		// the channel checks max_buffer_size before it queues, there is always room
+		template <typename U>
+		void push_back(U&& value)
+		{
+			new (&storage[(head + count) % Capacity]) T(std::forward<U>(value));
+			++count;
+		}
+
+		void pop_front()
+		{
+			slot(head)->~T();
+			head = (head + 1) % Capacity;
+			--count;
+		}
+
+		void clear()
+		{
+			while (count)
+				pop_front();
+		}
+
+	private:
+		struct Storage
+		{
+			alignas(T) unsigned char bytes[sizeof(T)];
+		};
+
+		T* slot(std::size_t index) noexcept
+		{
+			return std::launder(reinterpret_cast<T*>(storage[index].bytes));
+		}
+
+		std::array<Storage, Capacity> storage;
+		std::size_t head;
+		std::size_t count;
+
+		TinyFTPFixedRing(const TinyFTPFixedRing& other) = delete;
+		TinyFTPFixedRing& operator=(const TinyFTPFixedRing& other) = delete;
+	};
+
+	/// Channel traits keeping queued values in a TinyFTPFixedRing, for asio::experimental::basic_channel.
+	template <std::size_t Capacity, typename... Signatures>
+	struct TinyFTPFixedChannelTraits : asio::experimental::channel_traits<Signatures...>
+	{
+		template <typename... NewSignatures>
+		struct rebind
+		{
+			typedef TinyFTPFixedChannelTraits<Capacity, NewSignatures...> other;
+		};
+
+		template <typename Element>
+		struct container
+		{
+			typedef TinyFTPFixedRing<Element, Capacity> type;
+		};
+	};
+
+}
+
+#endif // IK80_TINYFTPHANDLERALLOCATOR_H_
@@ -0,0 +1,161 @@
+#include <iostream>
+
+#include "TinyFTPHandoff.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char LISTENER_RELEASED = 'R';
+		const DWORD PIPE_TIMEOUT_MS = 5000;
+
+		// ntdll's FileReplaceCompletionInformation, Windows 8.1 and later
+		struct CompletionInformation
+		{
+			HANDLE port;
+			PVOID key;
+		};
+		struct IoStatusBlock
+		{
+			union
+			{
+				LONG status;
+				PVOID pointer;
+			};
+			ULONG_PTR information;
+		};
+		typedef LONG(NTAPI* NtSetInformationFileFunction)(HANDLE, IoStatusBlock*, PVOID, ULONG, int);
+		const int FILE_REPLACE_COMPLETION_INFORMATION = 61;
+
+		// the duplicate shares the old process's socket object and with it that process's completion port,
+		// asio can only register it here once the association is gone
+		bool dropCompletionPort(SOCKET socket)
+		{
+			NtSetInformationFileFunction setInformationFile = (NtSetInformationFileFunction)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtSetInformationFile");
+			if (!setInformationFile)
+				return false;
+			IoStatusBlock status;
+			CompletionInformation information = { 0, 0 };
+			return setInformationFile((HANDLE)socket, &status, &information, sizeof(information), FILE_REPLACE_COMPLETION_INFORMATION) >= 0;
+		}
+
+		bool readMessage(HANDLE pipe, void* buffer, DWORD size)
+		{
+			DWORD bytesRead = 0;
+			return ReadFile(pipe, buffer, size, &bytesRead, 0) && bytesRead == size;
+		}
+
+		bool writeMessage(HANDLE pipe, const void* buffer, DWORD size)
+		{
+			DWORD bytesWritten = 0;
+			return WriteFile(pipe, buffer, size, &bytesWritten, 0) && bytesWritten == size;
+		}
+	}
+
+	TinyFTPListenerHandoff::TinyFTPListenerHandoff(unsigned short in_port)
+		: port(in_port),
+		listenerHandle(INVALID_SOCKET),
+		stopping(false)
+	{
+	}
+
+	TinyFTPListenerHandoff::~TinyFTPListenerHandoff()
+	{
+		stop();
+	}
+
+	std::string TinyFTPListenerHandoff::pipeName(unsigned short port)
+	{
+		return "\\\\.\\pipe\\YATinyWinFTP-" + std::to_string(port);
+	}
+
+	void TinyFTPListenerHandoff::start(asio::ip::tcp::acceptor& listener, ReleaseListener in_releaseListener)
+	{
+		listenerHandle = listener.native_handle();
+		releaseListener = in_releaseListener;
+		pipeThread = std::thread([this] { serve(); });
+	}
+
+	void TinyFTPListenerHandoff::stop()
+	{
+		if (!pipeThread.joinable())
+			return;
+		stopping = true;
+		// a client that connected and went quiet leaves the thread in ReadFile, otherwise wake ConnectNamedPipe by connecting to ourselves
+		CancelSynchronousIo(pipeThread.native_handle());
+		HANDLE pipe = CreateFileA(pipeName(port).c_str(), GENERIC_READ, 0, 0, OPEN_EXISTING, 0, 0);
+		if (pipe != INVALID_HANDLE_VALUE)
+			CloseHandle(pipe);
+		pipeThread.join();
+	}
+
+	void TinyFTPListenerHandoff::serve()
+	{
+		// default security: only the owner, administrators and SYSTEM may write to it
+		HANDLE pipe = CreateNamedPipeA(pipeName(port).c_str(), PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 4096, 4096, PIPE_TIMEOUT_MS, 0);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			std::cout << "Handoff: can't create pipe, error " << GetLastError() << std::endl;
+			return;
+		}
+
+		while (!stopping)
+		{
+			if (!ConnectNamedPipe(pipe, 0) && GetLastError() != ERROR_PIPE_CONNECTED)
+				break;
+			if (stopping)
+				break;
+
+			DWORD processId = 0;
+			WSAPROTOCOL_INFOW protocolInfo;
+			if (!readMessage(pipe, &processId, sizeof(processId)) || WSADuplicateSocketW(listenerHandle, processId, &protocolInfo) != 0
+				|| !writeMessage(pipe, &protocolInfo, sizeof(protocolInfo)))
+			{
+				std::cout << "Handoff: request failed, error " << GetLastError() << std::endl;
+				DisconnectNamedPipe(pipe);
+				continue;
+			}
+
+			std::cout << "Handoff: listener duplicated into process " << processId << std::endl;
+			releaseListener();
+			writeMessage(pipe, &LISTENER_RELEASED, sizeof(LISTENER_RELEASED));
+			FlushFileBuffers(pipe);
+			DisconnectNamedPipe(pipe);
+			break;
+		}
+		CloseHandle(pipe);
+	}
+
+	bool TinyFTPListenerHandoff::takeOver(unsigned short port, asio::ip::tcp::acceptor& listener, asio::error_code& ec)
+	{
+		std::string name = pipeName(port);
+		if (!WaitNamedPipeA(name.c_str(), PIPE_TIMEOUT_MS))
+			return false;
+		HANDLE pipe = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+		if (pipe == INVALID_HANDLE_VALUE)
+			return false;
+		DWORD readMode = PIPE_READMODE_MESSAGE;
+		SetNamedPipeHandleState(pipe, &readMode, 0, 0);
+
+		DWORD processId = GetCurrentProcessId();
+		WSAPROTOCOL_INFOW protocolInfo;
+		char released = 0;
+		bool ok = writeMessage(pipe, &processId, sizeof(processId)) && readMessage(pipe, &protocolInfo, sizeof(protocolInfo));
+		SOCKET socket = ok ? WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0, WSA_FLAG_OVERLAPPED) : INVALID_SOCKET;
+		// the old process's pending accept has to be gone before the completion port can change
+		ok = socket != INVALID_SOCKET && readMessage(pipe, &released, sizeof(released)) && released == LISTENER_RELEASED;
+		CloseHandle(pipe);
+
+		if (ok && dropCompletionPort(socket))
+		{
+			listener.assign(protocolInfo.iAddressFamily == AF_INET6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4(), socket, ec);
+			if (!ec)
+				return true;
+		}
+		std::cout << "Handoff: could not take over the listener" << std::endl;
+		if (socket != INVALID_SOCKET)
+			closesocket(socket);
+		return false;
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef IK80_TINYFTPHANDOFF_H_
+#define IK80_TINYFTPHANDOFF_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <asio/ip/tcp.hpp>
+
+namespace TinyWinFTP
+{
+	/// Hands the listening socket to a newer server process for a restart without refused connections.
+	/// The running server waits on the named pipe \\.\pipe\YATinyWinFTP-<port>. A new process started with --takeover
+	/// sends its process id; the old one duplicates the listener into it (WSADuplicateSocket), closes its own handle
+	/// and starts draining. Connections arriving meanwhile wait in the listen backlog, which both processes share.
+	class TinyFTPListenerHandoff
+	{
+	public:
+		/// Called on the pipe thread once the listener is duplicated, must return after the old process's handle is closed.
+		typedef std::function<void()> ReleaseListener;
+
+		explicit TinyFTPListenerHandoff(unsigned short port);
+		~TinyFTPListenerHandoff();
+
+		/// Old process: serve one takeover request for listener.
+		void start(asio::ip::tcp::acceptor& listener, ReleaseListener releaseListener);
+		void stop();
+
+		/// New process: take the listening socket from the server running on port, false if there is none or it failed.
+		static bool takeOver(unsigned short port, asio::ip::tcp::acceptor& listener, asio::error_code& ec);
+
+	private:
+		static std::string pipeName(unsigned short port);
+		void serve();
+
+		unsigned short port;
+		asio::ip::tcp::acceptor::native_handle_type listenerHandle;
+		ReleaseListener releaseListener;
+		std::thread pipeThread;
+		std::atomic_bool stopping;
+
+		TinyFTPListenerHandoff(const TinyFTPListenerHandoff& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPHANDOFF_H_
@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <asio/post.hpp>
+
+#include <bcrypt.h>
+#include <zlib.h>
+
+#include "TinyFTPHash.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char* HASH_NAMES[HASH_ALGORITHM_COUNT] = { "SHA-256", "SHA-1", "MD5", "CRC32", "SHA-512" };
+
+		const size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		const char DIGEST_STREAM_SUFFIX[] = ":tinyftp.digest";
+
+		// CRC32 of files at least this big is computed in parallel chunks of this size
+		const uint64_t CRC_CHUNK_SIZE = 64ull * 1024 * 1024;
+
+		// algorithm providers are expensive to open and safe to share, keep one per algorithm for the process
+		BCRYPT_ALG_HANDLE getProvider(TinyFTPHashAlgorithm algorithm)
+		{
+			static BCRYPT_ALG_HANDLE providers[HASH_ALGORITHM_COUNT] = {};
+			static std::once_flag providersOnce;
+			std::call_once(providersOnce, []()
+			{
+				BCryptOpenAlgorithmProvider(&providers[HASH_SHA256], BCRYPT_SHA256_ALGORITHM, 0, 0);
+				BCryptOpenAlgorithmProvider(&providers[HASH_SHA1], BCRYPT_SHA1_ALGORITHM, 0, 0);
+				BCryptOpenAlgorithmProvider(&providers[HASH_MD5], BCRYPT_MD5_ALGORITHM, 0, 0);
+				BCryptOpenAlgorithmProvider(&providers[HASH_SHA512], BCRYPT_SHA512_ALGORITHM, 0, 0);
+			});
+			return providers[algorithm];
+		}
+
+		std::string toHex(const unsigned char* data, size_t len)
+		{
+			static const char HEX_DIGITS[] = "0123456789abcdef";
+			std::string hex(len * 2, '0');
+			for (size_t i = 0; i < len; ++i)
+			{
+				hex[i * 2] = HEX_DIGITS[data[i] >> 4];
+				hex[i * 2 + 1] = HEX_DIGITS[data[i] & 0xf];
+			}
+			return hex;
+		}
+
+		bool statFile(const std::string& filename, uint64_t& size, uint64_t& mtime)
+		{
+			WIN32_FILE_ATTRIBUTE_DATA attributes;
+			if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes) || (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				return false;
+			size = ((uint64_t)attributes.nFileSizeHigh << 32) + attributes.nFileSizeLow;
+			mtime = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) + attributes.ftLastWriteTime.dwLowDateTime;
+			return true;
+		}
+
+		// hashes [offset, offset + len) of filename, len of -1 reads up to the end
+		bool hashFileRange(const std::string& filename, uint64_t offset, uint64_t len, TinyFTPHasher& hasher)
+		{
+			HANDLE file = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			std::vector<char> readBuffer(READ_BUFFER_SIZE);
+			bool ok = true;
+			while (len)
+			{
+				OVERLAPPED position = {};
+				position.Offset = (DWORD)offset;
+				position.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD bytesToRead = (DWORD)std::min<uint64_t>(readBuffer.size(), len);
+				DWORD bytesRead = 0;
+				if (!::ReadFile(file, readBuffer.data(), bytesToRead, &bytesRead, &position))
+				{
+					ok = (GetLastError() == ERROR_HANDLE_EOF && len == (uint64_t)-1);
+					break;
+				}
+				if (bytesRead == 0)
+				{
+					ok = (len == (uint64_t)-1);
+					break;
+				}
+				hasher.update(readBuffer.data(), bytesRead);
+				offset += bytesRead;
+				if (len != (uint64_t)-1)
+					len -= bytesRead;
+			}
+			CloseHandle(file);
+			return ok;
+		}
+
+		struct ParallelCrcState
+		{
+			std::string filename;
+			uint64_t size;
+			uint64_t mtime;
+			std::vector<unsigned long> chunkCrcs;
+			std::atomic<size_t> chunksLeft;
+			std::atomic<bool> failed;
+			std::function<void(bool, const std::string&, uint64_t)> onDone;
+		};
+	}
+
+	const char* hashAlgorithmName(TinyFTPHashAlgorithm algorithm)
+	{
+		return HASH_NAMES[algorithm];
+	}
+
+	bool hashAlgorithmFromName(const char* name, TinyFTPHashAlgorithm& algorithm)
+	{
+		for (int i = 0; i < HASH_ALGORITHM_COUNT; ++i)
+		{
+			if (!_stricmp(name, HASH_NAMES[i]))
+			{
+				algorithm = (TinyFTPHashAlgorithm)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	TinyFTPHasher::TinyFTPHasher(TinyFTPHashAlgorithm in_algorithm) : algorithm(in_algorithm), hashHandle(0), crc(0)
+	{
+		if (algorithm == HASH_CRC32)
+			crc = crc32(0L, Z_NULL, 0);
+		else
+		{
+			BCRYPT_HASH_HANDLE handle = 0;
+			if (BCRYPT_SUCCESS(BCryptCreateHash(getProvider(algorithm), &handle, 0, 0, 0, 0, 0)))
+				hashHandle = handle;
+		}
+	}
+
+	TinyFTPHasher::~TinyFTPHasher()
+	{
+		if (hashHandle)
+			BCryptDestroyHash(hashHandle);
+	}
+
+	void TinyFTPHasher::update(const char* data, size_t len)
+	{
+		if (algorithm == HASH_CRC32)
+			crc = crc32_z(crc, (const Bytef*)data, len);
+		else if (hashHandle)
+		{
+			while (len)
+			{
+				ULONG part = (ULONG)std::min<size_t>(len, 0x40000000);
+				BCryptHashData(hashHandle, (PUCHAR)data, part, 0);
+				data += part;
+				len -= part;
+			}
+		}
+	}
+
+	std::string TinyFTPHasher::finish()
+	{
+		if (algorithm == HASH_CRC32)
+		{
+			char crcBuf[16];
+			snprintf(crcBuf, sizeof(crcBuf), "%08lx", crc);
+			return crcBuf;
+		}
+		if (!hashHandle)
+			return std::string();
+
+		unsigned char digest[64];
+		DWORD digestLength = 0, resultLength = 0;
+		BCryptGetProperty(hashHandle, BCRYPT_HASH_LENGTH, (PUCHAR)&digestLength, sizeof(digestLength), &resultLength, 0);
+		if (digestLength > sizeof(digest) || !BCRYPT_SUCCESS(BCryptFinishHash(hashHandle, digest, digestLength, 0)))
+			return std::string();
+		return toHex(digest, digestLength);
+	}
+
+	TinyFTPDigestCache::TinyFTPDigestCache(size_t in_capacity) : capacity(in_capacity)
+	{
+	}
+
+	std::string TinyFTPDigestCache::makeKey(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime)
+	{
+		return std::to_string(algorithm) + '|' + std::to_string(size) + '|' + std::to_string(mtime) + '|' + filename;
+	}
+
+	bool TinyFTPDigestCache::lookup(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime, std::string& hexDigest)
+	{
+		std::string key = makeKey(algorithm, filename, size, mtime);
+		std::lock_guard<std::mutex> cacheGuard(cacheMutex);
+		auto it = index.find(key);
+		if (it == index.end())
+			return false;
+		entries.splice(entries.begin(), entries, it->second);
+		hexDigest = it->second->second;
+		return true;
+	}
+
+	void TinyFTPDigestCache::store(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime, const std::string& hexDigest)
+	{
+		std::string key = makeKey(algorithm, filename, size, mtime);
+		std::lock_guard<std::mutex> cacheGuard(cacheMutex);
+		auto it = index.find(key);
+		if (it != index.end())
+		{
+			it->second->second = hexDigest;
+			entries.splice(entries.begin(), entries, it->second);
+			return;
+		}
+		entries.emplace_front(key, hexDigest);
+		index[key] = entries.begin();
+		if (entries.size() > capacity)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+	}
+
+	bool storeDigestAttribute(const std::string& filename, TinyFTPHashAlgorithm algorithm, const std::string& hexDigest, uint64_t& size, uint64_t& mtime)
+	{
+		if (!statFile(filename, size, mtime))
+			return false;
+
+		char record[256];
+		int recordLength = snprintf(record, sizeof(record), "%s %llu %llu %s\n", hashAlgorithmName(algorithm), (unsigned long long)size, (unsigned long long)mtime, hexDigest.c_str());
+		if (recordLength <= 0 || recordLength >= (int)sizeof(record))
+			return false;
+
+		HANDLE stream = ::CreateFileA((filename + DIGEST_STREAM_SUFFIX).c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+		if (stream == INVALID_HANDLE_VALUE)
+			return false;
+		DWORD bytesWritten = 0;
+		bool ok = ::WriteFile(stream, record, (DWORD)recordLength, &bytesWritten, 0) && bytesWritten == (DWORD)recordLength;
+		CloseHandle(stream);
+		if (!ok)
+			return false;
+
+		// writing the stream bumped the file's mtime, put back the one the record was made for
+		HANDLE file = ::CreateFileA(filename.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		FILETIME lastWriteTime;
+		lastWriteTime.dwLowDateTime = (DWORD)mtime;
+		lastWriteTime.dwHighDateTime = (DWORD)(mtime >> 32);
+		ok = ::SetFileTime(file, 0, 0, &lastWriteTime) != FALSE;
+		CloseHandle(file);
+		return ok;
+	}
+
+	bool loadDigestAttribute(const std::string& filename, TinyFTPHashAlgorithm algorithm, uint64_t size, uint64_t mtime, std::string& hexDigest)
+	{
+		HANDLE stream = ::CreateFileA((filename + DIGEST_STREAM_SUFFIX).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (stream == INVALID_HANDLE_VALUE)
+			return false;
+		char record[256];
+		DWORD bytesRead = 0;
+		bool ok = ::ReadFile(stream, record, sizeof(record) - 1, &bytesRead, 0) != FALSE;
+		CloseHandle(stream);
+		if (!ok)
+			return false;
+		record[bytesRead] = 0;
+
+		char algorithmName[16], digest[160];
+		unsigned long long recordSize = 0, recordMtime = 0;
+		if (sscanf(record, "%15s %llu %llu %159s", algorithmName, &recordSize, &recordMtime, digest) != 4)
+			return false;
+		if (strcmp(algorithmName, hashAlgorithmName(algorithm)) || recordSize != size || recordMtime != mtime)
+			return false;
+		hexDigest = digest;
+		return true;
+	}
+
+	void hashFileAsync(asio::thread_pool& workerPool, TinyFTPDigestCache& digestCache, const std::string& filename, TinyFTPHashAlgorithm algorithm,
+		std::function<void(bool ok, const std::string& hexDigest, uint64_t size)> onDone)
+	{
+		asio::post(workerPool, [&workerPool, &digestCache, filename, algorithm, onDone]()
+		{
+			uint64_t size = 0, mtime = 0;
+			if (!statFile(filename, size, mtime))
+			{
+				onDone(false, std::string(), 0);
+				return;
+			}
+
+			std::string hexDigest;
+			if (digestCache.lookup(algorithm, filename, size, mtime, hexDigest))
+			{
+				onDone(true, hexDigest, size);
+				return;
+			}
+			if (loadDigestAttribute(filename, algorithm, size, mtime, hexDigest))
+			{
+				digestCache.store(algorithm, filename, size, mtime, hexDigest);
+				onDone(true, hexDigest, size);
+				return;
+			}
+
+			if (algorithm != HASH_CRC32 || size < 2 * CRC_CHUNK_SIZE)
+			{
+				TinyFTPHasher hasher(algorithm);
+				bool ok = hashFileRange(filename, 0, (uint64_t)-1, hasher);
+				if (ok)
+				{
+					hexDigest = hasher.finish();
+					ok = !hexDigest.empty();
+				}
+				if (ok)
+					digestCache.store(algorithm, filename, size, mtime, hexDigest);
+				onDone(ok, hexDigest, size);
+				return;
+			}
+
+			// CRC32 is linear, chunks can be hashed independently and combined in order afterwards
+			std::shared_ptr<ParallelCrcState> state = std::make_shared<ParallelCrcState>();
+			size_t chunkCount = (size_t)((size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE);
+			state->filename = filename;
+			state->size = size;
+			state->mtime = mtime;
+			state->chunkCrcs.resize(chunkCount);
+			state->chunksLeft = chunkCount;
+			state->failed = false;
+			state->onDone = onDone;
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				asio::post(workerPool, [state, chunk, &digestCache]()
+				{
+					uint64_t offset = chunk * CRC_CHUNK_SIZE;
+					TinyFTPHasher hasher(HASH_CRC32);
+					if (!hashFileRange(state->filename, offset, std::min(CRC_CHUNK_SIZE, state->size - offset), hasher))
+						state->failed = true;
+					else
+						state->chunkCrcs[chunk] = hasher.crcValue();
+
+					if (--state->chunksLeft != 0)
+						return;
+
+					// last one out stitches the chunks together
+					if (state->failed)
+					{
+						state->onDone(false, std::string(), 0);
+						return;
+					}
+					unsigned long crc = state->chunkCrcs[0];
+					for (size_t i = 1; i < state->chunkCrcs.size(); ++i)
+					{
+						uint64_t chunkLength = std::min(CRC_CHUNK_SIZE, state->size - i * CRC_CHUNK_SIZE);
+						crc = crc32_combine(crc, state->chunkCrcs[i], (z_off_t)chunkLength);
+					}
+					char crcBuf[16];
+					snprintf(crcBuf, sizeof(crcBuf), "%08lx", crc);
+					digestCache.store(HASH_CRC32, state->filename, state->size, state->mtime, crcBuf);
+					state->onDone(true, crcBuf, state->size);
+				});
+			}
+		});
+	}
+}
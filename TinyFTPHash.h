@@ -0,0 +1,89 @@
+#ifndef IK80_TINYFTPHASH_H_
+#define IK80_TINYFTPHASH_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <asio/thread_pool.hpp>
+
+namespace TinyWinFTP
+{
+	enum TinyFTPHashAlgorithm
+	{
+		HASH_SHA256 = 0,
+		HASH_SHA1,
+		HASH_MD5,
+		HASH_CRC32,
+		HASH_SHA512,
+		HASH_ALGORITHM_COUNT
+	};
+
+	/// Name as used by HASH/OPTS HASH, "SHA-256" etc.
+	const char* hashAlgorithmName(TinyFTPHashAlgorithm algorithm);
+	bool hashAlgorithmFromName(const char* name, TinyFTPHashAlgorithm& algorithm);
+
+	/// Incremental digest. SHA and MD5 go through CNG, which picks SHA-NI/AVX2 code where the CPU has it, CRC32 through zlib.
+	class TinyFTPHasher
+	{
+	public:
+		explicit TinyFTPHasher(TinyFTPHashAlgorithm algorithm);
+		~TinyFTPHasher();
+
+		void update(const char* data, size_t len);
+
+		/// Lowercase hex digest, hasher can't be updated afterwards.
+		std::string finish();
+
+		unsigned long crcValue() const
+		{
+			return crc;
+		}
+
+	private:
+		TinyFTPHashAlgorithm algorithm;
+		void* hashHandle;
+		unsigned long crc;
+
+		TinyFTPHasher(const TinyFTPHasher& other) = delete;
+		TinyFTPHasher(TinyFTPHasher&& other) = delete;
+	};
+
+	/// Digests of whole files keyed by algorithm, path, size and mtime, least recently used ones dropped first.
+	class TinyFTPDigestCache
+	{
+	public:
+		static const size_t DEFAULT_CAPACITY = 65536;
+
+		explicit TinyFTPDigestCache(size_t capacity = DEFAULT_CAPACITY);
+
+		bool lookup(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime, std::string& hexDigest);
+		void store(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime, const std::string& hexDigest);
+
+	private:
+		static std::string makeKey(TinyFTPHashAlgorithm algorithm, const std::string& filename, uint64_t size, uint64_t mtime);
+
+		size_t capacity;
+		std::mutex cacheMutex;
+		std::list<std::pair<std::string, std::string> > entries;
+		std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator> index;
+	};
+
+	/// Digest of an upload kept in the file's "tinyftp.digest" NTFS alternate data stream, together with the
+	/// size and mtime it belongs to. store() puts the mtime back after writing the stream so the record stays valid.
+	bool storeDigestAttribute(const std::string& filename, TinyFTPHashAlgorithm algorithm, const std::string& hexDigest, uint64_t& size, uint64_t& mtime);
+	bool loadDigestAttribute(const std::string& filename, TinyFTPHashAlgorithm algorithm, uint64_t size, uint64_t mtime, std::string& hexDigest);
+
+	/// Hashes filename on the worker pool, onDone runs on a worker thread with the hex digest and file size.
+	/// A digest stored with the file by storeDigestAttribute() is used when it is still valid.
+	/// CRC32 of large files is split into chunks hashed in parallel and stitched with crc32_combine,
+	/// SHA/MD5 can't be split so those run as one sequential job.
+	void hashFileAsync(asio::thread_pool& workerPool, TinyFTPDigestCache& digestCache, const std::string& filename, TinyFTPHashAlgorithm algorithm,
+		std::function<void(bool ok, const std::string& hexDigest, uint64_t size)> onDone);
+}
+
+#endif // IK80_TINYFTPHASH_H_
@@ -0,0 +1,231 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <algorithm>
+
+#include <asio/post.hpp>
+
+#include "TinyFTPListing.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char* numToMonth(WORD month)
+		{
+			if (month < 1 || month > 12)
+				abort();
+			static const char* MONTH_NAMES[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+			return MONTH_NAMES[month-1];
+		}
+
+		// NTFS order, case doesn't count
+		bool nameLess(const std::string& left, const std::string& right)
+		{
+			return std::lexicographical_compare(left.begin(), left.end(), right.begin(), right.end(),
+				[](char l, char r) { return tolower((unsigned char)l) < tolower((unsigned char)r); });
+		}
+	}
+
+	void applyListOptions(const TinyFTPListOptions& options, std::vector<TinyFTPFileInfo>& entries)
+	{
+		size_t offset = std::min(options.offset, entries.size());
+		size_t end = options.limit ? std::min(entries.size(), offset + options.limit) : entries.size();
+		if (options.sortKey != TinyFTPListOptions::SORT_NONE)
+		{
+			bool descending = options.descending;
+			TinyFTPListOptions::SortKey sortKey = options.sortKey;
+			auto before = [sortKey, descending](const TinyFTPFileInfo& left, const TinyFTPFileInfo& right)
+			{
+				const TinyFTPFileInfo& first = descending ? right : left;
+				const TinyFTPFileInfo& second = descending ? left : right;
+				// names break ties so pages don't overlap
+				if (sortKey == TinyFTPListOptions::SORT_SIZE && first.size != second.size)
+					return first.size < second.size;
+				if (sortKey == TinyFTPListOptions::SORT_TIME && first.lastWriteTime != second.lastWriteTime)
+					return first.lastWriteTime < second.lastWriteTime;
+				return nameLess(first.name, second.name);
+			};
+			if (end < entries.size())
+				std::partial_sort(entries.begin(), entries.begin() + end, entries.end(), before);
+			else
+				std::sort(entries.begin(), entries.end(), before);
+		}
+		entries.resize(end);
+		entries.erase(entries.begin(), entries.begin() + offset);
+	}
+
+	void appendListEntry(const TinyFTPFileInfo& entry, bool longFormat, std::string& out)
+	{
+		if (longFormat)
+		{
+			char DirAttr;
+			char WriteAttr;
+
+			SYSTEMTIME stUTC, stLocal;
+			FILETIME lastWriteTime;
+			lastWriteTime.dwLowDateTime = (DWORD)entry.lastWriteTime;
+			lastWriteTime.dwHighDateTime = (DWORD)(entry.lastWriteTime >> 32);
+			// Convert the last-write time to local time.
+			FileTimeToSystemTime(&lastWriteTime, &stUTC);
+			SystemTimeToTzSpecificLocalTime(NULL, &stUTC, &stLocal);
+
+			char timeStringBuf[128];
+
+			// Build a string showing the date and time.
+			snprintf(timeStringBuf, 128, "%s %02d  %04d", numToMonth(stLocal.wMonth), stLocal.wDay, stLocal.wYear);
+
+			DirAttr = entry.isDirectory ? 'd' : '-';
+			WriteAttr = entry.readOnly ? '-' : 'w';
+
+			char attributesBuf[256];
+			snprintf(attributesBuf, sizeof(attributesBuf), "%cr%c-r%c-r%c-   1 root  root    %7llu %s ",
+				DirAttr, WriteAttr, WriteAttr, WriteAttr,
+				(unsigned long long)entry.size,
+				timeStringBuf);
+			out += attributesBuf;
+		}
+		out += entry.name;
+		out += "\r\n";
+	}
+
+	TinyFTPTreeListing::TinyFTPTreeListing(TinyFTPFileSystem& in_fileSystem, asio::thread_pool& in_pool, size_t in_maxScanners, bool in_longFormat)
+		: fileSystem(in_fileSystem),
+		pool(in_pool),
+		maxScanners(in_maxScanners ? in_maxScanners : 1),
+		longFormat(in_longFormat),
+		blockedOn(0),
+		activeScanners(0),
+		bufferedBytes(0),
+		cancelled(false)
+	{
+	}
+
+	void TinyFTPTreeListing::start(const std::string& directory, const std::string& displayName, std::function<void()> in_onReady)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		onReady = in_onReady;
+		root.reset(new Node);
+		root->path = directory;
+		root->displayName = displayName;
+		pending.push_back(root.get());
+		outputPath.push_back(root.get());
+		startScanners();
+	}
+
+	bool TinyFTPTreeListing::take(std::string& out)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		while (!outputPath.empty())
+		{
+			Node* node = outputPath.back();
+			if (!node->scanned)
+			{
+				// scanners may have paused with this one still queued, it goes first and past the limit
+				blockedOn = node;
+				if (!node->scanning)
+				{
+					for (std::deque<Node*>::iterator it = pending.begin(); it != pending.end(); ++it)
+						if (*it == node)
+						{
+							pending.erase(it);
+							break;
+						}
+					pending.push_front(node);
+				}
+				break;
+			}
+			if (!node->text.empty())
+			{
+				bufferedBytes -= node->text.size();
+				out += node->text;
+				std::string().swap(node->text);
+			}
+			if (node->nextChild < node->children.size())
+				outputPath.push_back(node->children[node->nextChild++].get());
+			else
+			{
+				// everything below it is out
+				node->children.clear();
+				outputPath.pop_back();
+			}
+		}
+		startScanners();
+		return outputPath.empty();
+	}
+
+	void TinyFTPTreeListing::cancel()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		cancelled = true;
+		pending.clear();
+	}
+
+	void TinyFTPTreeListing::startScanners()
+	{
+		while (!cancelled && activeScanners < maxScanners && activeScanners < pending.size()
+			&& (bufferedBytes <= MAX_BUFFERED_BYTES || pending.front() == blockedOn))
+		{
+			++activeScanners;
+			std::shared_ptr<TinyFTPTreeListing> self = shared_from_this();
+			asio::post(pool, [self]() { self->scan(); });
+		}
+	}
+
+	void TinyFTPTreeListing::scan()
+	{
+		for (;;)
+		{
+			Node* node;
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				if (cancelled || pending.empty() || (bufferedBytes > MAX_BUFFERED_BYTES && pending.front() != blockedOn))
+				{
+					--activeScanners;
+					return;
+				}
+				node = pending.front();
+				pending.pop_front();
+				node->scanning = true;
+			}
+
+			// nodes only go away once the output is past them, and it can't get past one being scanned
+			std::vector<TinyFTPFileInfo> entries;
+			fileSystem.list(node->path, entries);
+			std::string text;
+			if (node != root.get())
+				text += "\r\n";
+			text += node->displayName + ":\r\n";
+			std::vector<std::unique_ptr<Node>> children;
+			for (const TinyFTPFileInfo& entry : entries)
+			{
+				appendListEntry(entry, longFormat, text);
+				if (!entry.isDirectory || entry.isReparsePoint)
+					continue;
+				std::unique_ptr<Node> child(new Node);
+				child->path = node->path + "\\" + entry.name;
+				child->displayName = node->displayName + "/" + entry.name;
+				children.push_back(std::move(child));
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				node->text.swap(text);
+				bufferedBytes += node->text.size();
+				// depth first: the first subdirectory is next in the output, so it goes to the front
+				for (std::vector<std::unique_ptr<Node>>::reverse_iterator it = children.rbegin(); it != children.rend() && !cancelled; ++it)
+					pending.push_front(it->get());
+				node->children.swap(children);
+				node->scanning = false;
+				node->scanned = true;
+				if (node == blockedOn)
+					blockedOn = 0;
+				startScanners();
+			}
+			onReady();
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef IK80_TINYFTPLISTING_H_
+#define IK80_TINYFTPLISTING_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <asio/thread_pool.hpp>
+
+#include "TinyFTPFileSystem.h"
+
+namespace TinyWinFTP
+{
+	/// Order and window of the LIST, NLST and STAT listings of a session, from SITE SORT and SITE PAGE.
+	struct TinyFTPListOptions
+	{
+		enum SortKey
+		{
+			SORT_NONE,
+			SORT_NAME,
+			SORT_SIZE,
+			SORT_TIME
+		};
+		SortKey sortKey = SORT_NONE;
+		bool descending = false;
+		// entries skipped, and how many are shown after them, 0 = all
+		size_t offset = 0;
+		size_t limit = 0;
+	};
+
+	/// Sorts entries and cuts them down to the page. Only what comes before the end of the page is put in
+	/// order, the rest of a big directory just gets partitioned away.
+	void applyListOptions(const TinyFTPListOptions& options, std::vector<TinyFTPFileInfo>& entries);
+
+	/// One LIST line ("-rw-r--r--   1 root  root ...") or, short, just the name. Both end in CRLF.
+	void appendListEntry(const TinyFTPFileInfo& entry, bool longFormat, std::string& out);
+
+	/// LIST -R / SITE TREE: the subtree is scanned by up to maxScanners tasks on the pool while the session
+	/// sends what is ready. Output is in ls -R order (every directory, then its subdirectories depth first,
+	/// each in listing order) however the scans finish. Scanners take the most recently found directory
+	/// first, which keeps them close to where the output is, and pause when too much finished output waits
+	/// for a slow client, except for the directory the output is stuck on.
+	class TinyFTPTreeListing
+		: public std::enable_shared_from_this<TinyFTPTreeListing>
+	{
+	public:
+		// finished output held back before scanners pause
+		static const size_t MAX_BUFFERED_BYTES = 4 * 1024 * 1024;
+
+		TinyFTPTreeListing(TinyFTPFileSystem& fileSystem, asio::thread_pool& pool, size_t maxScanners, bool longFormat);
+
+		/// Starts scanning directory, shown as displayName. onReady is called from the pool every time
+		/// a directory is done; it may find nothing new to take.
+		void start(const std::string& directory, const std::string& displayName, std::function<void()> onReady);
+		/// Moves the output that is ready, in order, to the end of out. True once all of it has been taken.
+		bool take(std::string& out);
+		/// Scanners stop after the directory they are on.
+		void cancel();
+
+	private:
+		struct Node
+		{
+			std::string path;
+			std::string displayName;
+			bool scanning = false;
+			bool scanned = false;
+			std::string text;
+			std::vector<std::unique_ptr<Node>> children;
+			// output: the next child to descend into
+			size_t nextChild = 0;
+		};
+
+		void scan();
+		// caller holds mutex
+		void startScanners();
+
+		TinyFTPFileSystem& fileSystem;
+		asio::thread_pool& pool;
+		size_t maxScanners;
+		bool longFormat;
+		std::function<void()> onReady;
+
+		std::mutex mutex;
+		std::unique_ptr<Node> root;
+		std::deque<Node*> pending;
+		// path of the output through the tree, the top is the next directory to print
+		std::vector<Node*> outputPath;
+		Node* blockedOn;
+		size_t activeScanners;
+		size_t bufferedBytes;
+		bool cancelled;
+
+		TinyFTPTreeListing(const TinyFTPTreeListing& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPLISTING_H_
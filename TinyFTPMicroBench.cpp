@@ -0,0 +1,506 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/read.hpp>
+#include <asio/write.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/bind_allocator.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include "LFMPMCQueue.h"
+#include "TinyFTPHandlerAllocator.h"
+#include "TinyFTPListing.h"
+#include "TinyFTPPath.h"
+#include "TinyFTPRequestParser.h"
+#include "TinyFTPUploadPipe.h"
+
+// ftpmicrobench: the CPU-bound pieces every command goes through, one at a time, in ns per operation.
+using namespace TinyWinFTP;
+
+namespace
+{
+	// every operator new in the process, the allocation benchmarks read it around the work they measure
+	std::atomic<uint64_t> heapAllocations(0);
+}
+
+void* operator new(std::size_t size)
+{
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* pointer = malloc(size ? size : 1))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+	free(pointer);
+}
+
+namespace
+{
+	const size_t PATH_BUFFER_SIZE = 32768;
+	const size_t UPLOAD_WARMUP_CHUNKS = 64;
+	const char CONTROL_REQUEST[] = "NOOP\r\n";
+	const char CONTROL_REPLY[] = "200 NOOP ok\r\n";
+
+	const char* COMMAND_LINES[] =
+	{
+		"NOOP\r\n",
+		"USER anonymous\r\n",
+		"SIZE /pub/releases/2024/build-1234/TinyWinFTP-x64.zip\r\n",
+		"RETR /pub/releases/2024/build-1234/TinyWinFTP-x64.zip\r\n",
+		"XSHA256 /pub/releases/2024/build-1234/TinyWinFTP-x64.zip\r\n",
+		"BOGUS command\r\n"
+	};
+
+	// depth components of "dirN/"
+	std::string deepPath(int depth, bool absolute)
+	{
+		std::string path = absolute ? "/" : "";
+		for (int i = 0; i < depth; ++i)
+			path += "dir" + std::to_string(i) + "/";
+		return path + "file.bin";
+	}
+
+	// down depth levels and back up half of them with "..", the way clients walk a tree with CWD
+	std::string dotDotPath(int depth)
+	{
+		std::string path = deepPath(depth, true);
+		path.resize(path.size() - strlen("file.bin"));
+		for (int i = 0; i < depth / 2; ++i)
+			path += "../";
+		return path + "file.bin";
+	}
+
+	std::vector<TinyFTPFileInfo> makeEntries(size_t count)
+	{
+		std::vector<TinyFTPFileInfo> entries(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			entries[i].name = "file-" + std::to_string(i) + ".dat";
+			entries[i].isDirectory = i % 16 == 0;
+			entries[i].readOnly = i % 7 == 0;
+			entries[i].size = i * 4099;
+			// 2024-01-01 plus i seconds, in FILETIME ticks
+			entries[i].lastWriteTime = 133485408000000000ULL + i * 10000000ULL;
+		}
+		return entries;
+	}
+
+	void copyPath(const std::string& path, std::vector<char>& buffer)
+	{
+		memcpy(buffer.data(), path.c_str(), path.size() + 1);
+	}
+
+	void connectLoopback(asio::io_context& io, asio::ip::tcp::socket& client, asio::ip::tcp::socket& server)
+	{
+		asio::ip::tcp::acceptor acceptor(io, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		client.connect(acceptor.local_endpoint());
+		acceptor.accept(server);
+	}
+
+	// where operation state comes from, and how often asio asked for it
+	struct HandlerSource
+	{
+		// null: the heap, one allocation per operation
+		TinyFTPHandlerMemory* memory = nullptr;
+		uint64_t requests = 0;
+	};
+
+	template <typename T>
+	class CountingHandlerAllocator
+	{
+	public:
+		typedef T value_type;
+
+		explicit CountingHandlerAllocator(HandlerSource& in_source) noexcept : source(&in_source)
+		{
+		}
+
+		template <typename U>
+		CountingHandlerAllocator(const CountingHandlerAllocator<U>& other) noexcept : source(other.source)
+		{
+		}
+
+		bool operator==(const CountingHandlerAllocator& other) const noexcept
+		{
+			return source == other.source;
+		}
+
+		bool operator!=(const CountingHandlerAllocator& other) const noexcept
+		{
+			return source != other.source;
+		}
+
+		T* allocate(std::size_t n) const
+		{
+			++source->requests;
+			if (source->memory)
+				return static_cast<T*>(source->memory->allocate(sizeof(T) * n));
+			return static_cast<T*>(::operator new(sizeof(T) * n));
+		}
+
+		void deallocate(T* pointer, std::size_t /*n*/) const
+		{
+			if (source->memory)
+				source->memory->deallocate(pointer);
+			else
+				::operator delete(pointer);
+		}
+
+	private:
+		template <typename> friend class CountingHandlerAllocator;
+
+		HandlerSource* source;
+	};
+
+	// the control connection before the coroutines: a std::bind of a member and shared_from_this() per hop,
+	// no allocator, so asio serves them as it did then, from its per-thread cache or the heap.
+	class CallbackControl : public std::enable_shared_from_this<CallbackControl>
+	{
+	public:
+		CallbackControl(asio::ip::tcp::socket& in_socket, uint64_t& in_replies)
+			: socket(in_socket),
+			replies(in_replies)
+		{
+		}
+
+		void start()
+		{
+			socket.async_read_some(asio::buffer(request),
+				std::bind(&CallbackControl::handleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+		}
+
+	private:
+		void handleRead(const asio::error_code& e, std::size_t)
+		{
+			if (e)
+				return;
+			asio::async_write(socket, asio::buffer(CONTROL_REPLY, sizeof(CONTROL_REPLY) - 1),
+				std::bind(&CallbackControl::handleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+		}
+
+		void handleWrite(const asio::error_code& e, std::size_t)
+		{
+			if (e)
+				return;
+			++replies;
+			start();
+		}
+
+		asio::ip::tcp::socket& socket;
+		uint64_t& replies;
+		std::array<char, 64> request;
+	};
+
+	// and with them: one coroutine, its operations taking TinyFTPHandlerMemory through the session token
+	asio::awaitable<void> coroutineControl(asio::ip::tcp::socket& socket, HandlerSource& source, uint64_t& replies)
+	{
+		std::array<char, 64> request;
+		for (;;)
+		{
+			asio::error_code e;
+			co_await socket.async_read_some(asio::buffer(request), asio::bind_allocator(CountingHandlerAllocator<void>(source), asio::redirect_error(asio::use_awaitable, e)));
+			if (e)
+				co_return;
+			co_await asio::async_write(socket, asio::buffer(CONTROL_REPLY, sizeof(CONTROL_REPLY) - 1), asio::bind_allocator(CountingHandlerAllocator<void>(source), asio::redirect_error(asio::use_awaitable, e)));
+			if (e)
+				co_return;
+			++replies;
+		}
+	}
+
+	// an upload through the pipe TinyFTPSession::receiveUpload runs, with the session's handler memory and tokens:
+	// the reader fills buffers from a loopback socket the client keeps sending on, the writer counts the chunks
+	// instead of writing them to disk.
+	class UploadLoop
+	{
+	public:
+		UploadLoop()
+			: client(io),
+			server(io),
+			outgoing(RECV_BUFFER_SIZE, 'x'),
+			chunksWritten(0)
+		{
+			connectLoopback(io, client, server);
+			for (TinyFTPUploadBuffer*& pBuffer : buffers)
+				pBuffer = new TinyFTPUploadBuffer;
+			send();
+			asio::co_spawn(io, receive(), asio::detached);
+		}
+
+		~UploadLoop()
+		{
+			asio::error_code ignored_ec;
+			client.close(ignored_ec);
+			server.close(ignored_ec);
+			io.run();
+			for (TinyFTPUploadBuffer* pBuffer : buffers)
+				delete pBuffer;
+		}
+
+		void runChunks(uint64_t count)
+		{
+			uint64_t target = chunksWritten + count;
+			while (chunksWritten < target)
+				io.run_one();
+		}
+
+	private:
+		void send()
+		{
+			asio::async_write(client, asio::buffer(outgoing), asio::bind_allocator(TinyFTPHandlerAllocator<void>(clientMemory),
+				[this](const asio::error_code& e, std::size_t)
+			{
+				if (!e)
+					send();
+			}));
+		}
+
+		// TinyFTPSession::sessionToken()
+		auto token(asio::error_code& e)
+		{
+			return asio::bind_allocator(TinyFTPHandlerAllocator<void>(sessionMemory), asio::redirect_error(asio::use_awaitable, e));
+		}
+
+		// TinyFTPSession::readUploadBuffer() without ALLO: whole buffers until the client closes
+		asio::awaitable<std::size_t> readBuffer(TinyFTPUploadBuffer& buffer, asio::error_code& e, bool& last)
+		{
+			std::size_t bytes = co_await asio::async_read(server, asio::buffer(buffer), token(e));
+			last = (e == asio::error::eof);
+			co_return bytes;
+		}
+
+		asio::awaitable<bool> writeChunk(TinyFTPUploadChunk chunk)
+		{
+			++chunksWritten;
+			co_return true;
+		}
+
+		asio::awaitable<void> receive()
+		{
+			auto pipe = makeUploadPipe(io, sessionMemory,
+				[this](TinyFTPUploadBuffer& buffer, asio::error_code& e, bool& last) { return readBuffer(buffer, e, last); },
+				[this](TinyFTPUploadChunk chunk) { return writeChunk(chunk); });
+			co_await pipe.run(buffers);
+		}
+
+		asio::io_context io;
+		TinyFTPHandlerMemory sessionMemory;
+		TinyFTPHandlerMemory clientMemory;
+		asio::ip::tcp::socket client;
+		asio::ip::tcp::socket server;
+		std::vector<char> outgoing;
+		std::array<TinyFTPUploadBuffer*, UPLOAD_BUFFER_COUNT> buffers;
+		uint64_t chunksWritten;
+	};
+}
+
+static void BM_ParseCommand(benchmark::State& state)
+{
+	TinyFTPRequestParser parser;
+	TinyFTPRequest request;
+	std::string line = COMMAND_LINES[state.range(0)];
+	for (auto _ : state)
+	{
+		char* begin = &line[0];
+		char* end = begin + line.size();
+		benchmark::DoNotOptimize(parser.parse(request, begin, end));
+		benchmark::DoNotOptimize(request.param.data());
+	}
+	state.SetLabel(line.substr(0, line.find_first_of(" \r")));
+}
+BENCHMARK(BM_ParseCommand)->DenseRange(0, sizeof(COMMAND_LINES) / sizeof(COMMAND_LINES[0]) - 1);
+
+// path argument of RETR/STOR/DELE..., arg 0 is the depth, arg 1 whether it is absolute
+static void BM_TranslatePath(benchmark::State& state)
+{
+	std::string docRoot = "C:\\ftproot";
+	std::string curDirectory = "\\pub\\releases";
+	std::string path = deepPath((int)state.range(0), state.range(1) != 0);
+	std::vector<char> buffer(PATH_BUFFER_SIZE);
+	for (auto _ : state)
+	{
+		copyPath(path, buffer);
+		benchmark::DoNotOptimize(translateClientPath(docRoot, curDirectory, buffer.data(), buffer.size()));
+	}
+}
+BENCHMARK(BM_TranslatePath)->ArgsProduct({ { 1, 4, 16, 64 }, { 0, 1 } });
+
+static void BM_TranslatePathDotDot(benchmark::State& state)
+{
+	std::string docRoot = "C:\\ftproot";
+	std::string curDirectory = "\\";
+	std::string path = dotDotPath((int)state.range(0));
+	std::vector<char> buffer(PATH_BUFFER_SIZE);
+	for (auto _ : state)
+	{
+		copyPath(path, buffer);
+		benchmark::DoNotOptimize(translateClientPath(docRoot, curDirectory, buffer.data(), buffer.size()));
+	}
+}
+BENCHMARK(BM_TranslatePathDotDot)->Arg(4)->Arg(16)->Arg(64);
+
+// CWD from a directory range(0) levels deep: one level down, then "..", then range(0) levels up
+static void BM_ResolveDirectory(benchmark::State& state)
+{
+	std::string docRoot = "C:\\ftproot";
+	std::string curDirectory = deepPath((int)state.range(0), true);
+	curDirectory.resize(curDirectory.size() - strlen("/file.bin"));
+	for (char& c : curDirectory)
+		if (c == '/')
+			c = '\\';
+	std::string upToRoot;
+	for (int64_t i = 0; i < state.range(0); ++i)
+		upToRoot += "../";
+	const std::string arguments[] = { "next", "..", upToRoot };
+	std::vector<char> buffer(PATH_BUFFER_SIZE);
+	size_t next = 0;
+	for (auto _ : state)
+	{
+		copyPath(arguments[next++ % 3], buffer);
+		benchmark::DoNotOptimize(resolveDirectoryPath(docRoot, curDirectory, buffer.data()));
+	}
+}
+BENCHMARK(BM_ResolveDirectory)->Arg(1)->Arg(8)->Arg(32);
+
+// whole LIST (arg 1 = 1) or NLST body of a directory with range(0) entries
+static void BM_FormatListing(benchmark::State& state)
+{
+	std::vector<TinyFTPFileInfo> entries = makeEntries((size_t)state.range(0));
+	bool longFormat = state.range(1) != 0;
+	std::string out;
+	for (auto _ : state)
+	{
+		out.clear();
+		for (const TinyFTPFileInfo& entry : entries)
+			appendListEntry(entry, longFormat, out);
+		benchmark::DoNotOptimize(out.data());
+	}
+	state.SetItemsProcessed(state.iterations() * (int64_t)entries.size());
+	state.SetBytesProcessed(state.iterations() * (int64_t)out.size());
+}
+BENCHMARK(BM_FormatListing)->ArgsProduct({ { 1 << 10, 1 << 15, 1 << 20 }, { 0, 1 } })->Unit(benchmark::kMillisecond);
+
+// a push and a pop per iteration on one queue shared by every thread, like passive ports taken and returned
+static void BM_QueuePushPop(benchmark::State& state)
+{
+	static LFMPMCQueue<size_t>* queue;
+	if (state.thread_index() == 0)
+		queue = new LFMPMCQueue<size_t>(1024);
+	size_t value = (size_t)state.thread_index();
+	for (auto _ : state)
+	{
+		while (!queue->push(value))
+			;
+		while (!queue->pop(value))
+			;
+	}
+	state.SetItemsProcessed(state.iterations() * 2);
+	if (state.thread_index() == 0)
+	{
+		delete queue;
+		queue = 0;
+	}
+}
+BENCHMARK(BM_QueuePushPop)->ThreadRange(1, (int)std::max(1u, std::thread::hardware_concurrency()))->UseRealTime();
+
+// a NOOP round trip on a control connection per iteration, arg 0 the std::bind callbacks, 1 the coroutine with
+// handler memory. heap allocs is what reached operator new; handler allocs, for the coroutine only, what asio
+// asked the handler memory for.
+static void BM_HandlerAllocation(benchmark::State& state)
+{
+	asio::io_context io;
+	asio::ip::tcp::socket client(io);
+	asio::ip::tcp::socket server(io);
+	connectLoopback(io, client, server);
+	TinyFTPHandlerMemory memory;
+	HandlerSource source;
+	uint64_t replies = 0;
+	bool coroutine = state.range(0) != 0;
+	if (coroutine)
+	{
+		source.memory = &memory;
+		asio::co_spawn(io, coroutineControl(server, source, replies), asio::detached);
+	}
+	else
+		std::make_shared<CallbackControl>(server, replies)->start();
+
+	std::array<char, sizeof(CONTROL_REPLY) - 1> reply;
+	auto roundTrip = [&]()
+	{
+		asio::write(client, asio::buffer(CONTROL_REQUEST, sizeof(CONTROL_REQUEST) - 1));
+		uint64_t target = replies + 1;
+		while (replies < target)
+			io.run_one();
+		asio::read(client, asio::buffer(reply));
+	};
+	// the first round trips size the handler slots
+	for (int i = 0; i < 16; ++i)
+		roundTrip();
+
+	uint64_t requests = source.requests;
+	uint64_t allocations = 0;
+	for (auto _ : state)
+	{
+		uint64_t before = heapAllocations.load(std::memory_order_relaxed);
+		roundTrip();
+		allocations += heapAllocations.load(std::memory_order_relaxed) - before;
+	}
+	if (coroutine)
+		state.counters["handler allocs"] = benchmark::Counter((double)(source.requests - requests), benchmark::Counter::kAvgIterations);
+	state.counters["heap allocs"] = benchmark::Counter((double)allocations, benchmark::Counter::kAvgIterations);
+	state.SetLabel(coroutine ? "coroutine" : "callbacks");
+
+	asio::error_code ignored_ec;
+	client.close(ignored_ec);
+	server.close(ignored_ec);
+	io.run();
+}
+BENCHMARK(BM_HandlerAllocation)->Arg(0)->Arg(1);
+
+// one 256 KB upload chunk through socket read, channels and buffer return per iteration; fails if any of it
+// reaches operator new once the first chunks have sized the handler slots. asio's own per-thread cache for
+// coroutine frames uses aligned allocation and isn't counted here.
+static void BM_UploadSteadyState(benchmark::State& state)
+{
+	UploadLoop loop;
+	loop.runChunks(UPLOAD_WARMUP_CHUNKS);
+	uint64_t allocations = 0;
+	for (auto _ : state)
+	{
+		uint64_t before = heapAllocations.load(std::memory_order_relaxed);
+		loop.runChunks(1);
+		allocations += heapAllocations.load(std::memory_order_relaxed) - before;
+	}
+	state.counters["allocs"] = benchmark::Counter((double)allocations, benchmark::Counter::kAvgIterations);
+	state.SetBytesProcessed(state.iterations() * (int64_t)RECV_BUFFER_SIZE);
+	if (allocations)
+		state.SkipWithError("steady-state upload allocated");
+}
+BENCHMARK(BM_UploadSteadyState);
+
+BENCHMARK_MAIN();
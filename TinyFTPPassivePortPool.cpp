@@ -0,0 +1,83 @@
+#include <iostream>
+
+#include "TinyFTPPassivePortPool.h"
+#include "TinyFTPAddress.h"
+
+namespace TinyWinFTP
+{
+	TinyFTPPassivePortPool::TinyFTPPassivePortPool(asio::io_context& io_context, unsigned short firstPort, unsigned short lastPort)
+		: freeAcceptors(queueSizeFor(lastPort >= firstPort ? lastPort - firstPort + 1 : 0)),
+		closed(false)
+	{
+		for (unsigned int port = firstPort; port <= lastPort; ++port)
+		{
+			asio::error_code ec;
+			std::unique_ptr<asio::ip::tcp::acceptor> acceptor(new asio::ip::tcp::acceptor(io_context));
+			listenDualStack(*acceptor, (unsigned short)port, ec);
+			if (ec)
+			{
+				std::cout << "Passive port " << port << " unavailable: " << ec.message() << std::endl;
+				continue;
+			}
+			freeAcceptors.push(acceptor.get());
+			acceptors.push_back(std::move(acceptor));
+		}
+		std::cout << "Passive ports " << firstPort << "-" << lastPort << ": " << acceptors.size() << " bound" << std::endl;
+	}
+
+	asio::ip::tcp::acceptor* TinyFTPPassivePortPool::acquire()
+	{
+		asio::ip::tcp::acceptor* acceptor = nullptr;
+		if (!freeAcceptors.pop(acceptor))
+			return nullptr;
+
+		// previous owner may have left a connection nobody accepted in the backlog, drop it
+		asio::error_code ec;
+		acceptor->non_blocking(true, ec);
+		for (;;)
+		{
+			asio::ip::tcp::socket stale(acceptor->get_executor());
+			acceptor->accept(stale, ec);
+			if (ec)
+				break;
+			std::cout << "Passive port " << acceptor->local_endpoint(ec).port() << ": dropped stale connection" << std::endl;
+		}
+		acceptor->non_blocking(false, ec);
+		return acceptor;
+	}
+
+	void TinyFTPPassivePortPool::release(asio::ip::tcp::acceptor* acceptor)
+	{
+		if (!acceptor)
+			return;
+		if (closed)
+		{
+			asio::error_code ignored_ec;
+			acceptor->close(ignored_ec);
+			return;
+		}
+		freeAcceptors.push(acceptor);
+	}
+
+	void TinyFTPPassivePortPool::closeFree()
+	{
+		closed = true;
+		asio::ip::tcp::acceptor* acceptor = nullptr;
+		size_t count = 0;
+		while (freeAcceptors.pop(acceptor))
+		{
+			asio::error_code ignored_ec;
+			acceptor->close(ignored_ec);
+			++count;
+		}
+		std::cout << "Passive ports: " << count << " unbound" << std::endl;
+	}
+
+	size_t TinyFTPPassivePortPool::queueSizeFor(size_t count)
+	{
+		size_t queueSize = 2;
+		while (queueSize < count)
+			queueSize <<= 1;
+		return queueSize;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef IK80_TINYFTPPASSIVEPORTPOOL_H_
+#define IK80_TINYFTPPASSIVEPORTPOOL_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+
+#include "LFMPMCQueue.h"
+
+namespace TinyWinFTP
+{
+	/// Listening sockets for one io_context, bound once at startup and reused for every PASV/EPSV.
+	class TinyFTPPassivePortPool
+	{
+	public:
+		/// Binds every port in [firstPort, lastPort], ports already in use are skipped.
+		TinyFTPPassivePortPool(asio::io_context& io_context, unsigned short firstPort, unsigned short lastPort);
+
+		/// Hands out a listening acceptor, nullptr when all ports are taken.
+		asio::ip::tcp::acceptor* acquire();
+
+		/// Returns an acceptor handed out by acquire().
+		void release(asio::ip::tcp::acceptor* acceptor);
+
+		/// Server is draining: unbind every free port so a new instance can take them, ports in use close on release.
+		void closeFree();
+
+		size_t size() const
+		{
+			return acceptors.size();
+		}
+
+	private:
+		static size_t queueSizeFor(size_t count);
+
+		std::vector<std::unique_ptr<asio::ip::tcp::acceptor> > acceptors;
+		LFMPMCQueue<asio::ip::tcp::acceptor*> freeAcceptors;
+		std::atomic_bool closed;
+
+		TinyFTPPassivePortPool(const TinyFTPPassivePortPool& other) = delete;
+		TinyFTPPassivePortPool(TinyFTPPassivePortPool&& other) = delete;
+	};
+
+	using TinyFTPPassivePortPoolPtr = std::shared_ptr<TinyFTPPassivePortPool>;
+}
+
+#endif // IK80_TINYFTPPASSIVEPORTPOOL_H_
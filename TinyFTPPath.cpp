@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include <regex>
+
+#include "TinyFTPPath.h"
+
+namespace TinyWinFTP
+{
+	std::string resolveDirectoryPath(const std::string& docRoot, const std::string& curDirectory, char* szNewCurDir)
+	{
+		// replace all slashes
+		size_t inputLen = strlen(szNewCurDir);
+		for (size_t pos = 0; pos < inputLen; ++pos)
+			if (szNewCurDir[pos] == '/')
+				szNewCurDir[pos] = '\\';
+
+		// check for first slash (absolute path), combine with root as necessary
+		std::string newCombinedRoot;
+		if (szNewCurDir[0] == '\\')
+			newCombinedRoot = docRoot + szNewCurDir;
+		else
+			newCombinedRoot = docRoot + curDirectory + (curDirectory == "\\" ? "" : "\\") + szNewCurDir;
+		newCombinedRoot = std::regex_replace(newCombinedRoot, std::regex("\\\\[^\\\\]*\\\\\\.\\."), "");
+		newCombinedRoot = std::regex_replace(newCombinedRoot, std::regex("\\\\\\\\"), "\\");
+		while (newCombinedRoot.size() > 1 && *newCombinedRoot.rbegin() == '.')
+			newCombinedRoot = newCombinedRoot.substr(0, newCombinedRoot.size() - 1);
+		while (newCombinedRoot.size() > 1 && *newCombinedRoot.rbegin() == '\\')
+			newCombinedRoot = newCombinedRoot.substr(0, newCombinedRoot.size() - 1);
+
+		return newCombinedRoot;
+	}
+
+	char* translateClientPath(const std::string& docRoot, const std::string& curDirectory, char* pathToTranslate, size_t bufferSize)
+	{
+		// replace all slashes
+		size_t inputLen = strlen(pathToTranslate);
+		if (inputLen)
+		{
+			for (size_t pos = 0; pos < inputLen; ++pos)
+				if (pathToTranslate[pos] == '/')
+				{
+					pathToTranslate[pos] = '\\';
+				}
+		}
+
+		// check for first slash (absolute path), combine with root as necessary
+		std::string newCombinedPath;
+		if (pathToTranslate[0] == '\\')
+			newCombinedPath = docRoot + pathToTranslate;
+		else
+			newCombinedPath = docRoot + curDirectory + "\\" + pathToTranslate;
+
+		while (*newCombinedPath.rbegin() == '\\' && newCombinedPath.size() > 1)
+			newCombinedPath = newCombinedPath.substr(0, newCombinedPath.size() - 1);
+		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\\\[^\\\\]*\\\\\\.\\."), "");
+		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\\\\\\\"), "\\");
+		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\.\\\\"), "");
+
+		strncpy_s(pathToTranslate, bufferSize, "\\\\?\\", strlen("\\\\?\\"));
+		strncpy_s(pathToTranslate + strlen("\\\\?\\"), bufferSize - strlen("\\\\?\\"), newCombinedPath.c_str(), newCombinedPath.size());
+
+		return pathToTranslate;
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef IK80_TINYFTPPATH_H_
+#define IK80_TINYFTPPATH_H_
+
+#include <string>
+
+namespace TinyWinFTP
+{
+	/// Directory a CWD argument leads to from curDirectory, as a full path under docRoot without a trailing
+	/// backslash. Slashes in newCurDir are turned into backslashes in place; ".." is folded away.
+	std::string resolveDirectoryPath(const std::string& docRoot, const std::string& curDirectory, char* newCurDir);
+
+	/// Rewrites the client path in buffer (bufferSize bytes) in place into the \\?\ form of the file under
+	/// docRoot it names, relative ones are taken from curDirectory. Returns buffer.
+	char* translateClientPath(const std::string& docRoot, const std::string& curDirectory, char* buffer, size_t bufferSize);
+}
+
+#endif // IK80_TINYFTPPATH_H_
@@ -40,6 +40,47 @@ namespace TinyWinFTP
 		const char unimplemented_command[] = "500 command not implemented\r\n";
 		const char bad_request[] = "550 bad request\r\n";
 		const char bye[] = "221 goodbye\r\n";
+		const char cant_open_data_connection[] = "425 Can't open data connection\r\n";
+		const char no_data_connection[] = "425 No data connection, send PASV or EPSV first\r\n";
+		const char epsv_all_successful[] = "200 EPSV ALL command successful\r\n";
+		const char pasv_ipv4_only[] = "425 PASV needs IPv4, use EPSV\r\n";
+		const char eprt_unsupported_protocol[] = "522 Network protocol not supported, use (1,2)\r\n";
+		const char idle_timeout[] = "421 Idle timeout, closing control connection\r\n";
+		const char server_draining[] = "421 Server restarting, please reconnect\r\n";
+		const char transfer_aborted[] = "451 Transfer aborted: local error in processing\r\n";
+		const char mode_s_successful[] = "200 Mode set to S\r\n";
+		const char mode_z_successful[] = "200 Mode set to Z\r\n";
+		const char mode_b_successful[] = "200 Mode set to B\r\n";
+		const char mode_not_supported[] = "504 Mode not supported\r\n";
+		const char stor_in_mode_z[] = "504 STOR not supported in MODE Z, use MODE S\r\n";
+		const char opts_successful[] = "200 OPTS command successful\r\n";
+		const char opts_not_understood[] = "501 Option not understood\r\n";
+		const char unknown_hash_algorithm[] = "504 Unknown hash algorithm\r\n";
+		const char cpfr_successful[] = "350 File exists, ready for destination name\r\n";
+		const char copy_started[] = "150-Copying on the server\r\n";
+		const char copy_finished[] = "150 Copy finished\r\n250 CPTO command successful\r\n";
+		const char copy_failed[] = "150 Copy failed\r\n550 Error\r\n";
+		const char cpto_without_cpfr[] = "503 Bad sequence of commands, send SITE CPFR first\r\n";
+		const char site_help[] = "214-The following SITE commands are recognized\r\n CPFR CPTO MGET TREE DU SORT PAGE STATS HELP\r\n214 Help OK\r\n";
+		const char auth_tls_successful[] = "234 AUTH TLS successful\r\n";
+		const char tls_not_available[] = "431 TLS not available\r\n";
+		const char tls_already_active[] = "503 TLS already active\r\n";
+		const char auth_not_understood[] = "504 Security mechanism not understood\r\n";
+		const char pbsz_successful[] = "200 PBSZ=0\r\n";
+		const char prot_needs_tls[] = "503 PROT needs AUTH TLS first\r\n";
+		const char prot_c_successful[] = "200 Protection level set to Clear\r\n";
+		const char prot_p_successful[] = "200 Protection level set to Private\r\n";
+		const char prot_not_supported[] = "536 Protection level not supported\r\n";
+		const char data_tls_failed[] = "522 TLS negotiation on the data connection failed\r\n";
+		const char mget_needs_mode_s[] = "504 SITE MGET needs MODE S\r\n";
+		const char mget_nothing_matched[] = "550 No files found\r\n";
+		const char needs_local_files[] = "504 Not available for files served from memory\r\n";
+		const char sort_successful[] = "200 Listing order set\r\n";
+		const char page_successful[] = "200 Listing page set\r\n";
+		const char quota_exceeded[] = "552 Quota exceeded\r\n";
+		const char du_needs_size_index[] = "502 SITE DU needs --size-index\r\n";
+		const char du_index_not_ready[] = "450 Size index not ready yet, try again later\r\n";
+		const char syntax_error_in_parameters[] = "501 Syntax error in parameters or arguments\r\n";
 	} // namespace stock_replies
 }
 #endif // IK80_TINYFTPREPLY_H_
@@ -50,6 +50,18 @@ namespace TinyWinFTP
 			sNOOP,
 			ALLO,
 			sALLO,
+			EPSV,
+			EPRT,
+			HASH,
+			XCRC,
+			XMD5,
+			XSHA,
+			XSHA1,
+			XSHA256,
+			XSHA512,
+			AUTH,
+			PBSZ,
+			PROT,
 			UNKNOWN_COMMAND
 		};
 
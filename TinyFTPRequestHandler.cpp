@@ -1,6 +1,7 @@
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -18,184 +19,616 @@
 #include "TinyFTPSession.h"
 #include "TinyFTPRequest.h"
 #include "TinyFTPReply.h"
+#include "TinyFTPAddress.h"
+#include "TinyFTPCopy.h"
+#include "TinyFTPArchive.h"
+#include "TinyFTPListing.h"
 
 namespace TinyWinFTP
 {
-	TinyFTPRequestHandler::TinyFTPRequestHandler()
-		: rnFrString(""),
-		curMaxPassivePort(PASV_PORT_RANGE_START),
-		reusablePassivePorts(8192)
+	TinyFTPRequestHandler::TinyFTPRequestHandler(TinyFTPServices& in_services)
+		: services(in_services)
 	{
 	}
 
 	void TinyFTPRequestHandler::ServiceRetrCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
 	{
+		// MODE Z compresses from a real file on the worker pool
+		if (pSession->isModeZ() && !services.fileSystem->isLocal())
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::needs_local_files, sizeof(StatusStrings::needs_local_files) - 1), asio::transfer_all());
+			return;
+		}
+
 		// File opened succesfully, so make the connection
 		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opening_binary_connection, sizeof(StatusStrings::opening_binary_connection) - 1), asio::transfer_all());
 
-		if (pSession->isPassiveMode())
-			pSession->startDataSocketPasv();
-		else
-			pSession->startDataSocketRemote();
-
-		// TODO: Transfer file
-		pSession->startFileTransfer(std::string(filename));
-		pSession->dataOpInProgress = true;
+		// the transfer starts once the client is connected, the 425 comes from the session if it doesn't
+		std::string file(filename);
+		pSession->startDataSocket([file](TinyFTPSession& session) { session.startFileTransfer(file); });
 	}
 
 
 	void TinyFTPRequestHandler::ServiceStorCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
 	{
+		// up front, an upload of unknown size is let in while there is room left
+		if (!services.sizeIndex.fitsQuota(filename, pSession->getAlloSize()))
+		{
+			pSession->setAlloSize(-1);
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::quota_exceeded, sizeof(StatusStrings::quota_exceeded) - 1), asio::transfer_all());
+			return;
+		}
+
 		// File opened succesfully, so make the connection
 		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opening_binary_connection, sizeof(StatusStrings::opening_binary_connection) - 1), asio::transfer_all());
 
-		if (pSession->isPassiveMode())
-			pSession->startDataSocketPasv();
-		else
-			pSession->startDataSocketRemote();
-
-		// TODO: Transfer file
-		pSession->startFileUpload(std::string(filename));
-		pSession->dataOpInProgress = true;
+		std::string file(filename);
+		pSession->startDataSocket([file](TinyFTPSession& session) { session.startFileUpload(file); });
 	}
 
 
 	void TinyFTPRequestHandler::ServiceStatCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
 	{
-		struct stat FileStat;
-		struct tm tm;
-		char RepBuf[50];
-
-		if (stat(filename, &FileStat))
+		std::string path(filename);
+		TinyFTPRequest::FTPRequestType type = req.type;
+		pSession->runBlocking(BLOCKING_STAT, [this, path, type]()
 		{
-			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
-			return;
-		}
+			TinyFTPFileInfo info;
+			struct tm tm;
+			char RepBuf[50];
 
-		if (FileStat.st_mode & _S_IFDIR)
-		{
-			// Its a directory.
-			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error_not_a_plain_file, sizeof(StatusStrings::error_not_a_plain_file) - 1), asio::transfer_all());
-			return;
-		}
+			if (!services.fileSystem->stat(path, info))
+				return std::string(StatusStrings::error);
 
+			if (info.isDirectory)
+			{
+				// Its a directory.
+				return std::string(StatusStrings::error_not_a_plain_file);
+			}
 
-		switch (req.type)
-		{
-		case TinyFTPRequest::MDTM:
-			localtime_s(&tm, &FileStat.st_mtime);
+			switch (type)
+			{
+			case TinyFTPRequest::MDTM:
+			{
+				// FILETIME counts 100ns from 1601
+				time_t lastWriteTime = (time_t)((info.lastWriteTime - 116444736000000000ull) / 10000000);
+				localtime_s(&tm, &lastWriteTime);
 
-			snprintf(RepBuf, MAX_REPLY_LEN, "213 %04d%02d%02d%02d%02d%02d\r\n",
-				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-				tm.tm_hour, tm.tm_min, tm.tm_sec);
+				snprintf(RepBuf, sizeof(RepBuf), "213 %04d%02d%02d%02d%02d%02d\r\n",
+					tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+					tm.tm_hour, tm.tm_min, tm.tm_sec);
+			}
 			break;
 
-		case TinyFTPRequest::xSIZE:
-			snprintf(RepBuf, MAX_REPLY_LEN, "213 %u\r\n", FileStat.st_size);
-			break;
+			case TinyFTPRequest::xSIZE:
+				snprintf(RepBuf, sizeof(RepBuf), "213 %llu\r\n", (unsigned long long)info.size);
+				break;
 
-		default:
-			// Internal screwup!
-			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
-			break;
-		}
-		rep.content = RepBuf;
+			default:
+				// Internal screwup!
+				return std::string(StatusStrings::error);
+			}
+			return std::string(RepBuf);
+		});
 	}
 
 	namespace
 	{
-		const char* numToMonth(WORD month)
+		// LIST, NLST and STAT options come before the path: -l, -a and -la are what we do anyway, R recurses
+		void stripListOptions(char* arguments, bool& recursive)
 		{
-			if (month < 1 || month > 12)
-				abort();
-			static const char* MONTH_NAMES[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-			return MONTH_NAMES[month-1];
+			recursive = false;
+			char* path = arguments;
+			while (*path == '-')
+			{
+				for (; *path && *path != ' '; ++path)
+					if (*path == 'R')
+						recursive = true;
+				while (*path == ' ')
+					++path;
+			}
+			memmove(arguments, path, strlen(path) + 1);
+		}
+
+		// a wildcard in the last component of a translated path is a pattern for the directory before it
+		void splitPattern(std::string& directory, std::string& pattern)
+		{
+			size_t lastSlash = directory.find_last_of('\\');
+			if (lastSlash != std::string::npos && directory.find_first_of("*?", lastSlash) != std::string::npos)
+			{
+				pattern = directory.substr(lastSlash + 1);
+				directory.resize(lastSlash);
+			}
+		}
+
+		// LIST/NLST body, on the blocking pool
+		std::string readListing(TinyFTPFileSystem& fileSystem, const std::string& directory, const std::string& pattern, const TinyFTPListOptions& options, bool longFormat)
+		{
+			std::string listing;
+			std::vector<TinyFTPFileInfo> entries;
+			fileSystem.list(directory, pattern, entries);
+			applyListOptions(options, entries);
+			for (const TinyFTPFileInfo& entry : entries)
+				appendListEntry(entry, longFormat, listing);
+			return listing;
 		}
 	}
 
 	void TinyFTPRequestHandler::ServiceListCommands(char *filename, BOOL Long, BOOL UseCtrlConn, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
 	{
-		char repbuf[MAX_REPLY_LEN];
-		BOOL ListAll = FALSE;
+		// read on the blocking pool; STAT replies with the listing itself, LIST and NLST send it from the session
+		std::string directory(filename), pattern;
+		splitPattern(directory, pattern);
+		TinyFTPListOptions options = pSession->getListOptions();
+		bool longFormat = Long != FALSE;
+		std::function<std::string()> readDirectory = [this, directory, pattern, options, longFormat]()
+		{
+			return readListing(*services.fileSystem, directory, pattern, options, longFormat);
+		};
+		if (UseCtrlConn)
+		{
+			pSession->runBlocking(BLOCKING_LIST, readDirectory);
+			return;
+		}
 
-		if (!UseCtrlConn)
+		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opening_connection, sizeof(StatusStrings::opening_connection) - 1), asio::transfer_all());
+
+		pSession->startDataSocket([readDirectory](TinyFTPSession& session)
 		{
-			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opening_connection, sizeof(StatusStrings::opening_connection) - 1), asio::transfer_all());
+			session.runBlocking(BLOCKING_LIST, readDirectory, [](TinyFTPSession& session, const std::string& listing)
+			{
+				session.startListingTransfer(listing);
+				return std::string();
+			});
+		});
+	}
 
-			if (pSession->isPassiveMode())
-				pSession->startDataSocketPasv();
-			else
+	void TinyFTPRequestHandler::ServiceTreeListCommand(char *directory, const std::string& displayName, BOOL Long, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		// -R on a file lists just the file, that listing is read with the stat
+		std::string path(directory), listDirectory(directory), pattern;
+		splitPattern(listDirectory, pattern);
+		TinyFTPListOptions options = pSession->getListOptions();
+		bool longFormat = Long != FALSE;
+		std::shared_ptr<bool> isTree = std::make_shared<bool>(false);
+		pSession->runBlocking(BLOCKING_STAT, [this, path, listDirectory, pattern, options, longFormat, isTree]()
+		{
+			TinyFTPFileInfo info;
+			*isTree = services.fileSystem->stat(path, info) && info.isDirectory;
+			if (*isTree)
+				return std::string();
+			return readListing(*services.fileSystem, listDirectory, pattern, options, longFormat);
+		}, [path, displayName, longFormat, isTree](TinyFTPSession& session, const std::string& listing)
+		{
+			asio::write(session.getSocket(), asio::buffer(StatusStrings::opening_connection, sizeof(StatusStrings::opening_connection) - 1), asio::transfer_all());
+
+			if (!*isTree)
+			{
+				session.startDataSocket([listing](TinyFTPSession& session) { session.startListingTransfer(listing); });
+				return std::string();
+			}
+			// scanned on the worker pool and sent as it comes, the 226 follows from the session
+			session.startDataSocket([path, displayName, longFormat](TinyFTPSession& session)
+			{
+				session.startTreeTransfer(path, displayName, longFormat);
+			});
+			return std::string();
+		});
+	}
+
+	void TinyFTPRequestHandler::ServiceOptsCommand(char *options, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		// OPTS HASH [algorithm] and OPTS MODE Z [ENGINE DEFLATE|ZSTD] [LEVEL n]
+		char* context = 0;
+		char* option = strtok_s(options, " ", &context);
+		char* subOption = option ? strtok_s(0, " ", &context) : 0;
+		if (option && !_stricmp(option, "HASH"))
+		{
+			char repbuf[64];
+			if (subOption)
 			{
-				pSession->startDataSocketRemote();
+				TinyFTPHashAlgorithm algorithm;
+				if (!hashAlgorithmFromName(subOption, algorithm))
+				{
+					asio::write(pSession->getSocket(), asio::buffer(StatusStrings::unknown_hash_algorithm, sizeof(StatusStrings::unknown_hash_algorithm) - 1), asio::transfer_all());
+					return;
+				}
+				pSession->setHashAlgorithm(algorithm);
 			}
+			snprintf(repbuf, sizeof(repbuf), "200 %s\r\n", hashAlgorithmName(pSession->getHashAlgorithm()));
+			rep.content = repbuf;
+			return;
+		}
+		if (!option || !subOption || _stricmp(option, "MODE") || _stricmp(subOption, "Z"))
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opts_not_understood, sizeof(StatusStrings::opts_not_understood) - 1), asio::transfer_all());
+			return;
 		}
 
+		TinyFTPCompressionEngine engine = pSession->getModeZEngine();
+		int level = -1;
+		for (char* name = strtok_s(0, " ", &context); name; name = strtok_s(0, " ", &context))
 		{
-			WIN32_FIND_DATAA ffd;
-			size_t length_of_arg;
-			HANDLE hFind = INVALID_HANDLE_VALUE;
-			DWORD dwError = 0;
+			char* value = strtok_s(0, " ", &context);
+			bool understood = (value != 0);
+			if (understood && !_stricmp(name, "ENGINE"))
+			{
+				if (!_stricmp(value, "ZSTD"))
+					engine = COMPRESSION_ZSTD;
+				else if (!_stricmp(value, "DEFLATE"))
+					engine = COMPRESSION_DEFLATE;
+				else
+					understood = false;
+			}
+			else if (understood && !_stricmp(name, "LEVEL"))
+				level = atoi(value);
+			else
+				understood = false;
 
-			length_of_arg = strnlen_s(filename, TinyFTPSession::MAX_PATH_32K);
-			if (length_of_arg > (TinyFTPSession::MAX_PATH_32K - 3))
-				abort();
+			if (!understood)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opts_not_understood, sizeof(StatusStrings::opts_not_understood) - 1), asio::transfer_all());
+				return;
+			}
+		}
 
-			strncat_s(filename, TinyFTPSession::MAX_PATH_32K, "\\*", strlen("\\*"));
-			// Find the first file in the directory.
-			hFind = FindFirstFileA(filename, &ffd);
+		if (level == -1)
+			level = (engine == pSession->getModeZEngine()) ? pSession->getModeZLevel() : (engine == COMPRESSION_ZSTD ? TinyFTPSession::DEFAULT_ZSTD_LEVEL : TinyFTPSession::DEFAULT_DEFLATE_LEVEL);
+		if (level < 1 || level > (engine == COMPRESSION_ZSTD ? 19 : 9))
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opts_not_understood, sizeof(StatusStrings::opts_not_understood) - 1), asio::transfer_all());
+			return;
+		}
+		pSession->setModeZOptions(engine, level);
+		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::opts_successful, sizeof(StatusStrings::opts_successful) - 1), asio::transfer_all());
+	}
 
-			if (INVALID_HANDLE_VALUE == hFind)
-				return;
+	void TinyFTPRequestHandler::ServiceFeatCommand(const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		rep.content = "211-Features:\r\n"
+			" EPRT\r\n"
+			" EPSV\r\n"
+			" MDTM\r\n"
+			" SIZE\r\n"
+			" MODE B\r\n"
+			" MODE Z\r\n"
+			" HASH ";
+		// current algorithm is marked with a star
+		for (int i = 0; i < HASH_ALGORITHM_COUNT; ++i)
+		{
+			if (i)
+				rep.content += ';';
+			rep.content += hashAlgorithmName((TinyFTPHashAlgorithm)i);
+			if (i == pSession->getHashAlgorithm())
+				rep.content += '*';
+		}
+		rep.content += "\r\n"
+			" XCRC\r\n"
+			" XMD5\r\n"
+			" XSHA1\r\n"
+			" XSHA256\r\n"
+			" XSHA512\r\n";
+		if (services.tlsContext)
+			rep.content += " AUTH TLS\r\n"
+				" PBSZ\r\n"
+				" PROT\r\n";
+		rep.content += "211 End\r\n";
+	}
 
-			do
-			{
-				if (!strncmp(ffd.cFileName, ".", TinyFTPSession::MAX_PATH_32K) || !strncmp(ffd.cFileName, "..", TinyFTPSession::MAX_PATH_32K))
-					continue;
+	void TinyFTPRequestHandler::ServiceHashCommand(char *param, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		TinyFTPHashAlgorithm algorithm;
+		switch (req.type)
+		{
+		case TinyFTPRequest::XCRC: algorithm = HASH_CRC32; break;
+		case TinyFTPRequest::XMD5: algorithm = HASH_MD5; break;
+		case TinyFTPRequest::XSHA:
+		case TinyFTPRequest::XSHA1: algorithm = HASH_SHA1; break;
+		case TinyFTPRequest::XSHA256: algorithm = HASH_SHA256; break;
+		case TinyFTPRequest::XSHA512: algorithm = HASH_SHA512; break;
+		default: algorithm = pSession->getHashAlgorithm(); break;
+		}
 
-				if (Long)
-				{
-					char DirAttr;
-					char WriteAttr;
+		// X* commands may quote the name and append a byte range, ranges are ignored and the whole file is hashed
+		if (param[0] == '"')
+		{
+			memmove(param, param + 1, strlen(param));
+			char* closingQuote = strchr(param, '"');
+			if (closingQuote)
+				*closingQuote = 0;
+		}
+		std::string displayName = param;
 
-					SYSTEMTIME stUTC, stLocal;
-					// Convert the last-write time to local time.
-					FileTimeToSystemTime(&ffd.ftLastWriteTime, &stUTC);
-					SystemTimeToTzSpecificLocalTime(NULL, &stUTC, &stLocal);
+		if (!services.fileSystem->isLocal())
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::needs_local_files, sizeof(StatusStrings::needs_local_files) - 1), asio::transfer_all());
+			return;
+		}
 
-					char timeStringBuf[128];
+		char* NewPath = pSession->translatePath(param);
+		if (NewPath == NULL)
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+			return;
+		}
 
-					// Build a string showing the date and time.
-					snprintf(timeStringBuf, 128, "%s %02d  %04d", numToMonth(stLocal.wMonth), stLocal.wDay, stLocal.wYear);
+		// hashing a multi-GB file takes a while, the reply goes out from the worker when it is done
+		TinyFTPSessionPtr session = pSession->shared_from_this();
+		bool isHashCommand = (req.type == TinyFTPRequest::HASH);
+		hashFileAsync(services.workerPool, services.digestCache, NewPath, algorithm,
+			[session, isHashCommand, algorithm, displayName](bool ok, const std::string& hexDigest, uint64_t size)
+		{
+			if (!ok)
+			{
+				session->sendDeferredReply(StatusStrings::error);
+				return;
+			}
+			std::string hashReply;
+			if (isHashCommand)
+			{
+				char rangeBuf[64];
+				snprintf(rangeBuf, sizeof(rangeBuf), " 0-%llu ", (unsigned long long)size);
+				hashReply = std::string("213 ") + hashAlgorithmName(algorithm) + rangeBuf + hexDigest + " " + displayName + "\r\n";
+			}
+			else
+			{
+				std::string upperDigest = hexDigest;
+				if (algorithm == HASH_CRC32)
+					std::transform(upperDigest.begin(), upperDigest.end(), upperDigest.begin(), ::toupper);
+				hashReply = "250 " + upperDigest + "\r\n";
+			}
+			session->sendDeferredReply(hashReply);
+		});
+		pSession->dataOpInProgress = true;
+	}
 
-					DirAttr = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 'd' : '-';
-					WriteAttr = (ffd.dwFileAttributes & FILE_ATTRIBUTE_READONLY) ? '-' : 'w';
+	void TinyFTPRequestHandler::ServiceSiteCommand(char *param, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		char* argument = strchr(param, ' ');
+		if (argument)
+			*argument++ = 0;
+		else
+			argument = param + strlen(param);
 
-					uint64_t fileSize = ((uint64_t)ffd.nFileSizeHigh << 32) + ffd.nFileSizeLow;
-					snprintf(repbuf, MAX_REPLY_LEN, "%cr%c-r%c-r%c-   1 root  root    %7llu %s %s\r\n",
-						DirAttr, WriteAttr, WriteAttr, WriteAttr,
-						fileSize,
-						timeStringBuf,
-						ffd.cFileName);
-				}
-				else
-				{
-					snprintf(repbuf, MAX_REPLY_LEN, "%s\r\n", ffd.cFileName);
-				}
-				rep.content += std::string(repbuf);
-			} while (FindNextFileA(hFind, &ffd) != 0);
-			FindClose(hFind);
+		char* NewPath;
+		if (!_stricmp(param, "CPFR"))
+		{
+			// SITE CPFR/CPTO work like RNFR/RNTO, but copy
+			if (!services.fileSystem->isLocal())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::needs_local_files, sizeof(StatusStrings::needs_local_files) - 1), asio::transfer_all());
+				return;
+			}
+			NewPath = pSession->translatePath(argument);
+			if (NewPath == NULL)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+				return;
+			}
+			std::string path(NewPath);
+			pSession->runBlocking(BLOCKING_STAT, [this, path]()
+			{
+				TinyFTPFileInfo info;
+				return std::string(services.fileSystem->stat(path, info) && !info.isDirectory ? StatusStrings::cpfr_successful : StatusStrings::error_not_a_plain_file);
+			}, [path](TinyFTPSession& session, const std::string& result)
+			{
+				if (result == StatusStrings::cpfr_successful)
+					session.copyFrom = path;
+				return result;
+			});
 		}
-
-		if (!UseCtrlConn)
+		else if (!_stricmp(param, "CPTO"))
+		{
+			if (pSession->copyFrom.empty())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::cpto_without_cpfr, sizeof(StatusStrings::cpto_without_cpfr) - 1), asio::transfer_all());
+				return;
+			}
+			NewPath = pSession->translatePath(argument);
+			if (NewPath == NULL)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+				pSession->copyFrom.clear();
+				return;
+			}
+			ServiceCopyCommand(NewPath, req, rep, pSession);
+		}
+		else if (!_stricmp(param, "MGET"))
+		{
+			// the tar stream has no block framing or compression of its own
+			if (pSession->isModeZ() || pSession->isModeB())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::mget_needs_mode_s, sizeof(StatusStrings::mget_needs_mode_s) - 1), asio::transfer_all());
+				return;
+			}
+			NewPath = pSession->translatePath(argument);
+			if (NewPath == NULL)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+				return;
+			}
+			ServiceMgetCommand(NewPath, req, rep, pSession);
+		}
+		else if (!_stricmp(param, "TREE"))
+		{
+			// LIST -R for clients that can't pass options to LIST
+			std::string displayName = *argument ? argument : ".";
+			NewPath = pSession->translatePath(argument);
+			if (NewPath == NULL)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+				return;
+			}
+			ServiceTreeListCommand(NewPath, displayName, TRUE, req, rep, pSession);
+		}
+		else if (!_stricmp(param, "SORT"))
+		{
+			// SITE SORT NAME|SIZE|TIME|NONE [ASC|DESC]
+			char* context = 0;
+			char* key = strtok_s(argument, " ", &context);
+			char* direction = strtok_s(0, " ", &context);
+			TinyFTPListOptions options = pSession->getListOptions();
+			if (key && !_stricmp(key, "NAME"))
+				options.sortKey = TinyFTPListOptions::SORT_NAME;
+			else if (key && !_stricmp(key, "SIZE"))
+				options.sortKey = TinyFTPListOptions::SORT_SIZE;
+			else if (key && !_stricmp(key, "TIME"))
+				options.sortKey = TinyFTPListOptions::SORT_TIME;
+			else if (key && !_stricmp(key, "NONE"))
+				options.sortKey = TinyFTPListOptions::SORT_NONE;
+			else
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::syntax_error_in_parameters, sizeof(StatusStrings::syntax_error_in_parameters) - 1), asio::transfer_all());
+				return;
+			}
+			if (direction && _stricmp(direction, "ASC") && _stricmp(direction, "DESC"))
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::syntax_error_in_parameters, sizeof(StatusStrings::syntax_error_in_parameters) - 1), asio::transfer_all());
+				return;
+			}
+			options.descending = direction && !_stricmp(direction, "DESC");
+			pSession->setListOptions(options);
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::sort_successful, sizeof(StatusStrings::sort_successful) - 1), asio::transfer_all());
+		}
+		else if (!_stricmp(param, "PAGE"))
 		{
-			if (!rep.content.empty())
+			// SITE PAGE <offset> <limit>, SITE PAGE 0 0 shows everything again
+			char* offsetEnd = argument;
+			char* limitEnd = argument;
+			unsigned long long offset = strtoull(argument, &offsetEnd, 10);
+			unsigned long long limit = strtoull(offsetEnd, &limitEnd, 10);
+			if (offsetEnd == argument || limitEnd == offsetEnd || *limitEnd)
 			{
-				asio::write(pSession->getDataSocket(), asio::buffer(rep.content), asio::transfer_all());
-				rep.content.clear();
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::syntax_error_in_parameters, sizeof(StatusStrings::syntax_error_in_parameters) - 1), asio::transfer_all());
+				return;
 			}
-			pSession->closeDataSocket();
-			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::transfer_complete, sizeof(StatusStrings::transfer_complete) - 1), asio::transfer_all());
+			TinyFTPListOptions options = pSession->getListOptions();
+			options.offset = (size_t)offset;
+			options.limit = (size_t)limit;
+			pSession->setListOptions(options);
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::page_successful, sizeof(StatusStrings::page_successful) - 1), asio::transfer_all());
 		}
+		else if (!_stricmp(param, "DU"))
+		{
+			// SITE DU [path]: from the size index, no walk over the tree
+			if (!services.sizeIndex.isEnabled())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::du_needs_size_index, sizeof(StatusStrings::du_needs_size_index) - 1), asio::transfer_all());
+				return;
+			}
+			if (!services.sizeIndex.isReady())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::du_index_not_ready, sizeof(StatusStrings::du_index_not_ready) - 1), asio::transfer_all());
+				return;
+			}
+			NewPath = pSession->translatePath(argument);
+			TinyFTPSizeIndex::Usage usage;
+			if (NewPath == NULL || !services.sizeIndex.getUsage(NewPath, usage))
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
+				return;
+			}
+			char repbuf[128];
+			snprintf(repbuf, sizeof(repbuf), "211 %llu bytes in %llu files, %llu directories\r\n",
+				(unsigned long long)usage.bytes, (unsigned long long)usage.files, (unsigned long long)usage.directories);
+			rep.content = repbuf;
+		}
+		else if (!_stricmp(param, "STATS"))
+		{
+			const TinyFTPTransferStats& stats = pSession->getTransferStats();
+			TinyFTPFileCache::Stats cacheStats = services.fileCache.getStats();
+			char repbuf[640 + 128 * BLOCKING_OP_COUNT];
+			snprintf(repbuf, sizeof(repbuf), "211-Last data connection\r\n"
+				" Bytes %llu\r\n RTT %lluus (min %lluus)\r\n Cwnd %llu\r\n Rate %llu B/s\r\n BDP %llu\r\n"
+				" SO_SNDBUF %d\r\n SO_RCVBUF %d\r\n Adjustments %u\r\n"
+				" Server timeouts: idle %llu, data connection %llu, stalled transfer %llu\r\n"
+				" Small file cache: %llu hits, %llu misses, %llu files, %llu bytes\r\n211 End\r\n",
+				(unsigned long long)stats.bytesTransferred, (unsigned long long)stats.rttUs, (unsigned long long)stats.minRttUs,
+				(unsigned long long)stats.cwndBytes, (unsigned long long)stats.bytesPerSecond, (unsigned long long)stats.bdpBytes,
+				stats.sendBuffer, stats.receiveBuffer, stats.adjustments,
+				(unsigned long long)services.timeoutStats.idleTimeouts, (unsigned long long)services.timeoutStats.dataConnectTimeouts,
+				(unsigned long long)services.timeoutStats.stallTimeouts,
+				(unsigned long long)cacheStats.hits, (unsigned long long)cacheStats.misses, (unsigned long long)cacheStats.files, (unsigned long long)cacheStats.bytes);
+			// end line goes after the blocking pool's
+			std::string statsReply(repbuf, strlen(repbuf) - strlen("211 End\r\n"));
+			for (int op = 0; op < BLOCKING_OP_COUNT; ++op)
+			{
+				TinyFTPBlockingPool::Stats opStats = services.blockingPool.getStats((TinyFTPBlockingOp)op);
+				snprintf(repbuf, sizeof(repbuf), " Blocking %s: %llu queued, %llu done, avg wait %lluus, avg run %lluus, max run %lluus\r\n",
+					blockingOpName((TinyFTPBlockingOp)op), (unsigned long long)opStats.queued, (unsigned long long)opStats.completed,
+					(unsigned long long)(opStats.completed ? opStats.waitMicros / opStats.completed : 0),
+					(unsigned long long)(opStats.completed ? opStats.runMicros / opStats.completed : 0), (unsigned long long)opStats.maxRunMicros);
+				statsReply += repbuf;
+			}
+			rep.content = statsReply + "211 End\r\n";
+		}
+		else if (!_stricmp(param, "HELP"))
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::site_help, sizeof(StatusStrings::site_help) - 1), asio::transfer_all());
+		else
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::unknown_command, sizeof(StatusStrings::unknown_command) - 1), asio::transfer_all());
+	}
+
+	void TinyFTPRequestHandler::ServiceMgetCommand(char *path, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		// a wildcard in the last component picks files from its directory, anything else is archived whole
+		std::string directory(path), pattern;
+		splitPattern(directory, pattern);
+		// walking the tree is a pile of listings, it goes to the blocking pool like them
+		std::shared_ptr<std::vector<TinyFTPArchiveMember>> members = std::make_shared<std::vector<TinyFTPArchiveMember>>();
+		pSession->runBlocking(BLOCKING_LIST, [this, directory, pattern, members]()
+		{
+			if (!collectArchiveMembers(*services.fileSystem, directory, pattern, *members) || members->empty())
+				return std::string(StatusStrings::mget_nothing_matched);
+			return std::string();
+		}, [members](TinyFTPSession& session, const std::string& result)
+		{
+			if (!result.empty())
+				return result;
+
+			asio::write(session.getSocket(), asio::buffer(StatusStrings::opening_binary_connection, sizeof(StatusStrings::opening_binary_connection) - 1), asio::transfer_all());
+
+			session.startDataSocket([members](TinyFTPSession& session) { session.startArchiveTransfer(std::move(*members)); });
+			return std::string();
+		});
+	}
+
+	void TinyFTPRequestHandler::ServiceCopyCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
+	{
+		TinyFTPSizeIndex::Usage source;
+		if (!services.sizeIndex.fitsQuota(filename, services.sizeIndex.getUsage(pSession->copyFrom, source) ? (long long)source.bytes : -1))
+		{
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::quota_exceeded, sizeof(StatusStrings::quota_exceeded) - 1), asio::transfer_all());
+			pSession->copyFrom.clear();
+			return;
+		}
+
+		// the copy runs on the worker, the reply stays open with a progress line a second until it is done
+		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::copy_started, sizeof(StatusStrings::copy_started) - 1), asio::transfer_all());
+
+		std::weak_ptr<TinyFTPSession> weakSession = pSession->shared_from_this();
+		copyFileAsync(services.workerPool, pSession->copyFrom, filename,
+			[weakSession](uint64_t copiedBytes, uint64_t totalBytes)
+		{
+			// nobody left to report to, stop copying
+			TinyFTPSessionPtr session = weakSession.lock();
+			if (!session)
+				return false;
+			char progressBuf[96];
+			snprintf(progressBuf, sizeof(progressBuf), " %3u%% %llu of %llu bytes\r\n",
+				totalBytes ? (unsigned int)(copiedBytes * 100 / totalBytes) : 100u, (unsigned long long)copiedBytes, (unsigned long long)totalBytes);
+			session->sendProgressLine(progressBuf);
+			return true;
+		},
+			[this, weakSession, target = std::string(filename)](bool ok, bool cloned)
+		{
+			// on the worker pool, the stat is fine here
+			services.sizeIndex.refresh(target);
+			TinyFTPSessionPtr session = weakSession.lock();
+			if (session)
+				session->sendDeferredReply(ok ? StatusStrings::copy_finished : StatusStrings::copy_failed);
+		});
+		pSession->dataOpInProgress = true;
+		pSession->copyFrom.clear();
 	}
 
 	void TinyFTPRequestHandler::handleRequest(const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession)
@@ -206,6 +639,7 @@ namespace TinyWinFTP
 		char repbuf[MAX_REPLY_LEN];
 		int pasvPort;
 		char * NewPath;
+		bool recursive;
 
 		switch (req.type)
 		{
@@ -222,16 +656,41 @@ namespace TinyWinFTP
 			break;
 
 		case TinyFTPRequest::PASV:
-			pasvPort = acquirePassivePort();
-			pSession->setPasvPort(pasvPort);
-			ourAddrString = pSession->getSocket().local_endpoint().address().to_string();
-			snprintf(repbuf, MAX_REPLY_LEN, "227 Entering Passive Mode (%s,%d,%d).\r\n",
-				ourAddrString.c_str(), pasvPort >> 8, pasvPort & 0xff);
-			for (int a = 0; a < 50; a++)
+		{
+			// 227 can only carry IPv4, IPv6 clients have to use EPSV
+			asio::error_code ec;
+			asio::ip::address_v4 ourAddress;
+			if (!toIPv4(pSession->getSocket().local_endpoint(ec).address(), ourAddress))
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::pasv_ipv4_only, sizeof(StatusStrings::pasv_ipv4_only) - 1), asio::transfer_all());
+				break;
+			}
+			pasvPort = pSession->openPassivePort();
+			if (pasvPort < 0)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::cant_open_data_connection, sizeof(StatusStrings::cant_open_data_connection) - 1), asio::transfer_all());
+				break;
+			}
+			asio::ip::address_v4::bytes_type ourBytes = ourAddress.to_bytes();
+			snprintf(repbuf, MAX_REPLY_LEN, "227 Entering Passive Mode (%u,%u,%u,%u,%d,%d).\r\n",
+				ourBytes[0], ourBytes[1], ourBytes[2], ourBytes[3], pasvPort >> 8, pasvPort & 0xff);
+			rep.content = std::string(repbuf);
+		}
+		break;
+
+		case TinyFTPRequest::EPSV: // RFC 2428, port only, client reuses the control connection address
+			if (!_stricmp(buf, "ALL"))
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::epsv_all_successful, sizeof(StatusStrings::epsv_all_successful) - 1), asio::transfer_all());
+				break;
+			}
+			pasvPort = pSession->openPassivePort();
+			if (pasvPort < 0)
 			{
-				if (repbuf[a] == 0) break;
-				if (repbuf[a] == '.') repbuf[a] = ',';
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::cant_open_data_connection, sizeof(StatusStrings::cant_open_data_connection) - 1), asio::transfer_all());
+				break;
 			}
+			snprintf(repbuf, MAX_REPLY_LEN, "229 Entering Extended Passive Mode (|||%d|)\r\n", pasvPort);
 			rep.content = std::string(repbuf);
 			break;
 
@@ -249,31 +708,27 @@ namespace TinyWinFTP
 		break;
 
 		case TinyFTPRequest::NLST: // Request directory, names only.
-			if (!strncmp(buf, "-la", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-l", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-a", TinyFTPSession::MAX_PATH_32K))
-				strncpy_s(buf, "", TinyFTPSession::MAX_PATH_32K);
-			NewPath = pSession->translatePath(buf);
-			if (NewPath == NULL)
-			{
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
-				break;
-			}
-			ServiceListCommands(NewPath, FALSE, FALSE, req, rep, pSession);
-			break;
-
 		case TinyFTPRequest::LIST: // Request directory, long version.
-			if (!strncmp(buf, "-la", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-l", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-a", TinyFTPSession::MAX_PATH_32K))
-				strncpy_s(buf, "", TinyFTPSession::MAX_PATH_32K);
+		{
+			stripListOptions(buf, recursive);
+			// what the client asked for, the headers of a recursive listing show paths below it
+			std::string displayName = *buf ? buf : ".";
 			NewPath = pSession->translatePath(buf);
 			if (NewPath == NULL)
 			{
 				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
+				break;
 			}
-			ServiceListCommands(NewPath, TRUE, FALSE, req, rep, pSession);
+			BOOL Long = req.type == TinyFTPRequest::LIST;
+			if (recursive)
+				ServiceTreeListCommand(NewPath, displayName, Long, req, rep, pSession);
+			else
+				ServiceListCommands(NewPath, Long, FALSE, req, rep, pSession);
 			break;
+		}
 
 		case TinyFTPRequest::STAT: // Just like LIST, but use control connection.
-			if (!strncmp(buf, "-la", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-l", TinyFTPSession::MAX_PATH_32K) || !strncmp(buf, "-a", TinyFTPSession::MAX_PATH_32K))
-				strncpy_s(buf, "", TinyFTPSession::MAX_PATH_32K);
+			stripListOptions(buf, recursive);
 			NewPath = pSession->translatePath(buf);
 			if (NewPath == NULL)
 			{
@@ -290,11 +745,18 @@ namespace TinyWinFTP
 				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
 				break;
 			}
-			if (!DeleteFileA(NewPath))
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
-			else
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::delete_successful, sizeof(StatusStrings::delete_successful) - 1), asio::transfer_all());
+		{
+			std::string path(NewPath);
+			pSession->runBlocking(BLOCKING_DELETE, [this, path]()
+			{
+				if (!services.fileSystem->removeFile(path))
+					return std::string(StatusStrings::error);
+				services.fileCache.invalidate(path);
+				services.sizeIndex.refresh(path);
+				return std::string(StatusStrings::delete_successful);
+			});
 			break;
+		}
 
 		case TinyFTPRequest::RMD:
 		case TinyFTPRequest::MKD:
@@ -306,27 +768,36 @@ namespace TinyWinFTP
 				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::path_perm_error, sizeof(StatusStrings::path_perm_error) - 1), asio::transfer_all());
 				break;
 			}
+		{
+			std::string path(NewPath);
 			if (req.type == TinyFTPRequest::MKD || req.type == TinyFTPRequest::XMKD) {
-				if (_mkdir(NewPath))
-					asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
-				else
-					asio::write(pSession->getSocket(), asio::buffer(StatusStrings::dir_created, sizeof(StatusStrings::dir_created) - 1), asio::transfer_all());
+				pSession->runBlocking(BLOCKING_MKDIR, [this, path]()
+				{
+					if (!services.fileSystem->makeDirectory(path))
+						return std::string(StatusStrings::error);
+					services.sizeIndex.refresh(path);
+					return std::string(StatusStrings::dir_created);
+				});
 			}
 			else
 			{
-				if (_rmdir(NewPath))
-					asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
-				else
-					asio::write(pSession->getSocket(), asio::buffer(StatusStrings::dir_removed, sizeof(StatusStrings::dir_removed) - 1), asio::transfer_all());
+				pSession->runBlocking(BLOCKING_RMDIR, [this, path]()
+				{
+					if (!services.fileSystem->removeDirectory(path))
+						return std::string(StatusStrings::error);
+					services.fileCache.invalidate(path);
+					services.sizeIndex.refresh(path);
+					return std::string(StatusStrings::dir_removed);
+				});
 			}
 			break;
+		}
 
 		case TinyFTPRequest::RNFR:
 			NewPath = pSession->translatePath(buf);
 			if (NewPath)
 			{
-				strncpy_s(repbuf, NewPath, MAX_REPLY_LEN);
-				rnFrString = repbuf;
+				pSession->renameFrom = NewPath;
 				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::file_exists, sizeof(StatusStrings::file_exists) - 1), asio::transfer_all());
 			}
 			else
@@ -336,11 +807,23 @@ namespace TinyWinFTP
 		case TinyFTPRequest::RNTO:
 			// Must be immediately preceeded by RNFR!
 			NewPath = pSession->translatePath(buf);
-			if (rename(rnFrString.c_str(), NewPath))
+			if (NewPath == NULL)
 				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::error, sizeof(StatusStrings::error) - 1), asio::transfer_all());
 			else
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::rnto_successful, sizeof(StatusStrings::rnto_successful) - 1), asio::transfer_all());
-			rnFrString.clear();
+			{
+				std::string fromPath(pSession->renameFrom), toPath(NewPath);
+				pSession->runBlocking(BLOCKING_RENAME, [this, fromPath, toPath]()
+				{
+					if (!services.fileSystem->rename(fromPath, toPath))
+						return std::string(StatusStrings::error);
+					services.fileCache.invalidate(fromPath);
+					services.fileCache.invalidate(toPath);
+					services.sizeIndex.refresh(fromPath);
+					services.sizeIndex.refresh(toPath);
+					return std::string(StatusStrings::rnto_successful);
+				});
+			}
+			pSession->renameFrom.clear();
 			break;
 
 		case TinyFTPRequest::ABOR:
@@ -359,11 +842,21 @@ namespace TinyWinFTP
 			break;
 
 		case TinyFTPRequest::CWD: // Change working directory
-			if (!pSession->setCurDir(buf))
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::cwd_failed, sizeof(StatusStrings::cwd_failed) - 1), asio::transfer_all());
-			else
-				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::cwd_successful, sizeof(StatusStrings::cwd_successful) - 1), asio::transfer_all());
+		{
+			// checked on the blocking pool, the session's directory changes back on its io thread
+			std::string directory = pSession->resolveDirectory(buf);
+			pSession->runBlocking(BLOCKING_STAT, [this, directory]()
+			{
+				TinyFTPFileInfo info;
+				return std::string(services.fileSystem->stat(directory, info) && info.isDirectory ? StatusStrings::cwd_successful : StatusStrings::cwd_failed);
+			}, [directory](TinyFTPSession& session, const std::string& result)
+			{
+				if (result == StatusStrings::cwd_successful)
+					session.changeDirectory(directory);
+				return result;
+			});
 			break;
+		}
 
 		case TinyFTPRequest::TYPE: // Accept file TYPE commands, but ignore.
 			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::type_successful, sizeof(StatusStrings::type_successful) - 1), asio::transfer_all());
@@ -381,8 +874,21 @@ namespace TinyWinFTP
 
 
 		case TinyFTPRequest::PORT: // Set the TCP/IP addres for trasnfers.
+		case TinyFTPRequest::EPRT:
 		{
-			pSession->setPortString(req.param);
+			asio::ip::tcp::endpoint activeEndpoint;
+			TinyFTPAddressParseResult parseResult = (req.type == TinyFTPRequest::PORT) ? parsePortArgument(buf, activeEndpoint) : parseEprtArgument(buf, activeEndpoint);
+			if (parseResult == ADDRESS_UNSUPPORTED_PROTOCOL)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::eprt_unsupported_protocol, sizeof(StatusStrings::eprt_unsupported_protocol) - 1), asio::transfer_all());
+				break;
+			}
+			if (parseResult != ADDRESS_OK)
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::syntax_error_in_parameters, sizeof(StatusStrings::syntax_error_in_parameters) - 1), asio::transfer_all());
+				break;
+			}
+			pSession->setActiveEndpoint(activeEndpoint);
 		}
 		asio::write(pSession->getSocket(), asio::buffer(StatusStrings::port_successful, sizeof(StatusStrings::port_successful) - 1), asio::transfer_all());
 		break;
@@ -398,6 +904,11 @@ namespace TinyWinFTP
 			break;
 
 		case TinyFTPRequest::STOR: // Store the file.
+			if (pSession->isModeZ())
+			{
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::stor_in_mode_z, sizeof(StatusStrings::stor_in_mode_z) - 1), asio::transfer_all());
+				break;
+			}
 			NewPath = pSession->translatePath(buf);
 			if (NewPath == NULL)
 			{
@@ -407,6 +918,90 @@ namespace TinyWinFTP
 			ServiceStorCommand(NewPath, req, rep, pSession);
 			break;
 
+		case TinyFTPRequest::MODE:
+			if (!_stricmp(buf, "S"))
+			{
+				pSession->setModeZ(false);
+				pSession->setModeB(false);
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::mode_s_successful, sizeof(StatusStrings::mode_s_successful) - 1), asio::transfer_all());
+			}
+			else if (!_stricmp(buf, "Z"))
+			{
+				pSession->setModeB(false);
+				pSession->setModeZ(true);
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::mode_z_successful, sizeof(StatusStrings::mode_z_successful) - 1), asio::transfer_all());
+			}
+			else if (!_stricmp(buf, "B"))
+			{
+				pSession->setModeZ(false);
+				pSession->setModeB(true);
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::mode_b_successful, sizeof(StatusStrings::mode_b_successful) - 1), asio::transfer_all());
+			}
+			else
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::mode_not_supported, sizeof(StatusStrings::mode_not_supported) - 1), asio::transfer_all());
+			break;
+
+		case TinyFTPRequest::OPTS:
+		case TinyFTPRequest::sOPTS:
+			ServiceOptsCommand(buf, req, rep, pSession);
+			break;
+
+		case TinyFTPRequest::HASH:
+		case TinyFTPRequest::XCRC:
+		case TinyFTPRequest::XMD5:
+		case TinyFTPRequest::XSHA:
+		case TinyFTPRequest::XSHA1:
+		case TinyFTPRequest::XSHA256:
+		case TinyFTPRequest::XSHA512:
+			ServiceHashCommand(buf, req, rep, pSession);
+			break;
+
+		case TinyFTPRequest::AUTH: // RFC 4217, explicit FTPS
+			if (_stricmp(buf, "TLS") && _stricmp(buf, "TLS-C") && _stricmp(buf, "SSL"))
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::auth_not_understood, sizeof(StatusStrings::auth_not_understood) - 1), asio::transfer_all());
+			else if (!services.tlsContext)
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::tls_not_available, sizeof(StatusStrings::tls_not_available) - 1), asio::transfer_all());
+			else if (pSession->isControlTls())
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::tls_already_active, sizeof(StatusStrings::tls_already_active) - 1), asio::transfer_all());
+			else
+			{
+				// 234 goes out in plaintext, everything after it through TLS
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::auth_tls_successful, sizeof(StatusStrings::auth_tls_successful) - 1), asio::transfer_all());
+				pSession->startControlTls();
+			}
+			break;
+
+		case TinyFTPRequest::PBSZ: // streams only, buffer size is always 0
+			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::pbsz_successful, sizeof(StatusStrings::pbsz_successful) - 1), asio::transfer_all());
+			break;
+
+		case TinyFTPRequest::PROT:
+			if (!pSession->isControlTls())
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::prot_needs_tls, sizeof(StatusStrings::prot_needs_tls) - 1), asio::transfer_all());
+			else if (!_stricmp(buf, "C"))
+			{
+				pSession->setProtectData(false);
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::prot_c_successful, sizeof(StatusStrings::prot_c_successful) - 1), asio::transfer_all());
+			}
+			else if (!_stricmp(buf, "P"))
+			{
+				pSession->setProtectData(true);
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::prot_p_successful, sizeof(StatusStrings::prot_p_successful) - 1), asio::transfer_all());
+			}
+			else
+				asio::write(pSession->getSocket(), asio::buffer(StatusStrings::prot_not_supported, sizeof(StatusStrings::prot_not_supported) - 1), asio::transfer_all());
+			break;
+
+		case TinyFTPRequest::FEAT:
+		case TinyFTPRequest::sFEAT:
+			ServiceFeatCommand(req, rep, pSession);
+			break;
+
+		case TinyFTPRequest::sSITE:
+		case TinyFTPRequest::SITE:
+			ServiceSiteCommand(buf, req, rep, pSession);
+			break;
+
 		case TinyFTPRequest::UNKNOWN_COMMAND:
 			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::unknown_command, sizeof(StatusStrings::unknown_command) - 1), asio::transfer_all());
 			break;
@@ -415,13 +1010,7 @@ namespace TinyWinFTP
 			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::bye, sizeof(StatusStrings::bye) - 1), asio::transfer_all());
 			// TODO: close session and free passv port
 
-		case TinyFTPRequest::FEAT:
-		case TinyFTPRequest::OPTS:
-		case TinyFTPRequest::sFEAT:
-		case TinyFTPRequest::sOPTS:
 		case TinyFTPRequest::sSYST:
-		case TinyFTPRequest::sSITE:
-		case TinyFTPRequest::SITE:
 		default: // Any command not implemented, return not recognized response.
 			asio::write(pSession->getSocket(), asio::buffer(StatusStrings::unknown_command, sizeof(StatusStrings::unknown_command) - 1), asio::transfer_all());
 			rep.content.clear();
@@ -429,17 +1018,4 @@ namespace TinyWinFTP
 		}
 	}
 
-	int TinyFTPRequestHandler::acquirePassivePort()
-	{
-		int nextPasvPort = 0;
-		if (!reusablePassivePorts.pop(nextPasvPort))
-			nextPasvPort = curMaxPassivePort++;
-
-		return nextPasvPort;
-	}
-	void TinyFTPRequestHandler::releasePassivePort(int pasvPort)
-	{
-		reusablePassivePorts.push(pasvPort);
-	}
-
 }
\ No newline at end of file
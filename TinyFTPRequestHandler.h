@@ -3,35 +3,27 @@
 
 #include <string>
 
-#include "LFMPMCQueue.h"
-
 #include "TinyFTPReply.h"
 #include "TinyFTPRequest.h"
 #include "TinyFTPSession.h"
+#include "TinyFTPServices.h"
 
 namespace TinyWinFTP
 {
-	/// The common handler for all incoming requests.
+	/// Turns requests into replies. Holds nothing but the shared services, state a command leaves for the next one
+	/// (RNFR, CPFR, ...) lives in the session. One per io thread so the command path writes no shared memory.
 	class TinyFTPRequestHandler
 	{
-		static const size_t PASV_PORT_RANGE_START = 50000;
 		static const size_t MAX_REPLY_LEN = 32768;
 	public:
-		/// Construct with a directory containing files to be served.
-		explicit TinyFTPRequestHandler();
+		/// Construct with the server wide services (worker pool, caches).
+		explicit TinyFTPRequestHandler(TinyFTPServices& services);
 
 		/// Handle a request and produce a reply.
 		void handleRequest(const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
 
-		int acquirePassivePort();
-		void releasePassivePort(int pasvPort);
-
 	private:
-		std::string ourAddrString;
-		std::string rnFrString;
-
-		int curMaxPassivePort;
-		LFMPMCQueue<int> reusablePassivePorts;
+		TinyFTPServices& services;
 
 		template <typename T>
 		void SyncSend(T responseString, TinyFTPSession* pSession)
@@ -42,7 +34,14 @@ namespace TinyWinFTP
 		void ServiceStorCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
 		void ServiceRetrCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
 		void ServiceListCommands(char *filename, BOOL Long, BOOL UseCtrlConn, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceTreeListCommand(char *directory, const std::string& displayName, BOOL Long, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
 		void ServiceStatCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceOptsCommand(char *options, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceFeatCommand(const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceHashCommand(char *param, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceSiteCommand(char *param, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceMgetCommand(char *path, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
+		void ServiceCopyCommand(char *filename, const TinyFTPRequest& req, TinyFTPReply& rep, TinyFTPSession* pSession);
 
 		TinyFTPRequestHandler(const TinyFTPRequestHandler& other) = delete;
 		TinyFTPRequestHandler(TinyFTPRequestHandler&& other) = delete;
@@ -44,6 +44,23 @@ namespace TinyWinFTP
 		commands["noop"] = 35;
 		commands["ALLO"] = 36;
 		commands["allo"] = 36;
+		commands["EPSV"] = 38;
+		commands["epsv"] = 38;
+		commands["EPRT"] = 39;
+		commands["eprt"] = 39;
+		commands["HASH"] = 40;
+		commands["XCRC"] = 41;
+		commands["XMD5"] = 42;
+		commands["XSHA"] = 43;
+		commands["XSHA1"] = 44;
+		commands["XSHA256"] = 45;
+		commands["XSHA512"] = 46;
+		commands["AUTH"] = 47;
+		commands["auth"] = 47;
+		commands["PBSZ"] = 48;
+		commands["pbsz"] = 48;
+		commands["PROT"] = 49;
+		commands["prot"] = 49;
 	}
 
 	void TinyFTPRequestParser::reset()
@@ -1,10 +1,15 @@
+#include <iostream>
+#include <future>
+
 #include "TinyFTPServer.h"
+#include "TinyFTPAddress.h"
 
 namespace TinyWinFTP
 {
 
-	TinyFTPServer::TinyFTPServer(std::string in_docRoot, short port) : nextIoService(0), docRoot(in_docRoot)
+	TinyFTPServer::TinyFTPServer(const TinyFTPServerConfig& in_config) : nextIoService(0), services(in_config)
 	{
+		const TinyFTPServerConfig& config = services.config;
 		size_t pool_size = std::thread::hardware_concurrency();
 		for (std::size_t i = 0; i < pool_size; ++i)
 		{
@@ -12,9 +17,39 @@ namespace TinyWinFTP
 			auto newWork = asio::make_work_guard(*newService);
 			ioServices.push_back(newService);
 			works.push_back(newWork);
+			timingWheels.push_back(std::unique_ptr<TinyFTPTimingWheel>(new TinyFTPTimingWheel(*newService)));
+			requestParsers.push_back(std::unique_ptr<TinyFTPRequestParser>(new TinyFTPRequestParser()));
+			requestHandlers.push_back(std::unique_ptr<TinyFTPRequestHandler>(new TinyFTPRequestHandler(services)));
 		}
-		tcpAcceptor.reset(new asio::ip::tcp::acceptor(*ioServices[0], asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)));
-		listenSocket.reset(new asio::ip::tcp::socket(*ioServices[0]));
+
+		// the listener first: a running instance handing it over also unbinds its passive ports before it answers
+		asio::error_code ec;
+		tcpAcceptor.reset(new asio::ip::tcp::acceptor(*ioServices[0]));
+		if (config.takeOver && TinyFTPListenerHandoff::takeOver(config.port, *tcpAcceptor, ec))
+			std::cout << "Took over the listening socket of the running instance" << std::endl;
+		else
+		{
+			// dual-stack, IPv4 clients show up as v4-mapped addresses
+			listenDualStack(*tcpAcceptor, config.port, ec);
+			if (ec)
+				throw asio::system_error(ec);
+		}
+
+		// split passive range between io_contexts so each one owns its listening sockets
+		size_t pasvRangeSize = config.pasvPortLast >= config.pasvPortFirst ? config.pasvPortLast - config.pasvPortFirst + 1 : 0;
+		size_t pasvSliceSize = pasvRangeSize / ioServices.size();
+		if (pasvSliceSize == 0)
+			std::cout << "Passive port range smaller than io thread count, some threads get no passive ports" << std::endl;
+		for (std::size_t i = 0; i < ioServices.size(); ++i)
+		{
+			size_t sliceFirst = config.pasvPortFirst + i * pasvSliceSize;
+			size_t sliceLast = (i + 1 == ioServices.size()) ? config.pasvPortLast : sliceFirst + pasvSliceSize - 1;
+			if (sliceLast < sliceFirst || sliceFirst > config.pasvPortLast)
+				pasvPortPools.push_back(std::make_shared<TinyFTPPassivePortPool>(*ioServices[i], 1, 0));
+			else
+				pasvPortPools.push_back(std::make_shared<TinyFTPPassivePortPool>(*ioServices[i], (unsigned short)sliceFirst, (unsigned short)sliceLast));
+		}
+
 	}
 
 	/// Get an io_context to use.
@@ -26,13 +61,16 @@ namespace TinyWinFTP
 
 	void TinyFTPServer::doAccept()
 	{
-		tcpAcceptor->async_accept(*listenSocket,
-			[this](std::error_code ec)
+		// accept straight onto the session's io_context, so its control socket completes on the same thread as the rest of the session
+		asio::io_context& sessionService = getIoService();
+		std::size_t index = nextIoService;
+		tcpAcceptor->async_accept(sessionService,
+			[this, &sessionService, index](std::error_code ec, asio::ip::tcp::socket socket)
 		{
+			if (!tcpAcceptor->is_open())
+				return;
 			if (!ec)
-			{
-				std::make_shared<TinyFTPSession>(getIoService(), std::move(*listenSocket), &requestHandler, requestParser, docRoot)->start();
-			}
+				std::make_shared<TinyFTPSession>(sessionService, std::move(socket), requestHandlers[index].get(), *requestParsers[index], pasvPortPools[index], *timingWheels[index], services)->start();
 			doAccept();
 		});
 	}
@@ -44,6 +82,7 @@ namespace TinyWinFTP
 		std::vector<std::shared_ptr<std::thread> > threads;
 		for (std::size_t i = 0; i < ioServices.size(); ++i)
 		{
+			timingWheels[i]->start();
 			asio::io_context * pService = &(*ioServices[i]);
 			std::shared_ptr<std::thread> newThread(new std::thread([pService] {pService->run();}));
 			threads.push_back(newThread);
@@ -51,10 +90,20 @@ namespace TinyWinFTP
 
 		// start accepting stuff
 		doAccept();
+		handoff.reset(new TinyFTPListenerHandoff(services.config.port));
+		handoff->start(*tcpAcceptor, [this]() { releaseForHandoff(); });
 
 		// Wait for all threads in the pool to exit.
 		for (std::size_t i = 0; i < threads.size(); ++i)
 			threads[i]->join();
+
+		handoff.reset();
+
+		// nothing may post back into the io_contexts once they are gone
+		services.workerPool.stop();
+		services.workerPool.join();
+		services.blockingPool.stop();
+		services.blockingPool.join();
 	}
 
 	void TinyFTPServer::stop()
@@ -64,4 +113,78 @@ namespace TinyWinFTP
 			ioServices[i]->stop();
 	}
 
+	bool TinyFTPServer::drain()
+	{
+		bool expected = false;
+		if (!services.draining.compare_exchange_strong(expected, true))
+			return false;
+		std::cout << "Draining: no new connections, " << services.activeTransfers << " transfers running" << std::endl;
+		for (std::size_t i = 0; i < ioServices.size(); ++i)
+		{
+			TinyFTPPassivePortPoolPtr pool = pasvPortPools[i];
+			asio::post(*ioServices[i], [pool]() { pool->closeFree(); });
+		}
+		asio::post(*ioServices[0], [this]()
+		{
+			closeListener();
+			drainDeadline = asio::steady_timer::clock_type::now() + std::chrono::seconds(services.config.drainTimeout);
+			drainTimer.reset(new asio::steady_timer(*ioServices[0]));
+			checkDrain();
+		});
+		return true;
+	}
+
+	void TinyFTPServer::closeListener()
+	{
+		if (!tcpAcceptor->is_open())
+			return;
+		asio::error_code ignored_ec;
+		tcpAcceptor->close(ignored_ec);
+		std::cout << "Listener closed" << std::endl;
+	}
+
+	void TinyFTPServer::checkDrain()
+	{
+		unsigned int running = services.activeTransfers;
+		bool expired = services.config.drainTimeout && asio::steady_timer::clock_type::now() >= drainDeadline;
+		if (running && !expired)
+		{
+			drainTimer->expires_after(std::chrono::seconds(1));
+			drainTimer->async_wait([this](const asio::error_code& e)
+			{
+				if (!e)
+					checkDrain();
+			});
+			return;
+		}
+		if (running)
+			std::cout << "Drain timeout, aborting " << running << " transfers" << std::endl;
+		else
+			std::cout << "Drained, stopping" << std::endl;
+		stop();
+	}
+
+	void TinyFTPServer::releaseForHandoff()
+	{
+		// the io threads own the sockets, wait for them; bounded so a stopping server can't hang the pipe thread
+		std::vector<std::future<void> > released;
+		for (std::size_t i = 0; i < ioServices.size(); ++i)
+		{
+			std::shared_ptr<std::promise<void> > done = std::make_shared<std::promise<void> >();
+			released.push_back(done->get_future());
+			TinyFTPPassivePortPoolPtr pool = pasvPortPools[i];
+			bool closeAcceptor = i == 0;
+			asio::post(*ioServices[i], [this, pool, closeAcceptor, done]()
+			{
+				if (closeAcceptor)
+					closeListener();
+				pool->closeFree();
+				done->set_value();
+			});
+		}
+		for (std::future<void>& future : released)
+			future.wait_for(std::chrono::seconds(5));
+		drain();
+	}
+
 }
@@ -6,16 +6,21 @@
 
 #include <asio\io_context.hpp>
 #include <asio\ip\tcp.hpp>
+#include <asio\steady_timer.hpp>
 
 #include "TinyFTPSession.h"
 #include "TinyFTPRequestHandler.h"
+#include "TinyFTPPassivePortPool.h"
+#include "TinyFTPServices.h"
+#include "TinyFTPTimingWheel.h"
+#include "TinyFTPHandoff.h"
 
 namespace TinyWinFTP 
 {
 	class TinyFTPServer
 	{
 	public:
-		TinyFTPServer(std::string in_docRoot, short port);
+		TinyFTPServer(const TinyFTPServerConfig& in_config);
 
 		// start the server
 		void run();
@@ -23,6 +28,9 @@ namespace TinyWinFTP
 		// stop the server
 		void stop();
 
+		// stop accepting and exit once running transfers are done or drainTimeout passed, false if already draining
+		bool drain();
+
 	private:
 		/// Get an io_context to use.
 		asio::io_context& getIoService();
@@ -30,6 +38,12 @@ namespace TinyWinFTP
 		// async accept incoming clients
 		void doAccept();
 
+		// io thread 0 only
+		void closeListener();
+		void checkDrain();
+		// pipe thread, a new instance took the listener: unbind everything it needs before it goes on
+		void releaseForHandoff();
+
 		/// The pool of io_contexts.
 		std::vector<std::shared_ptr<asio::io_context> > ioServices;
 
@@ -40,20 +54,29 @@ namespace TinyWinFTP
 
 		std::vector<io_context_work > works;
 
+		/// Pre-bound passive ports, one pool per io_context.
+		std::vector<TinyFTPPassivePortPoolPtr> pasvPortPools;
+
+		/// Session timeouts, one wheel per io_context.
+		std::vector<std::unique_ptr<TinyFTPTimingWheel> > timingWheels;
+
 		/// The next io_context to use for a connection.
 		std::size_t nextIoService;
 
-		/// The parser for the incoming request.
-		TinyFTPRequestParser requestParser;
+		/// Config and server wide helpers shared by all sessions.
+		TinyFTPServices services;
 
-		// RequestHandler for the server
-		TinyFTPRequestHandler requestHandler;
+		/// Request parsers and handlers, one of each per io_context.
+		std::vector<std::unique_ptr<TinyFTPRequestParser> > requestParsers;
+		std::vector<std::unique_ptr<TinyFTPRequestHandler> > requestHandlers;
 
-		// acceptor and listener socket
+		// acceptor, on the first io_context, accepting onto each session's own
 		std::shared_ptr<asio::ip::tcp::acceptor> tcpAcceptor;
-		std::shared_ptr<asio::ip::tcp::socket> listenSocket;
 
-		std::string docRoot;
+		// restart support
+		std::unique_ptr<TinyFTPListenerHandoff> handoff;
+		std::unique_ptr<asio::steady_timer> drainTimer;
+		asio::steady_timer::time_point drainDeadline;
 	};
 }
 
@@ -0,0 +1,76 @@
+#ifndef IK80_TINYFTPSERVERCONFIG_H_
+#define IK80_TINYFTPSERVERCONFIG_H_
+
+#include <string>
+#include <vector>
+
+namespace TinyWinFTP
+{
+	/// The tree below directory (docRoot relative, / separated) may hold maxBytes.
+	struct TinyFTPQuota
+	{
+		std::string directory;
+		uint64_t maxBytes = 0;
+	};
+
+	/// Settings the server is started with, filled in from the command line.
+	struct TinyFTPServerConfig
+	{
+		static const unsigned short DEFAULT_PASV_PORT_FIRST = 50000;
+		static const unsigned short DEFAULT_PASV_PORT_LAST = 51023;
+
+		std::string docRoot;
+		unsigned short port = 21;
+
+		// passive ports handed out for PASV/EPSV, split evenly between io threads
+		unsigned short pasvPortFirst = DEFAULT_PASV_PORT_FIRST;
+		unsigned short pasvPortLast = DEFAULT_PASV_PORT_LAST;
+
+		// STOR writes bypass the system cache, falls back to buffered where the filesystem refuses
+		bool unbufferedUploads = true;
+
+		// MODE Z: directory for precompressed copies (empty = off), and how many RETRs make a file worth caching
+		std::string compressionCacheDir;
+		unsigned int compressionCacheMinHits = 2;
+
+		// hash STOR data while it is written and keep the digest with the file, HASH answers from it
+		bool uploadDigest = false;
+		int uploadDigestAlgorithm = 0; // TinyFTPHashAlgorithm, SHA-256
+
+		// upper bound for data socket buffers sized after the measured BDP, 0 leaves them to the stack
+		int maxSocketBuffer = 32 * 1024 * 1024;
+
+		// AUTH TLS: PEM certificate chain and key (key may live in the certificate file), empty = plaintext only
+		std::string tlsCertificateFile;
+		std::string tlsKeyFile;
+
+		// seconds, 0 = never: silent control connection, PASV/PORT data connection setup, transfer without progress
+		unsigned int idleTimeout = 900;
+		unsigned int dataConnectTimeout = 30;
+		unsigned int stallTimeout = 300;
+
+		// restart: take the listening socket from the instance running on this port, and how long a draining
+		// instance lets running transfers finish before it exits (seconds, 0 = no limit)
+		bool takeOver = false;
+		unsigned int drainTimeout = 3600;
+
+		// serve docRoot from RAM: loaded at startup, uploads and changes are never written back
+		bool memoryFileSystem = false;
+
+		// RETR of files up to smallFileMaxSize bytes is served from a cache of smallFileCacheSize bytes, 0 = off
+		uint64_t smallFileCacheSize = 0;
+		uint64_t smallFileMaxSize = 64 * 1024;
+
+		// LIST -R / SITE TREE: directories of one listing scanned at the same time
+		unsigned int treeScanners = 4;
+
+		// threads stat, listing, delete, mkdir, rmdir and rename calls run on
+		unsigned int blockingThreads = 16;
+
+		// keep bytes and files per directory for SITE DU, quotas turn it on as well
+		bool sizeIndex = false;
+		std::vector<TinyFTPQuota> quotas;
+	};
+}
+
+#endif // IK80_TINYFTPSERVERCONFIG_H_
@@ -0,0 +1,73 @@
+#ifndef IK80_TINYFTPSERVICES_H_
+#define IK80_TINYFTPSERVICES_H_
+
+#include <thread>
+
+#include <asio/thread_pool.hpp>
+
+#include "TinyFTPServerConfig.h"
+#include "TinyFTPCompression.h"
+#include "TinyFTPHash.h"
+#include "TinyFTPStream.h"
+#include "TinyFTPTimingWheel.h"
+#include "TinyFTPFileSystem.h"
+#include "TinyFTPFileCache.h"
+#include "TinyFTPBlockingPool.h"
+#include "TinyFTPSizeIndex.h"
+
+namespace TinyWinFTP
+{
+	/// Server wide objects every session and the request handler share. Owned by TinyFTPServer.
+	struct TinyFTPServices
+	{
+		explicit TinyFTPServices(const TinyFTPServerConfig& in_config)
+			: config(in_config),
+			workerPool(std::thread::hardware_concurrency()),
+			blockingPool(in_config.blockingThreads),
+			compressionCache(in_config.compressionCacheDir, in_config.compressionCacheMinHits),
+			tlsContext(createTlsContext(in_config.tlsCertificateFile, in_config.tlsKeyFile)),
+			fileSystem(createFileSystem(in_config)),
+			// the in-memory filesystem is a cache of its own
+			fileCache(in_config.docRoot, in_config.memoryFileSystem ? 0 : in_config.smallFileCacheSize, in_config.smallFileMaxSize),
+			// nothing changes an in-memory tree behind the server's back
+			sizeIndex(*fileSystem, in_config.docRoot, in_config.sizeIndex || !in_config.quotas.empty(), !in_config.memoryFileSystem, in_config.quotas)
+		{
+		}
+
+		const TinyFTPServerConfig config;
+
+		/// CPU heavy work (compression, hashing) runs here so io threads keep serving sockets.
+		asio::thread_pool workerPool;
+
+		/// Filesystem metadata calls, so slow storage stalls only the sessions that wait on it.
+		TinyFTPBlockingPool blockingPool;
+
+		TinyFTPCompressionCache compressionCache;
+
+		/// HASH/XCRC/... results, repeat verifications of an unchanged file cost a lookup.
+		TinyFTPDigestCache digestCache;
+
+		/// Shared by every connection so data connections can resume the control connection's TLS session, null without TLS.
+		std::unique_ptr<TinyFTPTlsContext> tlsContext;
+
+		TinyFTPTimeoutStats timeoutStats;
+
+		/// Where RETR, STOR, LIST and friends find their files.
+		std::unique_ptr<TinyFTPFileSystem> fileSystem;
+
+		TinyFTPFileCache fileCache;
+
+		/// SITE DU and quotas.
+		TinyFTPSizeIndex sizeIndex;
+
+		/// Set when the server stops accepting; sessions close after their current request.
+		std::atomic_bool draining{ false };
+		/// RETR/STOR in flight, a draining server exits when this reaches 0.
+		std::atomic<unsigned int> activeTransfers{ 0 };
+
+		TinyFTPServices(const TinyFTPServices& other) = delete;
+		TinyFTPServices(TinyFTPServices&& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPSERVICES_H_
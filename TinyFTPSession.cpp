@@ -1,15 +1,25 @@
 #include <functional>
 
 #include <iostream>
-#include <regex>
 
 #include <asio\io_context.hpp>
 #include <asio\placeholders.hpp>
 #include <asio\error.hpp>
 #include <asio\ip\tcp.hpp>
 #include <asio\buffer.hpp>
+#include <asio\read.hpp>
+#include <asio\write_at.hpp>
+#include <asio\read_at.hpp>
+#include <asio\post.hpp>
+#include <asio\co_spawn.hpp>
+#include <asio\detached.hpp>
+#include <asio\redirect_error.hpp>
+#include <asio\as_tuple.hpp>
+#include <asio\bind_allocator.hpp>
+#include <asio\use_awaitable.hpp>
 
 #include "TinyFTPSession.h"
+#include "TinyFTPPath.h"
 
 #include "TinyFTPRequestHandler.h"
 
@@ -17,34 +27,11 @@
 namespace TinyWinFTP
 {
 
-	namespace
-	{
-		uint16_t atous(const char* beg, const char* end)
-		{
-			int value = 0;
-			int len = end - beg; // assuming end is past beg;
-			switch (len)
-				// handle up to 5 digits, assume we're 16-bit
-			{
-			case 5:
-				value += (beg[len - 5] - '0') * 10000;
-			case 4:
-				value += (beg[len - 4] - '0') * 1000;
-			case 3:
-				value += (beg[len - 3] - '0') * 100;
-			case 2:
-				value += (beg[len - 2] - '0') * 10;
-			case 1:
-				value += (beg[len - 1] - '0');
-			}
-			return value;
-		}
-	}
-
+	// buffers, when given, go out before and after the file data in the same call
 	template <typename Handler>
-	void transmit_file(asio::ip::tcp::socket& socket, asio::windows::random_access_handle& file, Handler handler, uint64_t offset, LARGE_INTEGER total)
+	void transmit_file(asio::ip::tcp::socket& socket, asio::windows::random_access_handle& file, Handler handler, uint64_t offset, LARGE_INTEGER total, LPTRANSMIT_FILE_BUFFERS buffers)
 	{
-		asio::windows::overlapped_ptr overlapped(socket.get_executor(), handler);
+		asio::windows::overlapped_ptr overlapped(socket.get_executor(), std::move(handler));
 
 		uint64_t totalBytes = total.HighPart;
 		totalBytes = totalBytes << 32;
@@ -62,7 +49,7 @@ namespace TinyWinFTP
 
 		std::cout << "::TransmitFile, bytes " << bytesToWrite << ", offset " << offset << std::endl;
 
-		BOOL ok = ::TransmitFile(socket.native_handle(), file.native_handle(), bytesToWrite, 0, realOverlapped, 0, 0);
+		BOOL ok = ::TransmitFile(socket.native_handle(), file.native_handle(), bytesToWrite, 0, realOverlapped, buffers, 0);
 		DWORD last_error = ::GetLastError();
 
 		// Check if the operation completed immediately.
@@ -83,534 +70,1279 @@ namespace TinyWinFTP
 		}
 	}
 
-	TinyFTPSession::TinyFTPSession(asio::io_context& in_ioService, asio::ip::tcp::socket&& in_socket, TinyFTPRequestHandler* handler, TinyFTPRequestParser& parser, std::string in_docRoot) : service(in_ioService),
+	// TransmitPackets isn't exported by mswsock.lib, the provider hands out a pointer to it
+	LPFN_TRANSMITPACKETS getTransmitPackets(SOCKET socket)
+	{
+		static LPFN_TRANSMITPACKETS transmitPackets = [socket]()
+		{
+			LPFN_TRANSMITPACKETS function = 0;
+			GUID guid = WSAID_TRANSMITPACKETS;
+			DWORD bytes = 0;
+			if (::WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &function, sizeof(function), &bytes, 0, 0) != 0)
+				std::cout << "TransmitPackets not available, error " << ::WSAGetLastError() << std::endl;
+			return function;
+		}();
+		return transmitPackets;
+	}
+
+	// sends memory and file ranges in the order given, one call for the lot
+	template <typename Handler>
+	void transmit_packets(asio::ip::tcp::socket& socket, Handler handler, LPTRANSMIT_PACKETS_ELEMENT packets, DWORD count)
+	{
+		asio::windows::overlapped_ptr overlapped(socket.get_executor(), std::move(handler));
+
+		LPFN_TRANSMITPACKETS transmitPackets = getTransmitPackets(socket.native_handle());
+		BOOL ok = transmitPackets && transmitPackets(socket.native_handle(), packets, count, 0, overlapped.get(), 0);
+		DWORD last_error = transmitPackets ? ::GetLastError() : ERROR_NOT_SUPPORTED;
+
+		if (!ok && last_error != ERROR_IO_PENDING)
+		{
+			asio::error_code ec(last_error,
+				asio::error::get_system_category());
+			overlapped.complete(ec, 0);
+		}
+		else
+			overlapped.release();
+	}
+
+	template <typename CompletionToken>
+	auto async_transmit_packets(asio::ip::tcp::socket& socket, LPTRANSMIT_PACKETS_ELEMENT packets, DWORD count, CompletionToken&& token)
+	{
+		return asio::async_initiate<CompletionToken, void(asio::error_code, std::size_t)>(
+			[&socket, packets, count](auto handler)
+		{
+			transmit_packets(socket, std::move(handler), packets, count);
+		}, token);
+	}
+
+	template <typename CompletionToken>
+	auto async_transmit_file(asio::ip::tcp::socket& socket, asio::windows::random_access_handle& file, uint64_t offset, LARGE_INTEGER total, LPTRANSMIT_FILE_BUFFERS buffers, CompletionToken&& token)
+	{
+		return asio::async_initiate<CompletionToken, void(asio::error_code, std::size_t)>(
+			[&socket, &file, offset, total, buffers](auto handler)
+		{
+			transmit_file(socket, file, std::move(handler), offset, total, buffers);
+		}, token);
+	}
+
+	auto TinyFTPSession::sessionToken(asio::error_code& e)
+	{
+		return asio::bind_allocator(handlerAllocator(), asio::redirect_error(asio::use_awaitable, e));
+	}
+
+	TinyFTPSession::TinyFTPSession(asio::io_context& in_ioService, asio::ip::tcp::socket&& in_socket, TinyFTPRequestHandler* handler, TinyFTPRequestParser& parser, TinyFTPPassivePortPoolPtr in_pasvPortPool, TinyFTPTimingWheel& in_timingWheel, TinyFTPServices& in_services) : service(in_ioService),
 		socket(std::move(in_socket)),
 		requestHandler(handler),
+		alloSize(-1),
 		requestParser(parser),
-		fileBytesSent(0),
-		pasvPort(-1),
-		fileToSend(in_ioService)
-	{
-		docRoot = in_docRoot;
-		std::replace(docRoot.begin(), docRoot.end(), '/', '\\');
-		while (*docRoot.rbegin() == '\\' && docRoot.size() > 1)
-			docRoot = docRoot.substr(0, docRoot.size() - 1);
+		pasvPortPool(in_pasvPortPool),
+		pasvAcceptor(nullptr),
+		protectData(false),
+		dataSocketTuner(in_services.config.maxSocketBuffer),
+		tuningTimer(in_ioService),
+		timingWheel(in_timingWheel),
+		stallProgress(0),
+		connectExpired(false),
+		idleClosing(false),
+		dataOpDone(in_ioService),
+		progressWriting(false),
+		docRoot(in_services.config.docRoot),
+		services(in_services),
+		unbufferedUploads(in_services.config.unbufferedUploads),
+		modeZ(false),
+		modeB(false),
+		zEngine(COMPRESSION_DEFLATE),
+		zLevel(DEFAULT_DEFLATE_LEVEL),
+		hashAlgorithm(HASH_SHA256)
+	{
 		curDirectory = "\\";
 
-		fileBytesTotal.QuadPart = 0;
 		dataOpInProgress = false;
 		dataSocketConnected = false;
+		idleTimeout.onExpired = [this]() { handleIdleTimeout(); };
+		connectTimeout.onExpired = [this]() { handleConnectTimeout(); };
+		handshakeTimeout.onExpired = [this]() { handleHandshakeTimeout(); };
+		stallTimeout.onExpired = [this]() { handleStallTimeout(); };
 		std::cout << "Session created" << std::endl;
 	}
 
 	TinyFTPSession::~TinyFTPSession()
 	{
+		timingWheel.cancel(idleTimeout);
+		timingWheel.cancel(connectTimeout);
+		timingWheel.cancel(handshakeTimeout);
+		timingWheel.cancel(stallTimeout);
 		asio::error_code ignored_ec;
 		socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
 
 		if (socketData.get())
 			socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-		if (fileToSend.is_open())
-			fileToSend.close();
 
-		if (tcpAcceptor.get())
-		{
-			tcpAcceptor->cancel();
-			tcpAcceptor->close();
-			tcpAcceptor.reset();
-		}
-		if (pasvPort != -1)
+		if (pasvAcceptor)
 		{
-			requestHandler->releasePassivePort(pasvPort);
-			pasvPort = -1;
+			pasvPortPool->release(pasvAcceptor);
+			pasvAcceptor = nullptr;
 		}
 
-		fileBytesTotal.QuadPart = 0;
-		fileBytesSent = 0;
 		std::cout << "Session destroyed" << std::endl;
 	}
 
 	void TinyFTPSession::start()
 	{
-		asio::async_write(socket, asio::buffer(WELCOME_STRING, strlen(WELCOME_STRING)),
-			std::bind(&TinyFTPSession::handleWriteControl, shared_from_this(),
-				std::placeholders::_1));
+		asio::co_spawn(service, controlLoop(shared_from_this()), asio::detached);
 		std::cout << "Session started" << std::endl;
 	}
 
-	void TinyFTPSession::handleReadControl(const asio::error_code& e, std::size_t bytes_transferred)
+	// one request at a time: read it, let the handler answer, wait out whatever the handler left running, repeat
+	asio::awaitable<void> TinyFTPSession::controlLoop(TinyFTPSessionPtr self)
 	{
-		if (!e)
+		asio::error_code e;
+		co_await asio::async_write(socket, asio::buffer(WELCOME_STRING, strlen(WELCOME_STRING)), sessionToken(e));
+		while (!e)
 		{
+			timingWheel.schedule(idleTimeout, services.config.idleTimeout);
+			std::size_t bytes_transferred = co_await socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()), sessionToken(e));
+			timingWheel.cancel(idleTimeout);
+			if (e)
+			{
+				std::cout << "Control channel: error on read" << std::endl;
+				break;
+			}
+
 			char* beginBuffer = buffer.data(), * endBuffer = buffer.data() + bytes_transferred;
 			std::cout << "Control channel:" << std::string(beginBuffer, endBuffer);
 			TinyFTPRequestParser::ParserResult result = requestParser.parse(request, beginBuffer, endBuffer);
-
-			if (result == TinyFTPRequestParser::SUCCESS)
+			if (result == TinyFTPRequestParser::NEEDMORE)
 			{
-				requestHandler->handleRequest(request, reply, this);
-				if (!reply.content.empty())
-				{
-					asio::async_write(socket, asio::buffer(reply.content.data(), reply.content.size()), std::bind(&TinyFTPSession::handleWriteControl, shared_from_this(), std::placeholders::_1));
-				}
-				else if (!dataOpInProgress)
-				{
-					socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()), std::bind(&TinyFTPSession::handleReadControl, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-					std::cout << "Control channel: resuming" << std::endl;
-				}
+				std::cout << "Control channel: underrun" << std::endl;
+				continue;
 			}
-			else if (result == TinyFTPRequestParser::FAIL)
+			if (result == TinyFTPRequestParser::SUCCESS)
+				requestHandler->handleRequest(request, reply, this);
+			else
 			{
 				std::cout << "Control channel: failed to parse" << std::endl;
 				reply.content = StatusStrings::bad_request;
-				asio::async_write(socket, asio::buffer(reply.content.data(), reply.content.size()), std::bind(&TinyFTPSession::handleWriteControl, shared_from_this(), std::placeholders::_1));
 			}
-			else if (result == TinyFTPRequestParser::NEEDMORE)
+			if (!reply.content.empty())
+				co_await asio::async_write(socket, asio::buffer(reply.content.data(), reply.content.size()), sessionToken(e));
+
+			// a transfer or worker job the handler started ends with completeDataOp(), its final reply goes out from here
+			// once no progress line is being written
+			while (!e && (dataOpInProgress || progressWriting))
 			{
-				std::cout << "Control channel: underrun" << std::endl;
-				socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()), std::bind(&TinyFTPSession::handleReadControl, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-				std::cout << "Control channel: resuming" << std::endl;
+				asio::error_code ignored_ec;
+				dataOpDone.expires_at(asio::steady_timer::time_point::max());
+				co_await dataOpDone.async_wait(sessionToken(ignored_ec));
+			}
+			if (!e && !deferredReply.empty())
+			{
+				reply.content.swap(deferredReply);
+				deferredReply.clear();
+				co_await asio::async_write(socket, asio::buffer(reply.content.data(), reply.content.size()), sessionToken(e));
+			}
+			if (!e && services.draining)
+			{
+				std::cout << "Control channel: server draining" << std::endl;
+				co_await asio::async_write(socket, asio::buffer(StatusStrings::server_draining, sizeof(StatusStrings::server_draining) - 1), sessionToken(e));
+				break;
 			}
+			std::cout << "Control channel: resuming" << std::endl;
+		}
+
+		std::cout << "Control channel: closing both sockets" << std::endl;
+		// Initiate graceful TinyFTPSession closure, a transfer still running fails on its socket and lets go of the session.
+		asio::error_code ignored_ec;
+		socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+		if (socketData.get())
+			socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+	}
+
+	// io thread only, wakes the control loop with the final reply of the pending request
+	void TinyFTPSession::completeDataOp(std::string finalReply)
+	{
+		deferredReply = finalReply;
+		dataOpInProgress = false;
+		dataOpDone.cancel();
+	}
+
+	// for STOR command: network reads and disk writes run side by side through the upload pipe
+	asio::awaitable<void> TinyFTPSession::receiveUpload(TinyFTPSessionPtr self)
+	{
+		auto pipe = makeUploadPipe(service, handlerMemory,
+			[this](TinyFTPUploadBuffer& buffer, asio::error_code& e, bool& last) { return readUploadBuffer(buffer, e, last); },
+			[this](TinyFTPUploadChunk chunk) { return writeUploadChunk(chunk); });
+		bool ok = co_await pipe.run(transfer->uploadBuffers.buffers);
+		finishUpload(ok);
+	}
+
+	// fills one buffer from the data connection, last is set once the upload has all its bytes
+	asio::awaitable<std::size_t> TinyFTPSession::readUploadBuffer(TinyFTPUploadBuffer& buffer, asio::error_code& e, bool& last)
+	{
+		TinyFTPUploadBuffers& uploadBuffers = transfer->uploadBuffers;
+		std::size_t bytes_transferred;
+		bool endOfStream;
+		if (modeB)
+		{
+			// the sender's EOF block ends the upload, the connection stays open for the next transfer
+			bytes_transferred = co_await readBlocks(buffer.data(), RECV_BUFFER_SIZE, e);
+			endOfStream = !e && transfer->blockEof && !transfer->blockRemaining;
 		}
 		else
 		{
-			std::cout << "Control channel: error on read" << std::endl;
-			// Initiate graceful TinyFTPSession closure.
+			// whole buffers keep unbuffered disk writes sector aligned, only the last one may be short
+			size_t bytesToRead = RECV_BUFFER_SIZE;
+			if (uploadBuffers.expectedUploadSize != -1 && uploadBuffers.expectedUploadSize - uploadBuffers.processedUploadSize < (long long int)RECV_BUFFER_SIZE)
+				bytesToRead = (size_t)(uploadBuffers.expectedUploadSize - uploadBuffers.processedUploadSize);
+
+			bytes_transferred = co_await asio::async_read(*socketData, asio::buffer(buffer.data(), bytesToRead), asio::transfer_exactly(bytesToRead), sessionToken(e));
+			// reads ask for a full buffer, so eof is how a client without ALLO ends the upload
+			endOfStream = (e == asio::error::eof);
+		}
+		if (e && !endOfStream)
+		{
+			std::cout << "Data channel: upload: error on read" << std::endl;
+			co_return 0;
+		}
+
+		std::cout << "Data channel: upload: read " << bytes_transferred << " bytes" << std::endl;
+		uploadBuffers.processedUploadSize += bytes_transferred;
+		last = endOfStream || (!modeB && uploadBuffers.expectedUploadSize != -1 && uploadBuffers.processedUploadSize >= uploadBuffers.expectedUploadSize);
+		if (last)
+			std::cout << "Data channel: upload: network read complete" << std::endl;
+		co_return bytes_transferred;
+	}
+
+	// MODE B upload: block headers are stripped, data fills the buffer until it is full or the EOF block is through.
+	// Restart markers are read and dropped, we don't restart uploads.
+	asio::awaitable<std::size_t> TinyFTPSession::readBlocks(char* data, std::size_t size, asio::error_code& e)
+	{
+		std::size_t filled = 0;
+		while (!e && filled < size)
+		{
+			if (!transfer->blockRemaining)
+			{
+				if (transfer->blockEof)
+					break;
+				unsigned char header[BLOCK_HEADER_SIZE];
+				co_await asio::async_read(*socketData, asio::buffer(header), sessionToken(e));
+				transfer->blockEof = (header[0] & BLOCK_EOF) != 0;
+				transfer->blockIsMarker = (header[0] & BLOCK_RESTART) != 0;
+				transfer->blockRemaining = e ? 0 : blockLength(header);
+				continue;
+			}
+			std::size_t bytesToRead = std::min(size - filled, transfer->blockRemaining);
+			std::size_t bytesRead = co_await asio::async_read(*socketData, asio::buffer(data + filled, bytesToRead), sessionToken(e));
+			transfer->blockRemaining -= bytesRead;
+			if (!transfer->blockIsMarker)
+				filled += bytesRead;
+		}
+		co_return filled;
+	}
+
+	// writes a full buffer at the end of the file, in the order they were read
+	asio::awaitable<bool> TinyFTPSession::writeUploadChunk(TinyFTPUploadChunk chunk)
+	{
+		TinyFTPUploadBuffers& uploadBuffers = transfer->uploadBuffers;
+		// in-memory filesystem, the "disk write" is a copy
+		if (transfer->uploadContent)
+		{
+			transfer->uploadContent->append(chunk.second->data(), chunk.first);
+			uploadBuffers.diskWriteOffset += chunk.first;
+			co_return true;
+		}
+
+		// unbuffered handles take sector multiples only, tail gets padded and cut off in finishUpload()
+		size_t bytesToWrite = chunk.first;
+		if (uploadBuffers.unbuffered && bytesToWrite % uploadBuffers.diskAlignment)
+			bytesToWrite += uploadBuffers.diskAlignment - bytesToWrite % uploadBuffers.diskAlignment;
+
+		asio::error_code e;
+		std::size_t bytes_transferred = co_await asio::async_write_at(transfer->file, uploadBuffers.diskWriteOffset, asio::buffer(chunk.second->data(), bytesToWrite), sessionToken(e));
+		if (e)
+		{
+			std::cout << "Disk write: error" << std::endl;
+			// the pipe wakes a reader waiting for a free buffer, this one may be waiting on the socket
 			asio::error_code ignored_ec;
-			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (socketData.get())
-				socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			socketData->lowest_layer().cancel(ignored_ec);
+			co_return false;
 		}
+
+		std::cout << "Disk write: written " << bytes_transferred << " bytes" << std::endl;
+		uploadBuffers.diskWriteOffset += chunk.first;
+		if (transfer->uploadHasher)
+			transfer->uploadHasher->update(chunk.second->data(), chunk.first);
+		co_return true;
 	}
 
-	// for STOR command
-	void TinyFTPSession::handleReadData(const asio::error_code& e, std::size_t bytes_transferred)
+	// all data is on disk or the upload failed, close up and tell the client
+	void TinyFTPSession::finishUpload(bool ok)
 	{
-		if (!e)
+		TinyFTPUploadBuffers& uploadBuffers = transfer->uploadBuffers;
+		if (uploadBuffers.unbuffered && uploadBuffers.diskWriteOffset % uploadBuffers.diskAlignment)
 		{
-			std::lock_guard<std::mutex> buffersGuard(uploadBuffers.queueMutex);
-			std::cout << "Data channel: upload: read " << bytes_transferred << " bytes" << std::endl;
+			FILE_END_OF_FILE_INFO endOfFile;
+			endOfFile.EndOfFile.QuadPart = uploadBuffers.diskWriteOffset;
+			if (!SetFileInformationByHandle(transfer->file.native_handle(), FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+				std::cout << "Disk write: failed to trim sector padding, error " << GetLastError() << std::endl;
+		}
 
-			uploadBuffers.processedUploadSize += bytes_transferred;
-			if (uploadBuffers.expectedUploadSize != -1 && uploadBuffers.expectedUploadSize == uploadBuffers.processedUploadSize)
-				uploadBuffers.noMoreReads = true;
-			uploadBuffers.fullBuffers.emplace_back(bytes_transferred, uploadBuffers.curNetworkBuffer);
-			uploadBuffers.curNetworkBuffer = 0;
+		finishDataConnection(ok);
+		if (transfer->file.is_open())
+			transfer->file.close();
+		services.fileSystem->finishWrite(transfer->uploadFilename, transfer->uploadContent, ok);
+		services.fileCache.invalidate(transfer->uploadFilename);
+		if (services.sizeIndex.isEnabled())
+		{
+			std::string filename = transfer->uploadFilename;
+			TinyFTPSizeIndex& sizeIndex = services.sizeIndex;
+			services.blockingPool.post(BLOCKING_STAT, [&sizeIndex, filename]() { sizeIndex.refresh(filename); });
+		}
+		std::cout << "Disk write: upload " << (ok ? "complete" : "failed") << ": closing socket and file" << std::endl;
+		std::string hexDigest;
+		if (ok && transfer->uploadHasher)
+			hexDigest = transfer->uploadHasher->finish();
+		std::string filename = transfer->uploadFilename;
+		transfer.reset();
+		timingWheel.cancel(stallTimeout);
+
+		if (!hexDigest.empty())
+			storeUploadDigest(filename, hexDigest);
+		else
+			completeDataOp(ok ? StatusStrings::transfer_complete : StatusStrings::transfer_aborted);
+	}
 
-			if (uploadBuffers.emptyBuffers.empty())
-			{
-				std::cout << "Data channel: upload: not enough network buffers, starved" << std::endl;
-				uploadBuffers.starved = true;
-			}
-			else if (bytes_transferred == 0) 
-			{
-				std::cout << "Data channel: upload: network read complete" << std::endl;
-				uploadBuffers.noMoreReads = true;
-			}
+	// digest of what was just written goes next to the file and into the cache, before the client sees 226;
+	// opening the stream and putting the mtime back is file system work, it runs on the blocking pool
+	void TinyFTPSession::storeUploadDigest(const std::string& filename, const std::string& hexDigest)
+	{
+		TinyFTPHashAlgorithm algorithm = (TinyFTPHashAlgorithm)services.config.uploadDigestAlgorithm;
+		TinyFTPDigestCache& digestCache = services.digestCache;
+		runBlocking(BLOCKING_OPEN, [&digestCache, algorithm, filename, hexDigest]()
+		{
+			uint64_t size = 0, mtime = 0;
+			if (!storeDigestAttribute(filename, algorithm, hexDigest, size, mtime))
+				std::cout << "Disk write: could not store upload digest" << std::endl;
 			else
 			{
-				uploadBuffers.starved = false;
-
-				auto buffersFront = std::move(uploadBuffers.emptyBuffers.front());
-				uploadBuffers.curNetworkBuffer = buffersFront.second;
-				uploadBuffers.emptyBuffers.pop_front();
-				socketData->async_read_some(asio::buffer(uploadBuffers.curNetworkBuffer->data(), uploadBuffers.curNetworkBuffer->max_size()), std::bind(&TinyFTPSession::handleReadData, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-				std::cout << "Data channel: upload: reading" << std::endl;
+				digestCache.store(algorithm, filename, size, mtime, hexDigest);
+				std::cout << "Disk write: " << hashAlgorithmName(algorithm) << " " << hexDigest << std::endl;
 			}
+			// the upload itself went through either way
+			return std::string(StatusStrings::transfer_complete);
+		});
+	}
+
+	// takes a listening port from the pool for this connection
+	int TinyFTPSession::openPassivePort()
+	{
+		// asking for a new connection, the one MODE B kept is done with
+		closeDataSocket();
+		if (!pasvAcceptor)
+			pasvAcceptor = pasvPortPool->acquire();
+		// passive from here on, an older PORT address is not a fallback
+		activeEndpoint = asio::ip::tcp::endpoint();
+		if (!pasvAcceptor)
+		{
+			std::cout << "Pasv port pool exhausted" << std::endl;
+			return -1;
+		}
+		asio::error_code ec;
+		int port = pasvAcceptor->local_endpoint(ec).port();
+		std::cout << "Pasv port opened " << port << std::endl;
+		return port;
+	}
 
-			if (!uploadBuffers.writeInProgress)
+	// RETR, STOR, LIST and SITE MGET: the connection MODE B kept from the last transfer, or a new one
+	void TinyFTPSession::startDataSocket(DataConnectionReady onReady)
+	{
+		dataOpInProgress = true;
+		asio::co_spawn(service, openDataConnection(shared_from_this(), std::move(onReady)), asio::detached);
+	}
+
+	// accept and connect wait on the io thread like any other operation, the wheel cancels them after dataConnectTimeout
+	asio::awaitable<void> TinyFTPSession::openDataConnection(TinyFTPSessionPtr self, DataConnectionReady onReady)
+	{
+		if (socketData)
+		{
+			// nothing may arrive on an idle kept connection, if something does the client closed it
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(socketData->lowest_layer().native_handle(), &readable);
+			timeval noWait = { 0, 0 };
+			if (::select(0, &readable, 0, 0, &noWait) == 0)
 			{
-				std::cout << "Data channel: upload: no disk write in progress, starting" << std::endl;
-				uploadBuffers.writeInProgress = true;
-				auto buffersFront = std::move(uploadBuffers.fullBuffers.front());
-				uploadBuffers.curDiskBuffer = buffersFront.second;
-				size_t bytesToWrite = buffersFront.first;
-				uploadBuffers.fullBuffers.pop_front();
-
-				GetFileSizeEx(fileToSend.native_handle(), &fileBytesTotal);
-				uint64_t totalBytes = fileBytesTotal.HighPart;
-				totalBytes = totalBytes << 32;
-				totalBytes += fileBytesTotal.LowPart;
-
-				fileToSend.async_write_some_at(totalBytes, asio::buffer(uploadBuffers.curDiskBuffer->data(), bytesToWrite), std::bind(&TinyFTPSession::handleWriteDisk, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+				std::cout << "Data channel: reusing connection" << std::endl;
+				onReady(*this);
+				co_return;
 			}
+			std::cout << "Data channel: kept connection was closed by the client" << std::endl;
+			closeDataSocket();
+		}
+		// MODE B gave the passive port back while it kept the connection, with that gone there is nothing to
+		// accept on; the same without any PASV, EPSV, PORT or EPRT before
+		if (!isPassiveMode() && !activeEndpoint.port())
+		{
+			std::cout << "Data channel: no passive port and no active address" << std::endl;
+			completeDataOp(StatusStrings::no_data_connection);
+			co_return;
+		}
+
+		asio::error_code e;
+		bool passive = isPassiveMode();
+		socketData.reset(new TinyFTPStream(service));
+		connectExpired = false;
+		timingWheel.schedule(connectTimeout, services.config.dataConnectTimeout);
+		if (passive)
+		{
+			std::cout << "Data channel: starting in pasv mode" << std::endl;
+			co_await pasvAcceptor->async_accept(socketData->lowest_layer(), sessionToken(e));
 		}
 		else
 		{
-			std::cout << "Data channel: upload: error, shutting down data socket" << std::endl;
-			uploadBuffers.expectedUploadSize = -1;
-			uploadBuffers.processedUploadSize = -1;
-			uploadBuffers.noMoreReads = true;
-			// Initiate graceful TinyFTPSession closure.
+			std::cout << "Data channel: starting in standard mode" << std::endl;
+			co_await socketData->lowest_layer().async_connect(activeEndpoint, sessionToken(e));
+		}
+		// PROT P, the client starts the handshake as soon as it is connected. Nothing goes out in the clear
+		// if it fails.
+		bool handshakeFailed = false;
+		if (!e && protectData && services.tlsContext)
+		{
+			co_await socketData->async_handshake(*services.tlsContext, sessionToken(e));
+			handshakeFailed = e && !connectExpired;
+		}
+		timingWheel.cancel(connectTimeout);
+		if (connectExpired)
+		{
+			e = asio::error::timed_out;
+			++services.timeoutStats.dataConnectTimeouts;
+		}
+		if (e)
+		{
+			std::cout << "Data channel: " << (handshakeFailed ? "TLS handshake" : passive ? "accept" : "connect") << " failed, " << e.message() << std::endl;
+			socketData.reset();
+			completeDataOp(handshakeFailed ? StatusStrings::data_tls_failed : StatusStrings::cant_open_data_connection);
+			co_return;
+		}
+
+		socketData->lowest_layer().set_option(asio::ip::tcp::no_delay(false), e);
+		startSocketTuning();
+		dataSocketConnected = true;
+		std::cout << "Data channel: started" << std::endl;
+		onReady(*this);
+	}
+
+	// no data connection within dataConnectTimeout seconds, the pending accept or connect fails
+	void TinyFTPSession::handleConnectTimeout()
+	{
+		std::cout << "Data channel: no connection after " << services.config.dataConnectTimeout << "s" << std::endl;
+		connectExpired = true;
+		asio::error_code ignored_ec;
+		if (pasvAcceptor)
+			pasvAcceptor->cancel(ignored_ec);
+		if (socketData)
+			socketData->lowest_layer().close(ignored_ec);
+	}
+
+	// the control connection has been silent for idleTimeout seconds, the control loop exits on the failed read.
+	// The 421 goes out asynchronously; a client that doesn't even take that is cut off on the next expiry.
+	void TinyFTPSession::handleIdleTimeout()
+	{
+		asio::error_code ignored_ec;
+		if (idleClosing)
+		{
+			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			socket.lowest_layer().close(ignored_ec);
+			return;
+		}
+		std::cout << "Control channel: idle for " << services.config.idleTimeout << "s, closing" << std::endl;
+		++services.timeoutStats.idleTimeouts;
+		idleClosing = true;
+		timingWheel.schedule(idleTimeout, services.config.idleTimeout);
+		std::shared_ptr<TinyFTPSession> self = shared_from_this();
+		// the wheel is single threaded, complete on the session's own io_context whatever the stream's executor
+		asio::async_write(socket, asio::buffer(StatusStrings::idle_timeout, sizeof(StatusStrings::idle_timeout) - 1),
+			asio::bind_executor(service, asio::bind_allocator(handlerAllocator(), [self](const asio::error_code&, std::size_t)
+		{
 			asio::error_code ignored_ec;
-			if (socketData.get())
-				socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			self->timingWheel.cancel(self->idleTimeout);
+			self->socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			self->socket.lowest_layer().cancel(ignored_ec);
+		})));
+	}
+
+	// bytes the stack moved on the data connection, TransmitFile gives no progress of its own
+	uint64_t TinyFTPSession::transferProgress()
+	{
+		uint64_t bytesOut = 0, bytesIn = 0;
+		if (socketData && readTcpByteCounters(socketData->lowest_layer(), bytesOut, bytesIn))
+			return bytesOut + bytesIn;
+		// no SIO_TCP_INFO, count what went through our own loops
+		return transfer ? transfer->bytesSent + transfer->uploadBuffers.diskWriteOffset : 0;
+	}
+
+	void TinyFTPSession::startStallWatch()
+	{
+		stallProgress = transferProgress();
+		timingWheel.schedule(stallTimeout, services.config.stallTimeout);
+	}
+
+	// checked every stallTimeout seconds while a transfer runs, aborts it if nothing moved since the last check
+	void TinyFTPSession::handleStallTimeout()
+	{
+		if (!transfer || !socketData)
+			return;
+		uint64_t progress = transferProgress();
+		if (progress != stallProgress)
+		{
+			stallProgress = progress;
+			timingWheel.schedule(stallTimeout, services.config.stallTimeout);
+			return;
 		}
+		std::cout << "Data channel: no progress for " << services.config.stallTimeout << "s, aborting transfer" << std::endl;
+		++services.timeoutStats.stallTimeouts;
+		asio::error_code ignored_ec;
+		socketData->lowest_layer().cancel(ignored_ec);
+		socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
 	}
 
-	void TinyFTPSession::handleWriteDisk(const asio::error_code& e, std::size_t bytes_transferred)
+	// close data socket
+	void TinyFTPSession::closeDataSocket()
 	{
-		if (!e)
+		if (!socketData)
+			return;
+		std::cout << "Data channel: closing socket" << std::endl;
+		tuningTimer.cancel();
+		dataSocketTuner.update(socketData->lowest_layer());
+		const TinyFTPTransferStats& stats = dataSocketTuner.getStats();
+		std::cout << "Data channel: " << stats.bytesTransferred << " bytes, rtt " << stats.rttUs << "us, bdp " << stats.bdpBytes
+			<< ", SO_SNDBUF " << stats.sendBuffer << ", SO_RCVBUF " << stats.receiveBuffer << ", " << stats.adjustments << " adjustments" << std::endl;
+		socketData->close(socketData);
+		socketData.reset();
+		if (pasvAcceptor)
 		{
-			std::cout << "Disk write: written " << bytes_transferred << " bytes" << std::endl;
-			std::lock_guard<std::mutex> buffersGuard(uploadBuffers.queueMutex);
+			pasvPortPool->release(pasvAcceptor);
+			pasvAcceptor = nullptr;
+		}
+	}
 
-			uploadBuffers.emptyBuffers.emplace_back(0, uploadBuffers.curDiskBuffer);
-			uploadBuffers.curDiskBuffer = 0;
+	// end of a transfer: MODE B keeps a connection that ended with its EOF block, anything else is closed
+	void TinyFTPSession::finishDataConnection(bool ok)
+	{
+		if (!ok || !modeB || !socketData)
+		{
+			closeDataSocket();
+			return;
+		}
+		std::cout << "Data channel: keeping connection for the next transfer" << std::endl;
+		dataSocketTuner.update(socketData->lowest_layer());
+		// the port isn't needed while the connection lasts, PASV after it takes a new one anyway. Should the client
+		// close the connection, the next transfer gets a 425 asking for a new PASV or EPSV.
+		if (pasvAcceptor)
+		{
+			pasvPortPool->release(pasvAcceptor);
+			pasvAcceptor = nullptr;
+		}
+	}
 
-			if (uploadBuffers.starved)
-			{
-				std::cout << "Disk write: network was starved for buffers" << std::endl;
-				uploadBuffers.starved = false;
-				auto buffersFront = std::move(uploadBuffers.emptyBuffers.front());
-				uploadBuffers.curNetworkBuffer = buffersFront.second;
-				uploadBuffers.emptyBuffers.pop_front();
-				socketData->async_read_some(asio::buffer(uploadBuffers.curNetworkBuffer->data(), uploadBuffers.curNetworkBuffer->max_size()), std::bind(&TinyFTPSession::handleReadData, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-				std::cout << "Data channel: upload: restarting read from socket, after disk write released a free buffer" << std::endl;
-			}
+	// first sample comes from the handshake, then one every TUNING_INTERVAL_MS until the socket closes
+	void TinyFTPSession::startSocketTuning()
+	{
+		dataSocketTuner.start(socketData->lowest_layer());
+		if (!dataSocketTuner.enabled())
+			return;
+		tuningTimer.expires_after(std::chrono::milliseconds(TinyFTPBufferTuner::TUNING_INTERVAL_MS));
+		tuningTimer.async_wait(asio::bind_allocator(handlerAllocator(), std::bind(&TinyFTPSession::handleTuningTimer, shared_from_this(), std::placeholders::_1)));
+	}
 
-			if (uploadBuffers.fullBuffers.empty())
-			{
-				std::cout << "Disk write: write buffers empty: stopping disk write" << std::endl;
-				uploadBuffers.writeInProgress = false;
-				if (uploadBuffers.noMoreReads)
-				{
-					std::cout << "Disk write: write buffers empty: network wont read more data" << std::endl;
-					uploadBuffers.noMoreReads = false;
-					uploadBuffers.starved = false;
-					dataOpInProgress = false;
-					uploadBuffers.expectedUploadSize = -1;
-					uploadBuffers.processedUploadSize = -1;
-					closeDataSocket();
-					if (fileToSend.is_open())
-						fileToSend.close();
-					std::cout << "Disk write: write buffers empty: network wont read more data: closing socket and file" << std::endl;
-
-					asio::write(getSocket(), asio::buffer(StatusStrings::transfer_complete, sizeof(StatusStrings::transfer_complete) - 1), asio::transfer_all());
-					socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()), std::bind(&TinyFTPSession::handleReadControl, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-					std::cout << "Control channel: resuming" << std::endl;
-				}
-			}
-			else
+	void TinyFTPSession::handleTuningTimer(const asio::error_code& e)
+	{
+		if (e || !socketData.get())
+			return;
+		dataSocketTuner.update(socketData->lowest_layer());
+		tuningTimer.expires_after(std::chrono::milliseconds(TinyFTPBufferTuner::TUNING_INTERVAL_MS));
+		tuningTimer.async_wait(asio::bind_allocator(handlerAllocator(), std::bind(&TinyFTPSession::handleTuningTimer, shared_from_this(), std::placeholders::_1)));
+	}
+
+	void TinyFTPSession::startControlTls()
+	{
+		dataOpInProgress = true;
+		asio::co_spawn(service, controlHandshake(shared_from_this()), asio::detached);
+	}
+
+	// the control loop waits for the handshake like for a transfer, nothing is read from the client meanwhile
+	asio::awaitable<void> TinyFTPSession::controlHandshake(TinyFTPSessionPtr self)
+	{
+		asio::error_code e;
+		timingWheel.schedule(handshakeTimeout, services.config.idleTimeout);
+		co_await socket.async_handshake(*services.tlsContext, sessionToken(e));
+		timingWheel.cancel(handshakeTimeout);
+		if (e)
+		{
+			// the read that follows fails and ends the session
+			std::cout << "Control channel: TLS handshake failed, closing" << std::endl;
+			asio::error_code ignored_ec;
+			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			socket.lowest_layer().close(ignored_ec);
+		}
+		else
+			std::cout << "Control channel: TLS established" << std::endl;
+		completeDataOp(std::string());
+	}
+
+	// AUTH TLS and then silence, closing the socket ends the handshake
+	void TinyFTPSession::handleHandshakeTimeout()
+	{
+		std::cout << "Control channel: no TLS handshake after " << services.config.idleTimeout << "s" << std::endl;
+		++services.timeoutStats.idleTimeouts;
+		asio::error_code ignored_ec;
+		socket.lowest_layer().close(ignored_ec);
+	}
+
+	// is session in passive mode
+	bool TinyFTPSession::isPassiveMode()
+	{
+		if (pasvAcceptor)
+			return true;
+		return false;
+	}
+
+	void TinyFTPSession::startFileTransfer(std::string filename_)
+	{
+		transfer.reset(new TinyFTPTransfer(service, services.activeTransfers));
+		startStallWatch();
+		if (modeZ)
+		{
+			startCompressedTransfer(filename_);
+			return;
+		}
+
+		uint64_t size = 0;
+		if (services.fileCache.isEnabled() && services.fileCache.lookup(filename_, transfer->content))
+		{
+			std::cout << "Data channel: starting file transfer from small file cache" << std::endl;
+			transfer->bytesTotal.QuadPart = transfer->content->size();
+			asio::co_spawn(service, sendFile(shared_from_this()), asio::detached);
+			return;
+		}
+
+		std::cout << "Data channel: starting file transfer" << std::endl;
+		if (services.fileSystem->openRead(filename_, transfer->file, transfer->content, size))
+		{
+			// this one goes out from disk, the next one from memory
+			if (services.fileCache.isEnabled() && size <= services.fileCache.getMaxFileSize())
+				services.fileCache.fillAsync(services.workerPool, filename_);
+			transfer->bytesTotal.QuadPart = size;
+			asio::co_spawn(service, sendFile(shared_from_this()), asio::detached);
+		}
+		else
+			finishTransfer(false);
+	}
+
+	void TinyFTPSession::startCompressedTransfer(std::string filename_)
+	{
+		std::string cachedFilename;
+		bool storeInCache = false;
+		if (services.compressionCache.lookup(filename_, zEngine, zLevel, cachedFilename, storeInCache))
+		{
+			// somebody already paid for compressing it, plain TransmitFile from here
+			std::cout << "Data channel: starting file transfer from compression cache" << std::endl;
+			asio::error_code ec;
+			transfer->file.assign(::CreateFileA(cachedFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
+			if (transfer->file.is_open())
 			{
-				auto buffersFront = std::move(uploadBuffers.fullBuffers.front());
-				uploadBuffers.curDiskBuffer = buffersFront.second;
-				size_t bytesToWrite = buffersFront.first;
-				uploadBuffers.fullBuffers.pop_front();
-
-				GetFileSizeEx(fileToSend.native_handle(), &fileBytesTotal);
-				uint64_t totalBytes = fileBytesTotal.HighPart;
-				totalBytes = totalBytes << 32;
-				totalBytes += fileBytesTotal.LowPart;
-
-				fileToSend.async_write_some_at(totalBytes, asio::buffer(uploadBuffers.curDiskBuffer->data(), bytesToWrite), std::bind(&TinyFTPSession::handleWriteDisk, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-				std::cout << "Disk write: writing data" << std::endl;
+				GetFileSizeEx(transfer->file.native_handle(), &transfer->bytesTotal);
+				asio::co_spawn(service, sendFile(shared_from_this()), asio::detached);
+				return;
 			}
 		}
-		else
+
+		std::cout << "Data channel: starting compressed file transfer" << std::endl;
+		std::shared_ptr<TinyFTPSession> self = shared_from_this();
+		transfer->compressedSender = std::make_shared<TinyFTPCompressedSender>(service, services.workerPool, socketData, zEngine, zLevel,
+			[self](bool ok) { self->finishTransfer(ok); });
+		if (!transfer->compressedSender->start(filename_, storeInCache ? &services.compressionCache : 0, cachedFilename))
 		{
-			std::cout << "Disk write: error: closing both sockets and file" << std::endl;
-			// Initiate graceful TinyFTPSession closure.
-			asio::error_code ignored_ec;
-			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (socketData.get())
-				socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (fileToSend.is_open())
-				fileToSend.close();
-			fileBytesTotal.QuadPart = 0;
-			fileBytesSent = 0;
+			// complete with nothing sent, reply goes out once the handler is done with this request
+			transfer->compressedSender.reset();
+			asio::post(service, std::bind(&TinyFTPSession::finishTransfer, shared_from_this(), false));
 		}
 	}
 
-	void TinyFTPSession::handleWriteControl(const asio::error_code& e)
+	// plaintext goes out with TransmitFile, straight from the system cache to the NIC; TLS records have to be built in user space
+	asio::awaitable<void> TinyFTPSession::sendFile(TinyFTPSessionPtr self)
 	{
-		if (!e)
+		asio::error_code e;
+		uint64_t totalBytes = transfer->bytesTotal.QuadPart;
+		transfer->bytesSent = 0;
+		if (modeB)
+		{
+			finishTransfer(co_await sendFileBlocks());
+			co_return;
+		}
+		if (transfer->content)
 		{
-			std::cout << "Control channel: write complete" << std::endl;
-			if (!dataOpInProgress)
+			// already in memory, one write whatever the protection
+			co_await asio::async_write(*socketData, asio::buffer(*transfer->content), sessionToken(e));
+			transfer->bytesSent = transfer->content->size();
+		}
+		else if (socketData->isTls())
+		{
+			std::cout << "Data channel: starting encrypted file transfer" << std::endl;
+			std::vector<char>& encryptedChunk = transfer->encryptedChunk;
+			encryptedChunk.resize(ENCRYPTED_CHUNK_SIZE);
+			while (!e && transfer->bytesSent < totalBytes)
 			{
-				socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()),
-					std::bind(&TinyFTPSession::handleReadControl, shared_from_this(),
-						std::placeholders::_1,
-						std::placeholders::_2));
-				std::cout << "Control channel: resuming" << std::endl;
+				std::size_t bytesRead = co_await transfer->file.async_read_some_at(transfer->bytesSent, asio::buffer(encryptedChunk), sessionToken(e));
+				if (!e)
+					co_await asio::async_write(*socketData, asio::buffer(encryptedChunk.data(), bytesRead), sessionToken(e));
+				transfer->bytesSent += bytesRead;
 			}
 		}
 		else
 		{
-			std::cout << "Control channel: write error, closing both sockets and file" << std::endl;
-			// Initiate graceful TinyFTPSession closure.
-			asio::error_code ignored_ec;
-			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (socketData.get())
-				socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (fileToSend.is_open())
-				fileToSend.close();
-			fileBytesTotal.QuadPart = 0;
-			fileBytesSent = 0;
+			// one TransmitFile call sends at most TRANSMIT_FILE_LIMIT
+			do
+			{
+				co_await async_transmit_file(socketData->lowest_layer(), transfer->file, transfer->bytesSent, transfer->bytesTotal, 0, sessionToken(e));
+				transfer->bytesSent += TRANSMIT_FILE_LIMIT;
+			} while (!e && transfer->bytesSent < totalBytes);
 		}
+		finishTransfer(!e);
 	}
 
-	void TinyFTPSession::handleWriteData(const asio::error_code& e)
+	// MODE B download, in batches of blocks. Plaintext from disk is one TransmitPackets call per batch that
+	// interleaves the 3 byte headers with file ranges, so the data still never passes through user space.
+	asio::awaitable<bool> TinyFTPSession::sendFileBlocks()
 	{
-		if (!e)
+		asio::error_code e;
+		uint64_t totalBytes = transfer->bytesTotal.QuadPart;
+		uint64_t blocks = blockCount(totalBytes);
+		std::vector<unsigned char>& headers = transfer->blockHeaders;
+		headers.resize(BLOCKS_PER_SEND * BLOCK_HEADER_SIZE);
+		// sized once for a full batch, the batches reuse them
+		transfer->blockBuffers.reserve(BLOCKS_PER_SEND * 2);
+		transfer->packets.reserve(BLOCKS_PER_SEND * 2);
+		bool tls = socketData->isTls();
+		if (tls && !transfer->content)
+			transfer->encryptedChunk.resize(BLOCK_DATA_SIZE);
+
+		for (uint64_t firstBlock = 0; !e && firstBlock < blocks; firstBlock += BLOCKS_PER_SEND)
 		{
-			std::cout << "Data channel: write complete" << std::endl;
-			bool expectedState = true;
-			if (dataOpInProgress.compare_exchange_strong(expectedState, false) == true)
+			size_t batch = (size_t)std::min<uint64_t>(BLOCKS_PER_SEND, blocks - firstBlock);
+			for (size_t i = 0; i < batch; ++i)
+				setBlockHeader(&headers[i * BLOCK_HEADER_SIZE], totalBytes, firstBlock + i);
+
+			if (transfer->content)
 			{
-				uint64_t fileBytesTotalBytes = fileBytesTotal.HighPart;
-				fileBytesTotalBytes = fileBytesTotalBytes << 32;
-				fileBytesTotalBytes += fileBytesTotal.LowPart;
-				if (fileBytesTotalBytes - fileBytesSent <= TRANSMIT_FILE_LIMIT)
+				std::vector<asio::const_buffer>& buffers = transfer->blockBuffers;
+				buffers.clear();
+				for (size_t i = 0; i < batch; ++i)
 				{
-					std::cout << "Data channel: write complete: file sent" << std::endl;
-					fileBytesTotal.QuadPart = 0;
-					fileBytesSent = 0;
-					closeDataSocket();
-					if (fileToSend.is_open())
-						fileToSend.close();
-
-					asio::write(getSocket(), asio::buffer(StatusStrings::transfer_complete, sizeof(StatusStrings::transfer_complete) - 1), asio::transfer_all());
-					socket.async_read_some(asio::buffer(buffer.data(), buffer.max_size()), std::bind(&TinyFTPSession::handleReadControl, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-					std::cout << "Control channel: resuming" << std::endl;
+					buffers.push_back(asio::buffer(&headers[i * BLOCK_HEADER_SIZE], BLOCK_HEADER_SIZE));
+					buffers.push_back(asio::buffer(transfer->content->data() + (firstBlock + i) * BLOCK_DATA_SIZE, blockLength(&headers[i * BLOCK_HEADER_SIZE])));
 				}
-				else
+				co_await asio::async_write(*socketData, buffers, sessionToken(e));
+			}
+			else if (tls)
+			{
+				std::vector<char>& encryptedChunk = transfer->encryptedChunk;
+				for (size_t i = 0; !e && i < batch; ++i)
 				{
-					std::cout << "Data channel: write complete: sending next chunk" << std::endl;
-					dataOpInProgress = true; // race! race here!
-					fileBytesSent += TRANSMIT_FILE_LIMIT;
-					transmit_file(*socketData, fileToSend, std::bind(&TinyFTPSession::handleWriteData, shared_from_this(), std::placeholders::_1), fileBytesSent, fileBytesTotal);
+					size_t length = blockLength(&headers[i * BLOCK_HEADER_SIZE]);
+					if (length)
+						co_await asio::async_read_at(transfer->file, (firstBlock + i) * BLOCK_DATA_SIZE, asio::buffer(encryptedChunk.data(), length), sessionToken(e));
+					std::array<asio::const_buffer, 2> buffers = { asio::buffer(&headers[i * BLOCK_HEADER_SIZE], BLOCK_HEADER_SIZE), asio::buffer(encryptedChunk.data(), length) };
+					if (!e)
+						co_await asio::async_write(*socketData, buffers, sessionToken(e));
 				}
 			}
 			else
-				abort();
+			{
+				std::vector<TRANSMIT_PACKETS_ELEMENT>& packets = transfer->packets;
+				packets.clear();
+				for (size_t i = 0; i < batch; ++i)
+				{
+					TRANSMIT_PACKETS_ELEMENT header = {};
+					header.dwElFlags = TP_ELEMENT_MEMORY;
+					header.cLength = BLOCK_HEADER_SIZE;
+					header.pBuffer = &headers[i * BLOCK_HEADER_SIZE];
+					packets.push_back(header);
+					TRANSMIT_PACKETS_ELEMENT data = {};
+					data.dwElFlags = TP_ELEMENT_FILE;
+					data.cLength = (ULONG)blockLength(&headers[i * BLOCK_HEADER_SIZE]);
+					data.nFileOffset.QuadPart = (firstBlock + i) * BLOCK_DATA_SIZE;
+					data.hFile = transfer->file.native_handle();
+					// a zero length file element would mean "to the end of the file"
+					if (data.cLength)
+						packets.push_back(data);
+				}
+				co_await async_transmit_packets(socketData->lowest_layer(), packets.data(), (DWORD)packets.size(), sessionToken(e));
+			}
+			transfer->bytesSent = std::min<uint64_t>(totalBytes, (firstBlock + batch) * BLOCK_DATA_SIZE);
 		}
-		else
+		co_return !e;
+	}
+
+	void TinyFTPSession::startArchiveTransfer(std::vector<TinyFTPArchiveMember> members)
+	{
+		transfer.reset(new TinyFTPTransfer(service, services.activeTransfers));
+		transfer->archiveMembers = std::move(members);
+		startStallWatch();
+		std::cout << "Data channel: starting archive transfer of " << transfer->archiveMembers.size() << " entries" << std::endl;
+		asio::co_spawn(service, sendArchive(shared_from_this()), asio::detached);
+	}
+
+	// SITE MGET, every member goes out as its tar header, its data and the padding to the next block.
+	// Plaintext members on disk take a single TransmitFile with the header and padding as head and tail buffers.
+	asio::awaitable<void> TinyFTPSession::sendArchive(TinyFTPSessionPtr self)
+	{
+		static const char zeroBlocks[TAR_BLOCK_SIZE * 2] = {};
+		asio::error_code e;
+		std::string& header = transfer->archiveHeader;
+		transfer->bytesSent = 0;
+		std::shared_ptr<TinyFTPArchiveOpener> opener = std::make_shared<TinyFTPArchiveOpener>(service);
+		for (size_t i = 0; !e && i < transfer->archiveMembers.size(); ++i)
 		{
-			std::cout << "Data channel: write error: closing both sockets and file" << std::endl;
-			// Initiate graceful TinyFTPSession closure.
-			asio::error_code ignored_ec;
-			socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (socketData.get())
-				socketData->shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
-			if (fileToSend.is_open())
-				fileToSend.close();
-			fileBytesTotal.QuadPart = 0;
-			fileBytesSent = 0;
+			const TinyFTPArchiveMember& member = transfer->archiveMembers[i];
+			header.clear();
+			if (member.isDirectory)
+			{
+				appendTarHeader(member, 0, header);
+				co_await asio::async_write(*socketData, asio::buffer(header), sessionToken(e));
+				transfer->bytesSent += header.size();
+				continue;
+			}
+
+			// the next batch is asked for while half of this one is left, it is usually open before it is needed
+			if (!opener->opening && opener->opened.size() <= TinyFTPArchiveOpener::OPEN_AHEAD / 2 && opener->nextMember < transfer->archiveMembers.size())
+				openArchiveMembers(opener);
+			while (opener->opened.empty())
+			{
+				asio::error_code ignored_ec;
+				opener->ready.expires_at(asio::steady_timer::time_point::max());
+				co_await opener->ready.async_wait(sessionToken(ignored_ec));
+			}
+			std::unique_ptr<TinyFTPOpenedMember> opened = std::move(opener->opened.front());
+			opener->opened.pop_front();
+			if (!opened->ok)
+			{
+				std::cout << "Data channel: archive skips " << member.path << ", can't open it" << std::endl;
+				continue;
+			}
+			// the header carries the size the file has now, not when it was listed
+			uint64_t size = opened->size;
+			transfer->content = std::move(opened->content);
+			if (!transfer->content)
+			{
+				transfer->file = std::move(opened->file);
+				if (services.fileCache.isEnabled() && size <= services.fileCache.getMaxFileSize())
+					services.fileCache.fillAsync(services.workerPool, member.path);
+			}
+			appendTarHeader(member, size, header);
+			size_t padding = tarPadding(size);
+
+			if (transfer->content || !size)
+			{
+				std::array<asio::const_buffer, 3> buffers = { asio::buffer(header),
+					transfer->content ? asio::buffer(*transfer->content) : asio::const_buffer(), asio::buffer(zeroBlocks, padding) };
+				co_await asio::async_write(*socketData, buffers, sessionToken(e));
+				transfer->bytesSent += size;
+			}
+			else if (socketData->isTls())
+			{
+				co_await asio::async_write(*socketData, asio::buffer(header), sessionToken(e));
+				std::vector<char>& encryptedChunk = transfer->encryptedChunk;
+				encryptedChunk.resize(ENCRYPTED_CHUNK_SIZE);
+				for (uint64_t offset = 0; !e && offset < size; )
+				{
+					std::size_t bytesToRead = (std::size_t)std::min<uint64_t>(encryptedChunk.size(), size - offset);
+					std::size_t bytesRead = co_await transfer->file.async_read_some_at(offset, asio::buffer(encryptedChunk.data(), bytesToRead), sessionToken(e));
+					if (!e)
+						co_await asio::async_write(*socketData, asio::buffer(encryptedChunk.data(), bytesRead), sessionToken(e));
+					offset += bytesRead;
+					transfer->bytesSent += bytesRead;
+				}
+				if (!e)
+					co_await asio::async_write(*socketData, asio::buffer(zeroBlocks, padding), sessionToken(e));
+			}
+			else
+			{
+				// header rides on the first call, padding on the last
+				TRANSMIT_FILE_BUFFERS& buffers = transfer->transmitBuffers;
+				LARGE_INTEGER total;
+				total.QuadPart = size;
+				uint64_t offset = 0;
+				do
+				{
+					buffers.Head = offset ? 0 : &header[0];
+					buffers.HeadLength = offset ? 0 : (DWORD)header.size();
+					buffers.Tail = size - offset <= TRANSMIT_FILE_LIMIT ? const_cast<char*>(zeroBlocks) : 0;
+					buffers.TailLength = size - offset <= TRANSMIT_FILE_LIMIT ? (DWORD)padding : 0;
+					co_await async_transmit_file(socketData->lowest_layer(), transfer->file, offset, total, &buffers, sessionToken(e));
+					offset += TRANSMIT_FILE_LIMIT;
+				} while (!e && offset < size);
+				transfer->bytesSent += size;
+			}
+			transfer->bytesSent += header.size() + padding;
+			if (transfer->file.is_open())
+				transfer->file.close();
 		}
+		// end of archive
+		if (!e)
+			co_await asio::async_write(*socketData, asio::buffer(zeroBlocks, sizeof(zeroBlocks)), sessionToken(e));
+		finishTransfer(!e);
 	}
 
-	// sets pasv port to use for this connection
-	void TinyFTPSession::setPasvPort(int port)
+	void TinyFTPSession::openArchiveMembers(std::shared_ptr<TinyFTPArchiveOpener> opener)
 	{
-		std::cout << "Pasv port opened " << port << std::endl;
-		pasvPort = port;
-		tcpAcceptor.reset(new asio::ip::tcp::acceptor(service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), pasvPort)));
-	}
-
-	// starts data socket up in remote mode
-	void TinyFTPSession::startDataSocketRemote()
-	{
-		std::cout << "Data channel: starting in standard mode" << std::endl;
-		unsigned long addr;
-		unsigned short port;
-
-		char* b = (char*)portString.c_str(), * e = b;
-		while (*e != ',') ++e;
-		addr = atous(b, e);
-		b = e + 1;
-		e = b;
-		while (*e != ',') ++e;
-		addr = addr * 256 + atous(b, e);
-		b = e + 1;
-		e = b;
-		while (*e != ',') ++e;
-		addr = addr * 256 + atous(b, e);
-		b = e + 1;
-		e = b;
-		while (*e != ',') ++e;
-		addr = addr * 256 + atous(b, e);
-		b = e + 1;
-		e = b;
-		while (*e != ',') ++e;
-		port = atous(b, e);
-		b = e + 1;
-		e = b;
-		while (*e != 0) ++e;
-		port = port * 256 + atous(b, e);
-
-		socketData.reset(new asio::ip::tcp::socket(service));
-		asio::ip::tcp::endpoint remoteEndpoint(asio::ip::address(asio::ip::address_v4(addr)), port);
-		socketData->connect(remoteEndpoint);
-		socketData->set_option(asio::ip::tcp::no_delay(false));
-		dataSocketConnected = true;
-		std::cout << "Data channel: started" << std::endl;
+		std::vector<std::string> paths;
+		const std::vector<TinyFTPArchiveMember>& members = transfer->archiveMembers;
+		size_t next = opener->nextMember;
+		for (; next < members.size() && paths.size() < TinyFTPArchiveOpener::OPEN_AHEAD; ++next)
+			if (!members[next].isDirectory)
+				paths.push_back(members[next].path);
+		opener->nextMember = next;
+		opener->opening = true;
+
+		asio::io_context& io = service;
+		TinyFTPFileSystem& fileSystem = *services.fileSystem;
+		TinyFTPFileCache& fileCache = services.fileCache;
+		services.blockingPool.post(BLOCKING_OPEN, [opener, paths, &io, &fileSystem, &fileCache]()
+		{
+			std::shared_ptr<std::vector<std::unique_ptr<TinyFTPOpenedMember>>> batch = std::make_shared<std::vector<std::unique_ptr<TinyFTPOpenedMember>>>();
+			for (const std::string& path : paths)
+			{
+				std::unique_ptr<TinyFTPOpenedMember> member(new TinyFTPOpenedMember(io));
+				bool cached = fileCache.isEnabled() && fileCache.lookup(path, member->content);
+				member->ok = cached || fileSystem.openRead(path, member->file, member->content, member->size);
+				if (member->content)
+					member->size = member->content->size();
+				batch->push_back(std::move(member));
+			}
+			// a transfer that ended meanwhile left the opener to this batch, the handles close with it
+			asio::post(io, [opener, batch]()
+			{
+				for (std::unique_ptr<TinyFTPOpenedMember>& member : *batch)
+					opener->opened.push_back(std::move(member));
+				opener->opening = false;
+				opener->ready.cancel();
+			});
+		});
 	}
 
-	// starts data socket up in pasv mode
-	void TinyFTPSession::startDataSocketPasv()
+	void TinyFTPSession::startTreeTransfer(const std::string& directory, const std::string& displayName, bool longFormat)
 	{
-		std::cout << "Data channel: starting in pasv mode" << std::endl;
-		socketData.reset(new asio::ip::tcp::socket(service));
-		tcpAcceptor->accept(*socketData);
-		socketData->set_option(asio::ip::tcp::no_delay(false));
-		dataSocketConnected = true;
-		std::cout << "Data channel: started" << std::endl;
+		transfer.reset(new TinyFTPTransfer(service, services.activeTransfers));
+		startStallWatch();
+		std::cout << "Data channel: starting recursive listing of " << directory << std::endl;
+		transfer->treeListing = std::make_shared<TinyFTPTreeListing>(*services.fileSystem, services.workerPool, services.config.treeScanners, longFormat);
+		if (modeZ)
+			transfer->treeCompressor.reset(new TinyFTPCompressor(zEngine, zLevel));
+		// scanners run on the pool, wake the sender on our io thread
+		std::weak_ptr<TinyFTPSession> weakSelf = shared_from_this();
+		asio::io_context& io = service;
+		transfer->treeListing->start(directory, displayName, [weakSelf, &io]()
+		{
+			asio::post(io, [weakSelf]()
+			{
+				TinyFTPSessionPtr session = weakSelf.lock();
+				if (session && session->transfer)
+					session->transfer->treeReady.cancel();
+			});
+		});
+		asio::co_spawn(service, sendTree(shared_from_this()), asio::detached);
 	}
 
-	// close data socket
-	void TinyFTPSession::closeDataSocket()
+	// LIST -R / SITE TREE, every piece of the listing goes out as soon as everything before it is there
+	asio::awaitable<void> TinyFTPSession::sendTree(TinyFTPSessionPtr self)
 	{
-		std::cout << "Data channel: closing socket" << std::endl;
-		socketData->close();
-		socketData.reset();
-		if (tcpAcceptor.get())
+		asio::error_code e;
+		std::string& output = transfer->treeOutput;
+		bool done = false;
+		while (!e && !done)
+		{
+			size_t before = output.size();
+			done = transfer->treeListing->take(output);
+			if (!done && output.size() == before)
+			{
+				asio::error_code ignored_ec;
+				transfer->treeReady.expires_at(asio::steady_timer::time_point::max());
+				co_await transfer->treeReady.async_wait(sessionToken(ignored_ec));
+				continue;
+			}
+			// MODE Z compresses each piece into the one stream as it comes, so the text is never held whole
+			if (modeZ)
+			{
+				std::vector<char>& compressed = transfer->treeCompressed;
+				compressed.clear();
+				bool ok = transfer->treeCompressor->compress(output.data(), output.size(), done, compressed);
+				output.clear();
+				if (!ok)
+				{
+					std::cout << "Data channel: tree listing: compress failed" << std::endl;
+					e = asio::error::operation_aborted;
+					break;
+				}
+				if (!compressed.empty())
+				{
+					co_await asio::async_write(*socketData, asio::buffer(compressed), sessionToken(e));
+					transfer->bytesSent += compressed.size();
+				}
+				continue;
+			}
+			if (modeB)
+			{
+				std::string& blocks = transfer->blockOutput;
+				blocks.clear();
+				appendBlocks(output.data(), output.size(), blocks, done);
+				output.swap(blocks);
+			}
+			co_await asio::async_write(*socketData, asio::buffer(output), sessionToken(e));
+			transfer->bytesSent += output.size();
+			output.clear();
+		}
+		finishTransfer(!e);
+	}
+
+	void TinyFTPSession::startListingTransfer(const std::string& listing)
+	{
+		transfer.reset(new TinyFTPTransfer(service, services.activeTransfers));
+		startStallWatch();
+		transfer->listing = listing;
+		asio::co_spawn(service, sendListing(shared_from_this()), asio::detached);
+	}
+
+	// LIST/NLST, one write of the whole listing
+	asio::awaitable<void> TinyFTPSession::sendListing(TinyFTPSessionPtr self)
+	{
+		asio::error_code e;
+		std::string& output = transfer->listing;
+		if (modeZ)
 		{
-			tcpAcceptor->cancel();
-			tcpAcceptor->close();
-			tcpAcceptor.reset();
+			std::string compressed;
+			if (compressForTransfer(output, compressed))
+				output.swap(compressed);
 		}
-		if (pasvPort != -1)
+		else if (modeB)
 		{
-			requestHandler->releasePassivePort(pasvPort);
-			pasvPort = -1;
+			std::string blocks;
+			appendBlocks(output.data(), output.size(), blocks);
+			output.swap(blocks);
 		}
+		if (!output.empty())
+		{
+			co_await asio::async_write(*socketData, asio::buffer(output), sessionToken(e));
+			transfer->bytesSent += output.size();
+		}
+		finishTransfer(!e);
 	}
 
-	// is session in passive mode
-	bool TinyFTPSession::isPassiveMode()
+	void TinyFTPSession::runBlocking(TinyFTPBlockingOp op, std::function<std::string()> work, BlockingDone done)
 	{
-		if (pasvPort != -1)
-			return true;
-		return false;
+		dataOpInProgress = true;
+		// the session may be gone by the time the call returns, the reply then goes nowhere
+		std::weak_ptr<TinyFTPSession> weakSelf = shared_from_this();
+		asio::io_context& io = service;
+		services.blockingPool.post(op, [weakSelf, &io, work, done]()
+		{
+			std::string result = work();
+			asio::post(io, [weakSelf, result, done]()
+			{
+				TinyFTPSessionPtr session = weakSelf.lock();
+				if (!session)
+					return;
+				if (!done)
+				{
+					session->completeDataOp(result);
+					return;
+				}
+				std::string reply = done(*session, result);
+				if (!reply.empty())
+					session->completeDataOp(reply);
+			});
+		});
 	}
 
-	void TinyFTPSession::startFileTransfer(std::string filename_)
+	// end of a RETR, however it was sent
+	void TinyFTPSession::finishTransfer(bool ok)
 	{
-		std::cout << "Data channel: starting file transfer" << std::endl;
-		asio::error_code ec;
-		fileToSend.assign(::CreateFileA(filename_.c_str(), GENERIC_READ, 0, 0,
-			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
-		GetFileSizeEx(fileToSend.native_handle(), &fileBytesTotal);
-		if (fileToSend.is_open())
+		finishDataConnection(ok);
+		// the MODE Z sender may be the caller, it holds on to itself until its callback returns
+		transfer.reset();
+		timingWheel.cancel(stallTimeout);
+		std::cout << "Data channel: transfer " << (ok ? "complete" : "failed") << std::endl;
+		completeDataOp(ok ? StatusStrings::transfer_complete : StatusStrings::transfer_aborted);
+	}
+
+	void TinyFTPSession::sendDeferredReply(std::string content)
+	{
+		std::shared_ptr<TinyFTPSession> self = shared_from_this();
+		asio::post(service, [self, content]()
 		{
-			transmit_file(*socketData, fileToSend, std::bind(&TinyFTPSession::handleWriteData, shared_from_this(), std::placeholders::_1), 0, fileBytesTotal);
-		}
+			self->completeDataOp(content);
+		});
+	}
+
+	void TinyFTPSession::sendProgressLine(std::string content)
+	{
+		std::shared_ptr<TinyFTPSession> self = shared_from_this();
+		asio::post(service, [self, content]()
+		{
+			// the request may have finished meanwhile
+			if (!self->dataOpInProgress || self->progressWriting)
+				return;
+			self->progressWriting = true;
+			self->progressLine = content;
+			asio::async_write(self->socket, asio::buffer(self->progressLine.data(), self->progressLine.size()),
+				asio::bind_allocator(self->handlerAllocator(), [self](const asio::error_code&, std::size_t)
+			{
+				self->progressWriting = false;
+				// let the control loop write the final reply if it was waiting on this line
+				self->dataOpDone.cancel();
+			}));
+		});
+	}
+
+	void TinyFTPSession::setModeZ(bool enabled)
+	{
+		modeZ = enabled;
+	}
+
+	// leaving MODE B, a kept connection carries no EOF markers any more
+	void TinyFTPSession::setModeB(bool enabled)
+	{
+		if (modeB && !enabled)
+			closeDataSocket();
+		modeB = enabled;
+	}
+
+	void TinyFTPSession::setModeZOptions(TinyFTPCompressionEngine engine, int level)
+	{
+		zEngine = engine;
+		zLevel = level;
+	}
+
+	bool TinyFTPSession::compressForTransfer(const std::string& in, std::string& out)
+	{
+		return TinyFTPCompressor::compressAll(zEngine, zLevel, in, out);
 	}
 
 	void TinyFTPSession::startFileUpload(std::string filename_)
 	{
 		std::cout << "Data channel: starting file upload" << std::endl;
-		if (fileToSend.is_open())
-			fileToSend.close();
-		fileBytesTotal.QuadPart = 0;
-		fileBytesSent = 0;
+		transfer.reset(new TinyFTPTransfer(service, services.activeTransfers));
+		startStallWatch();
+		TinyFTPUploadBuffers& uploadBuffers = transfer->uploadBuffers;
+		uploadBuffers.expectedUploadSize = alloSize;
+		alloSize = -1;
 
 		if (filename_.find("\\.\\") != std::string::npos)
 			filename_.replace(filename_.find("\\.\\"), strlen("\\.\\"), "\\");
-		asio::error_code ec;
-		fileToSend.assign(::CreateFileA(filename_.c_str(), GENERIC_WRITE, 0, 0,
-			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
-		if (fileToSend.is_open())
+		bool unbuffered = unbufferedUploads;
+		transfer->uploadFilename = filename_;
+		if (services.fileSystem->openWrite(filename_, UNBUFFERED_ALIGNMENT, unbuffered, transfer->file, transfer->uploadContent))
 		{
-			std::lock_guard<std::mutex> buffersGuard(uploadBuffers.queueMutex);
+			uploadBuffers.init();
 
-			if (!uploadBuffers.isInitialized)
-				uploadBuffers.init();
+			if (uploadBuffers.expectedUploadSize > 0)
+			{
+				// ALLO told us the size, reserve it so the file doesn't get extended piece by piece
+				if (transfer->uploadContent)
+					transfer->uploadContent->reserve((size_t)uploadBuffers.expectedUploadSize);
+				else
+				{
+					FILE_ALLOCATION_INFO allocationInfo;
+					allocationInfo.AllocationSize.QuadPart = uploadBuffers.expectedUploadSize;
+					SetFileInformationByHandle(transfer->file.native_handle(), FileAllocationInfo, &allocationInfo, sizeof(allocationInfo));
+				}
+			}
+
+			// the digest lives in an alternate data stream of the file
+			if (services.config.uploadDigest && services.fileSystem->isLocal())
+				transfer->uploadHasher.reset(new TinyFTPHasher((TinyFTPHashAlgorithm)services.config.uploadDigestAlgorithm));
 
-			auto buffersFront = std::move(uploadBuffers.emptyBuffers.front());
-			uploadBuffers.curNetworkBuffer = buffersFront.second;
-			uploadBuffers.emptyBuffers.pop_front();
-			uploadBuffers.noMoreReads = false;
-			uploadBuffers.processedUploadSize = -1;
+			uploadBuffers.unbuffered = unbuffered;
+			uploadBuffers.diskAlignment = UNBUFFERED_ALIGNMENT;
+			uploadBuffers.diskWriteOffset = 0;
+			uploadBuffers.processedUploadSize = 0;
 
-			socketData->async_read_some(asio::buffer(uploadBuffers.curNetworkBuffer->data(), uploadBuffers.curNetworkBuffer->max_size()), std::bind(&TinyFTPSession::handleReadData, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+			asio::co_spawn(service, receiveUpload(shared_from_this()), asio::detached);
 		}
+		else
+		{
+			uploadBuffers.unbuffered = false;
+			finishUpload(false);
+		}
+	}
+
+	void TinyFTPSession::setActiveEndpoint(const asio::ip::tcp::endpoint& endpoint)
+	{
+		closeDataSocket();
+		activeEndpoint = endpoint;
 	}
 
-	std::string TinyFTPSession::getPortString()
+	TinyFTPTransfer::TinyFTPTransfer(asio::io_context& io_context, std::atomic<unsigned int>& in_activeTransfers) : file(io_context), bytesSent(0), blockRemaining(0), blockEof(false), blockIsMarker(false), treeReady(io_context), activeTransfers(in_activeTransfers)
 	{
-		return portString;
+		bytesTotal.QuadPart = 0;
+		++activeTransfers;
 	}
 
-	void TinyFTPSession::setPortString(std::string newPortString)
+	TinyFTPTransfer::~TinyFTPTransfer()
 	{
-		portString = newPortString;
+		--activeTransfers;
+		if (treeListing)
+			treeListing->cancel();
+		if (file.is_open())
+			file.close();
 	}
 
-	TinyFTPUploadBuffers::TinyFTPUploadBuffers() : isInitialized(false), starved(false), writeInProgress(false), noMoreReads(false)
+	TinyFTPUploadBuffers::TinyFTPUploadBuffers() : isInitialized(false), unbuffered(false), diskAlignment(1), diskWriteOffset(0), buffers()
 	{
 		std::cout << "Upload buffers created" << std::endl;
 	}
 
 	TinyFTPUploadBuffers::~TinyFTPUploadBuffers()
 	{
-		while (!emptyBuffers.empty())
-		{
-			std::pair<size_t, std::array<char, RECV_BUFFER_SIZE>* > pBuffer = emptyBuffers.front();
-			emptyBuffers.pop_front();
-			delete pBuffer.second;
-		}
-		while (!fullBuffers.empty())
-		{
-			std::pair<size_t, std::array<char, RECV_BUFFER_SIZE>*> pBuffer = fullBuffers.front();
-			fullBuffers.pop_front();
-			delete pBuffer.second;
-		}
+		for (TinyFTPUploadBuffer* pBuffer : buffers)
+			freeBuffer(pBuffer);
 		std::cout << "Upload buffers destroyed" << std::endl;
 	}
 
 	void TinyFTPUploadBuffers::init()
 	{
-		// 3 buffers 1 reading 1 writing 1 ready for next read
-		emptyBuffers.emplace_front(0, new std::array<char, RECV_BUFFER_SIZE>());
-		emptyBuffers.emplace_front(0, new std::array<char, RECV_BUFFER_SIZE>());
-		emptyBuffers.emplace_front(0, new std::array<char, RECV_BUFFER_SIZE>());
+		for (TinyFTPUploadBuffer*& pBuffer : buffers)
+			pBuffer = allocateBuffer();
 		isInitialized = true;
 		std::cout << "Upload buffers initialized" << std::endl;
 	}
 
-	bool TinyFTPSession::setCurDir(char* szNewCurDir)
+	TinyFTPUploadBuffer* TinyFTPUploadBuffers::allocateBuffer()
 	{
-		bool res = false;
+		// page aligned, good for unbuffered writes on any sector size up to page size
+		void* pMemory = VirtualAlloc(0, RECV_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!pMemory)
+			throw std::bad_alloc();
+		return static_cast<TinyFTPUploadBuffer*>(pMemory);
+	}
 
-		// replace all slashes
-		size_t inputLen = strlen(szNewCurDir);
-		for (size_t pos = 0; pos < inputLen; ++pos)
-			if (szNewCurDir[pos] == '/')
-				szNewCurDir[pos] = '\\';
+	void TinyFTPUploadBuffers::freeBuffer(TinyFTPUploadBuffer* pBuffer)
+	{
+		if (pBuffer)
+			VirtualFree(pBuffer, 0, MEM_RELEASE);
+	}
 
-		// check for first slash (absolute path), combine with root as necessary
-		std::string newCombinedRoot;
-		if (szNewCurDir[0] == '\\')
-			newCombinedRoot = docRoot + szNewCurDir;
-		else
-			newCombinedRoot = docRoot + curDirectory + (curDirectory == "\\" ? "" : "\\") + szNewCurDir;
-		newCombinedRoot = std::regex_replace(newCombinedRoot, std::regex("\\\\[^\\\\]*\\\\\\.\\."), "");
-		newCombinedRoot = std::regex_replace(newCombinedRoot, std::regex("\\\\\\\\"), "\\");
-		while (newCombinedRoot.size() > 1 && *newCombinedRoot.rbegin() == '.')
-			newCombinedRoot = newCombinedRoot.substr(0, newCombinedRoot.size() - 1);
-		while (newCombinedRoot.size() > 1 && *newCombinedRoot.rbegin() == '\\')
-			newCombinedRoot = newCombinedRoot.substr(0, newCombinedRoot.size() - 1);
-
-		strncpy_s(szNewCurDir, TinyFTPSession::MAX_PATH_32K, newCombinedRoot.c_str(), newCombinedRoot.size());
-
-		// try CreateFile for directory, if success - CloseFile and return true otherwise false
-		HANDLE toClose = CreateFileA(szNewCurDir, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
-		if (INVALID_HANDLE_VALUE != toClose)
-		{
-			CloseHandle(toClose);
-			if (GetFileAttributesA(szNewCurDir) & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				res = true;
-				curDirectory = newCombinedRoot.substr(docRoot.size());
-				while (curDirectory.size() > 1 && *curDirectory.rbegin() == '\\')
-					curDirectory = curDirectory.substr(0, curDirectory.size() - 1);
-			}
-		}
+	std::string TinyFTPSession::resolveDirectory(char* szNewCurDir)
+	{
+		return resolveDirectoryPath(docRoot, curDirectory, szNewCurDir);
+	}
 
-		return res;
+	void TinyFTPSession::changeDirectory(const std::string& combined)
+	{
+		curDirectory = combined.substr(docRoot.size());
+		while (curDirectory.size() > 1 && *curDirectory.rbegin() == '\\')
+			curDirectory = curDirectory.substr(0, curDirectory.size() - 1);
 	}
 
 	const char* TinyFTPSession::getCurDir()
@@ -620,34 +1352,7 @@ namespace TinyWinFTP
 
 	char* TinyFTPSession::translatePath(char* pathToTranslate)
 	{
-		// replace all slashes
-		size_t inputLen = strlen(pathToTranslate);
-		if (inputLen)
-		{
-			for (size_t pos = 0; pos < inputLen; ++pos)
-				if (pathToTranslate[pos] == '/')
-				{
-					pathToTranslate[pos] = '\\';
-				}
-		}
-
-		// check for first slash (absolute path), combine with root as necessary
-		std::string newCombinedPath;
-		if (pathToTranslate[0] == '\\')
-			newCombinedPath = docRoot + pathToTranslate;
-		else
-			newCombinedPath = docRoot + curDirectory + "\\" + pathToTranslate;
-
-		while (*newCombinedPath.rbegin() == '\\' && newCombinedPath.size() > 1)
-			newCombinedPath = newCombinedPath.substr(0, newCombinedPath.size() - 1);
-		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\\\[^\\\\]*\\\\\\.\\."), "");
-		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\\\\\\\"), "\\");
-		newCombinedPath = std::regex_replace(newCombinedPath, std::regex("\\.\\\\"), "");
-
-		strncpy_s(pathToTranslate, TinyFTPSession::MAX_PATH_32K, "\\\\?\\", strlen("\\\\?\\"));
-		strncpy_s(pathToTranslate + strlen("\\\\?\\"), TinyFTPSession::MAX_PATH_32K - strlen("\\\\?\\"), newCombinedPath.c_str(), newCombinedPath.size());
-
-		return pathToTranslate;
+		return translateClientPath(docRoot, curDirectory, pathToTranslate, MAX_PATH_32K);
 	}
 
 }
\ No newline at end of file
@@ -4,12 +4,24 @@
 #include <memory>
 #include <array>
 #include <atomic>
+#include <deque>
 #include <mutex>
 
 #include <asio/windows/random_access_handle.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/awaitable.hpp>
 
 #include "TinyFTPRequestParser.h"
 #include "TinyFTPReply.h"
+#include "TinyFTPPassivePortPool.h"
+#include "TinyFTPServices.h"
+#include "TinyFTPSocketTuning.h"
+#include "TinyFTPHandlerAllocator.h"
+#include "TinyFTPUploadPipe.h"
+#include "TinyFTPTimingWheel.h"
+#include "TinyFTPArchive.h"
+#include "TinyFTPBlockMode.h"
+#include "TinyFTPListing.h"
 
 
 namespace TinyWinFTP
@@ -17,8 +29,6 @@ namespace TinyWinFTP
 
 	class TinyFTPRequestHandler;
 
-	static const size_t RECV_BUFFER_SIZE = 256*1024;
-
 	struct TinyFTPUploadBuffers 
 	{
 		TinyFTPUploadBuffers();
@@ -26,24 +36,118 @@ namespace TinyWinFTP
 		void init();
 
 		bool isInitialized;
-		bool starved;
-		bool writeInProgress;
-		bool noMoreReads = false;
-		std::mutex queueMutex;
 		long long int expectedUploadSize = -1;
 		long long int processedUploadSize = -1;
 
-		/// Buffer for incoming commands.
-		std::list< std::pair<size_t, std::array<char, RECV_BUFFER_SIZE> * > > emptyBuffers;
-		std::list< std::pair<size_t, std::array<char, RECV_BUFFER_SIZE> * > > fullBuffers;
+		// file is opened with FILE_FLAG_NO_BUFFERING, writes go out in diskAlignment multiples
+		bool unbuffered;
+		size_t diskAlignment;
+		uint64_t diskWriteOffset;
+
+		std::array<TinyFTPUploadBuffer*, UPLOAD_BUFFER_COUNT> buffers;
 
-		std::array<char, RECV_BUFFER_SIZE> * curNetworkBuffer;
-		std::array<char, RECV_BUFFER_SIZE> * curDiskBuffer;
+		static TinyFTPUploadBuffer * allocateBuffer();
+		static void freeBuffer(TinyFTPUploadBuffer * pBuffer);
 
 		TinyFTPUploadBuffers(const TinyFTPUploadBuffers& other) = delete;
 
 	};
 
+	/// A SITE MGET member file, opened on the blocking pool before the sender gets to it.
+	struct TinyFTPOpenedMember
+	{
+		explicit TinyFTPOpenedMember(asio::io_context& io_context)
+			: file(io_context)
+		{
+		}
+
+		bool ok = false;
+		asio::windows::random_access_handle file;
+		// from the small file cache or the in-memory filesystem, file stays closed then
+		std::shared_ptr<const std::string> content;
+		uint64_t size = 0;
+	};
+
+	/// Opens the files of a SITE MGET in member order, a batch at a time, so the sender never waits on
+	/// CreateFile and a slow share doesn't hold up the io thread. Shared with the batch in flight.
+	struct TinyFTPArchiveOpener
+	{
+		static const size_t OPEN_AHEAD = 64;
+
+		explicit TinyFTPArchiveOpener(asio::io_context& io_context)
+			: ready(io_context)
+		{
+		}
+
+		// io thread only
+		std::deque<std::unique_ptr<TinyFTPOpenedMember>> opened;
+		// first member no batch has been asked for yet
+		size_t nextMember = 0;
+		bool opening = false;
+		// the sender sleeps on it while nothing is open, a finished batch cancels it
+		asio::steady_timer ready;
+	};
+
+	/// State of a running RETR or STOR. Created when the transfer starts and dropped when its reply goes out,
+	/// so the many sessions that sit idle between transfers carry none of it.
+	struct TinyFTPTransfer
+	{
+		// counted in activeTransfers for its whole life, a draining server waits for the count to reach zero
+		TinyFTPTransfer(asio::io_context& io_context, std::atomic<unsigned int>& activeTransfers);
+		~TinyFTPTransfer();
+
+		asio::windows::random_access_handle file;
+		uint64_t bytesSent;
+		LARGE_INTEGER bytesTotal;
+
+		// files of the in-memory filesystem: what RETR sends, what STOR collects
+		std::shared_ptr<const std::string> content;
+		std::shared_ptr<std::string> uploadContent;
+
+		TinyFTPUploadBuffers uploadBuffers;
+
+		// MODE B: headers and TransmitPackets elements of the batch being sent, the block being received
+		std::vector<unsigned char> blockHeaders;
+		std::vector<TRANSMIT_PACKETS_ELEMENT> packets;
+		// MODE B from memory: header and data buffers of one batch
+		std::vector<asio::const_buffer> blockBuffers;
+		size_t blockRemaining;
+		bool blockEof;
+		bool blockIsMarker;
+
+		// PROT P, TLS records are built from this
+		std::vector<char> encryptedChunk;
+
+		// MODE Z
+		std::shared_ptr<TinyFTPCompressedSender> compressedSender;
+
+		// SITE MGET, the entries still to send and the header of the current one
+		std::vector<TinyFTPArchiveMember> archiveMembers;
+		std::string archiveHeader;
+		TRANSMIT_FILE_BUFFERS transmitBuffers;
+
+		// LIST/NLST, read on the blocking pool
+		std::string listing;
+		// MODE B tree listing: the framed copy of the text, swapped with it so both keep their capacity
+		std::string blockOutput;
+
+		// LIST -R: the scanners, the output not sent yet, and the wake up when a directory is done
+		std::shared_ptr<TinyFTPTreeListing> treeListing;
+		std::string treeOutput;
+		// MODE Z: one stream for the whole tree, and what it gave for the last piece
+		std::unique_ptr<TinyFTPCompressor> treeCompressor;
+		std::vector<char> treeCompressed;
+		asio::steady_timer treeReady;
+
+		// digest of the running upload, fed from every buffer written to disk
+		std::unique_ptr<TinyFTPHasher> uploadHasher;
+		std::string uploadFilename;
+
+		std::atomic<unsigned int>& activeTransfers;
+
+		TinyFTPTransfer(const TinyFTPTransfer& other) = delete;
+	};
+
 	/// Represents a single TinyFTPSession from a client.
 	class TinyFTPSession
 		: public std::enable_shared_from_this<TinyFTPSession>
@@ -53,79 +157,213 @@ namespace TinyWinFTP
 		static const size_t MAX_COMMAND_LEN = 384;
 		static const uint64_t TRANSMIT_FILE_LIMIT = 1024*1024*1024;
 		static const size_t MAX_PATH_32K = 32768;
+		static const size_t UNBUFFERED_ALIGNMENT = 4096;
+		static const size_t ENCRYPTED_CHUNK_SIZE = 256 * 1024;
+		// MODE B blocks per TransmitPackets call, about 15 MB
+		static const size_t BLOCKS_PER_SEND = 256;
 
 		/// Construct a TinyFTPSession with the given io_context.
-		TinyFTPSession(asio::io_context& io_context, asio::ip::tcp::socket&& socket, TinyFTPRequestHandler* handler, TinyFTPRequestParser& parser, std::string docRoot);
+		TinyFTPSession(asio::io_context& io_context, asio::ip::tcp::socket&& socket, TinyFTPRequestHandler* handler, TinyFTPRequestParser& parser, TinyFTPPassivePortPoolPtr pasvPortPool, TinyFTPTimingWheel& timingWheel, TinyFTPServices& services);
 
 		/// closes the socket
 		~TinyFTPSession();
 
-		/// Get the control socket associated with the TinyFTPSession.
-		inline asio::ip::tcp::socket& getSocket()
+		/// Get the control connection associated with the TinyFTPSession.
+		inline TinyFTPStream& getSocket()
 		{
 			return socket;
 		}
 
-		/// Get the data socket associated with the TinyFTPSession.
-		inline asio::ip::tcp::socket& getDataSocket()
+		/// Get the data connection associated with the TinyFTPSession.
+		inline TinyFTPStream& getDataSocket()
 		{
 			return *socketData;
 		}
 
-		// sets pasv port to use for this connection
-		void setPasvPort(int port);
-
-		// starts data socket up
-		void startDataSocketRemote();
+		// takes a listening port from the pool for this connection, returns -1 if none is free
+		int openPassivePort();
 
-		// starts data socket up
-		void startDataSocketPasv();
+		// connection for the next transfer: the one MODE B kept open, or a new one in passive or active mode.
+		// Leaves the request pending; onReady continues it once the connection is up, without one within
+		// dataConnectTimeout it ends with 425.
+		typedef std::function<void(TinyFTPSession&)> DataConnectionReady;
+		void startDataSocket(DataConnectionReady onReady);
 
 		// close data socket
 		void closeDataSocket();
+		// after a transfer, keeps the connection in MODE B when it went well
+		void finishDataConnection(bool ok);
 
 		// is session in passive mode
 		bool isPassiveMode();
 
-		// remote address
-		std::string getPortString();
-		void setPortString(std::string newPortString);
+		// remote address for active mode, from PORT or EPRT
+		void setActiveEndpoint(const asio::ip::tcp::endpoint& endpoint);
 
 		/// Start the first asynchronous operation for the TinyFTPSession.
 		void start();
 		void startFileTransfer(std::string filename_);
 		void startFileUpload(std::string filename_);
+		void startArchiveTransfer(std::vector<TinyFTPArchiveMember> members);
+		void startTreeTransfer(const std::string& directory, const std::string& displayName, bool longFormat);
+		void startListingTransfer(const std::string& listing);
+
+		// runs work on the blocking pool and leaves the request pending until it is done. Its result is the reply,
+		// or goes through done on the session's io thread first; an empty reply from done means done started
+		// something that completes the request later.
+		typedef std::function<std::string(TinyFTPSession&, const std::string&)> BlockingDone;
+		void runBlocking(TinyFTPBlockingOp op, std::function<std::string()> work, BlockingDone done = BlockingDone());
+
+		// MODE Z, compressed stream for RETR and listings
+		static const int DEFAULT_DEFLATE_LEVEL = 6;
+		static const int DEFAULT_ZSTD_LEVEL = 3;
+		void setModeZ(bool enabled);
+		bool isModeZ()
+		{
+			return modeZ;
+		}
+		void setModeZOptions(TinyFTPCompressionEngine engine, int level);
+
+		// MODE B, block framed transfers over a data connection that outlives them
+		void setModeB(bool enabled);
+		bool isModeB()
+		{
+			return modeB;
+		}
+		TinyFTPCompressionEngine getModeZEngine()
+		{
+			return zEngine;
+		}
+		int getModeZLevel()
+		{
+			return zLevel;
+		}
+		bool compressForTransfer(const std::string& in, std::string& out);
+
+		// algorithm HASH uses, set with OPTS HASH
+		TinyFTPHashAlgorithm getHashAlgorithm()
+		{
+			return hashAlgorithm;
+		}
+		void setHashAlgorithm(TinyFTPHashAlgorithm algorithm)
+		{
+			hashAlgorithm = algorithm;
+		}
+
+		// SITE SORT / SITE PAGE, for the listings that follow
+		const TinyFTPListOptions& getListOptions()
+		{
+			return listOptions;
+		}
+		void setListOptions(const TinyFTPListOptions& options)
+		{
+			listOptions = options;
+		}
+
+		// AUTH TLS: handshake on the control connection, call after the 234 went out. The request stays pending
+		// until it is done; a failed handshake, or none within idleTimeout, closes the session.
+		void startControlTls();
+		bool isControlTls()
+		{
+			return socket.isTls();
+		}
+		// PROT P/C: data connections get their own handshake
+		void setProtectData(bool enabled)
+		{
+			// a kept MODE B connection was set up for the old level
+			if (enabled != protectData)
+				closeDataSocket();
+			protectData = enabled;
+		}
+
+		// measurements and buffer sizes of the last data connection
+		const TinyFTPTransferStats& getTransferStats()
+		{
+			return dataSocketTuner.getStats();
+		}
+
+		// completes a request the handler left pending (dataOpInProgress set), safe to call from any thread
+		void sendDeferredReply(std::string content);
+		// writes a line of a reply that is still pending, safe to call from any thread;
+		// dropped while the previous line is still on its way, the next one says more anyway
+		void sendProgressLine(std::string content);
 
 		// is data op in progress
 		std::atomic_bool dataOpInProgress;
 
-		bool setCurDir(char * in_szNewCurDir);
+		// RNFR and SITE CPFR source, used up by the RNTO / SITE CPTO that follows
+		std::string renameFrom;
+		std::string copyFrom;
+
+		// CWD: the directory an argument names, and making it current once it is known to exist
+		std::string resolveDirectory(char * in_szNewCurDir);
+		void changeDirectory(const std::string& combined);
 		const char * getCurDir();
 		char * translatePath(char * buffer);
 		void setAlloSize(int size) 
 		{
-			uploadBuffers.expectedUploadSize = size;
+			alloSize = size;
+		}
+		long long getAlloSize()
+		{
+			return alloSize;
 		}
 
 	private:
-		/// Handle completion of a control read operation.
-		void handleReadControl(const asio::error_code& e, std::size_t bytes_transferred);
-
-		/// Handle completion of a data read operation.
-		void handleReadData(const asio::error_code& e, std::size_t bytes_transferred);
-		void handleWriteDisk(const asio::error_code& e, std::size_t bytes_transferred);
-
-		/// Handle completion of a control socket write operation.
-		void handleWriteControl(const asio::error_code& e);
-
-		/// Handle completion of a data socket write operation.
-		void handleWriteData(const asio::error_code& e);
+		// every asynchronous operation of the session takes its state from handlerMemory
+		TinyFTPHandlerAllocator<void> handlerAllocator()
+		{
+			return TinyFTPHandlerAllocator<void>(handlerMemory);
+		}
+		// co_await token: errors land in e instead of throwing
+		auto sessionToken(asio::error_code& e);
+
+		/// Reads commands and writes replies until the client goes away.
+		asio::awaitable<void> controlLoop(std::shared_ptr<TinyFTPSession> self);
+
+		// ends the data operation the control loop waits on, runs on the session's io_context
+		void completeDataOp(std::string finalReply);
+
+		// STOR, the network reader and disk writer TinyFTPUploadPipe passes buffers between
+		asio::awaitable<void> receiveUpload(std::shared_ptr<TinyFTPSession> self);
+		asio::awaitable<std::size_t> readUploadBuffer(TinyFTPUploadBuffer& buffer, asio::error_code& e, bool& last);
+		asio::awaitable<std::size_t> readBlocks(char* data, std::size_t size, asio::error_code& e);
+		asio::awaitable<bool> writeUploadChunk(TinyFTPUploadChunk chunk);
+		void finishUpload(bool ok);
+		void storeUploadDigest(const std::string& filename, const std::string& hexDigest);
+
+		// RETR
+		void startCompressedTransfer(std::string filename_);
+		asio::awaitable<void> sendFile(std::shared_ptr<TinyFTPSession> self);
+		asio::awaitable<bool> sendFileBlocks();
+		asio::awaitable<void> sendArchive(std::shared_ptr<TinyFTPSession> self);
+		void openArchiveMembers(std::shared_ptr<TinyFTPArchiveOpener> opener);
+		asio::awaitable<void> sendTree(std::shared_ptr<TinyFTPSession> self);
+		asio::awaitable<void> sendListing(std::shared_ptr<TinyFTPSession> self);
+		void finishTransfer(bool ok);
+
+		asio::awaitable<void> openDataConnection(std::shared_ptr<TinyFTPSession> self, DataConnectionReady onReady);
+		void handleConnectTimeout();
+		uint64_t transferProgress();
+		void startStallWatch();
+		void handleIdleTimeout();
+		void handleStallTimeout();
+
+		asio::awaitable<void> controlHandshake(std::shared_ptr<TinyFTPSession> self);
+		void handleHandshakeTimeout();
+
+		void startSocketTuning();
+		void handleTuningTimer(const asio::error_code& e);
+
+		// declared first so it outlives anything that still holds an operation
+		TinyFTPHandlerMemory handlerMemory;
 
 		/// Socket for the command connection.
-		asio::ip::tcp::socket socket;
+		TinyFTPStream socket;
 
 		/// Socket for the data connection.
-		std::unique_ptr<asio::ip::tcp::socket> socketData;
+		// shared with a MODE Z sender, which may still have a chunk on the worker pool when the transfer fails
+		std::shared_ptr<TinyFTPStream> socketData;
 
 		/// Relevant IO service
 		asio::io_context& service;
@@ -136,7 +374,11 @@ namespace TinyWinFTP
 		/// Buffer for incoming commands.
 		std::array<char, MAX_COMMAND_LEN> buffer;
 
-		TinyFTPUploadBuffers uploadBuffers;
+		// size from ALLO, handed to the next STOR
+		long long int alloSize;
+
+		// null while no RETR or STOR runs
+		std::unique_ptr<TinyFTPTransfer> transfer;
 
 		/// The incoming request.
 		TinyFTPRequest request;
@@ -147,24 +389,61 @@ namespace TinyWinFTP
 		/// The reply to be sent back to the client.
 		TinyFTPReply reply;
 
-		asio::windows::random_access_handle fileToSend;
-		uint64_t fileBytesSent;
-		LARGE_INTEGER fileBytesTotal;
-
 		// is data op in progress
 		std::atomic_bool dataSocketConnected;
 
-		std::atomic_int pasvPort;
-
-		// acceptor and listener socket
-		std::unique_ptr<asio::ip::tcp::acceptor> tcpAcceptor;
-
-		// remote address
-		std::string portString;
+		// pool of pre-bound passive ports for our io_context, and the one we hold
+		TinyFTPPassivePortPoolPtr pasvPortPool;
+		asio::ip::tcp::acceptor* pasvAcceptor;
+
+		// remote address for active mode
+		asio::ip::tcp::endpoint activeEndpoint;
+
+		// PROT P, data connections are TLS
+		bool protectData;
+
+		// data socket buffers follow the measured bandwidth-delay product
+		TinyFTPBufferTuner dataSocketTuner;
+		asio::steady_timer tuningTimer;
+
+		// idle control connection, data connection setup (PROT P handshake included), AUTH TLS handshake and
+		// stalled transfer, on the io_context's wheel
+		TinyFTPTimingWheel& timingWheel;
+		TinyFTPTimeout idleTimeout;
+		TinyFTPTimeout connectTimeout;
+		TinyFTPTimeout handshakeTimeout;
+		TinyFTPTimeout stallTimeout;
+		uint64_t stallProgress;
+		// the wheel gave up on the data connection, the aborted accept or connect is a timeout
+		bool connectExpired;
+		// the 421 is on its way, the next expiry closes without waiting for it
+		bool idleClosing;
+
+		// the control loop sleeps on this while a data operation runs, completeDataOp cancels it
+		asio::steady_timer dataOpDone;
+		std::string deferredReply;
+		// progress line being written, the final reply waits for it
+		std::string progressLine;
+		bool progressWriting;
 
 		// remote address
 		std::string curDirectory;
-		std::string docRoot;
+		// normalized once at startup, shared by all sessions
+		const std::string& docRoot;
+
+		TinyFTPServices& services;
+
+		// try FILE_FLAG_NO_BUFFERING for STOR
+		bool unbufferedUploads;
+
+		// MODE Z state
+		bool modeZ;
+		bool modeB;
+		TinyFTPCompressionEngine zEngine;
+		int zLevel;
+
+		TinyFTPHashAlgorithm hashAlgorithm;
+		TinyFTPListOptions listOptions;
 
 		TinyFTPSession(const TinyFTPSession & other) = delete;
 		TinyFTPSession(TinyFTPSession && other) = delete;
@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <ctype.h>
+
+#include "TinyFTPSizeIndex.h"
+
+namespace TinyWinFTP
+{
+	namespace
+	{
+		const char LONG_PATH_PREFIX[] = "\\\\?\\";
+
+		std::string lowerCase(const std::string& name)
+		{
+			std::string lower(name);
+			for (char& c : lower)
+				c = (char)tolower((unsigned char)c);
+			return lower;
+		}
+	}
+
+	TinyFTPSizeIndex::TinyFTPSizeIndex(TinyFTPFileSystem& in_fileSystem, const std::string& in_root, bool in_enabled, bool watchRoot, const std::vector<TinyFTPQuota>& quotas)
+		: fileSystem(in_fileSystem),
+		root(in_root),
+		rootKey(keyFor(in_root)),
+		enabled(in_enabled),
+		ready(false),
+		// what the watch reports before the first scan starts goes to missed as well
+		scanning(true),
+		stopping(false)
+	{
+		for (const TinyFTPQuota& quota : quotas)
+		{
+			std::string directory = quota.directory;
+			for (char& c : directory)
+				if (c == '/')
+					c = '\\';
+			quotaLimits.push_back(std::make_pair(keyFor(root + (directory.empty() || directory[0] != '\\' ? "\\" : "") + directory), quota.maxBytes));
+		}
+		if (!enabled)
+			return;
+
+		if (watchRoot)
+		{
+			watch.reset(new TinyFTPDirectoryWatch(root, [this](const std::string& path)
+			{
+				refresh(LONG_PATH_PREFIX + path);
+			}, [this]()
+			{
+				std::cout << "Size index: changes lost, scanning " << root << " again" << std::endl;
+				rebuild();
+			}, [this]()
+			{
+				std::cout << "Size index: watch failed, changes made outside the server are not counted any more" << std::endl;
+			}));
+			if (!watch->start())
+			{
+				std::cout << "Size index: can't watch " << root << ", changes made outside the server are not counted" << std::endl;
+				watch.reset();
+			}
+		}
+
+		builder = std::thread([this]()
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			rebuild();
+			if (!ready)
+				return;
+			Usage usage;
+			getUsage(root, usage);
+			std::cout << "Size index: " << usage.bytes << " bytes in " << usage.files << " files, " << usage.directories << " directories, scanned in "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+		});
+	}
+
+	TinyFTPSizeIndex::~TinyFTPSizeIndex()
+	{
+		// a scan running on either thread gives up at the next directory
+		stopping = true;
+		watch.reset();
+		if (builder.joinable())
+			builder.join();
+	}
+
+	std::string TinyFTPSizeIndex::keyFor(const std::string& path)
+	{
+		size_t begin = path.compare(0, sizeof(LONG_PATH_PREFIX) - 1, LONG_PATH_PREFIX) ? 0 : sizeof(LONG_PATH_PREFIX) - 1;
+		std::string key = lowerCase(path.substr(begin));
+		while (key.size() > 1 && *key.rbegin() == '\\')
+			key.erase(key.size() - 1);
+		return key;
+	}
+
+	std::string TinyFTPSizeIndex::parentOf(const std::string& key)
+	{
+		size_t slash = key.rfind('\\');
+		return slash == std::string::npos ? std::string() : key.substr(0, slash);
+	}
+
+	std::string TinyFTPSizeIndex::nameOf(const std::string& key)
+	{
+		size_t slash = key.rfind('\\');
+		return slash == std::string::npos ? key : key.substr(slash + 1);
+	}
+
+	bool TinyFTPSizeIndex::scan(const std::string& path, const std::string& key, Directories& scanned)
+	{
+		if (stopping)
+			return false;
+		std::vector<TinyFTPFileInfo> entries;
+		fileSystem.list(path, entries);
+		// map nodes stay where they are while others are added
+		Directory& directory = scanned[key];
+		for (const TinyFTPFileInfo& entry : entries)
+		{
+			std::string name = lowerCase(entry.name);
+			if (!entry.isDirectory)
+			{
+				directory.files[name] = entry.size;
+				directory.total.bytes += entry.size;
+				++directory.total.files;
+				continue;
+			}
+			// what a junction points to is counted where it really is, or never if that's outside the root
+			if (entry.isReparsePoint)
+				continue;
+			std::string childKey = key + "\\" + name;
+			if (!scan(path + "\\" + entry.name, childKey, scanned))
+				return false;
+			const Usage& child = scanned[childKey].total;
+			directory.total.bytes += child.bytes;
+			directory.total.files += child.files;
+			directory.total.directories += child.directories + 1;
+		}
+		return true;
+	}
+
+	void TinyFTPSizeIndex::rebuild()
+	{
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			scanning = true;
+		}
+		Directories scanned;
+		bool ok = scan(LONG_PATH_PREFIX + root, rootKey, scanned);
+		std::vector<std::string> replay;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			if (ok)
+				directories.swap(scanned);
+			scanning = false;
+			replay.swap(missed);
+		}
+		if (!ok)
+			return;
+		ready = true;
+		for (const std::string& path : replay)
+			refresh(path);
+	}
+
+	bool TinyFTPSizeIndex::getUsage(const std::string& path, Usage& usage)
+	{
+		std::string key = keyFor(path);
+		std::lock_guard<std::mutex> guard(mutex);
+		Directories::iterator it = directories.find(key);
+		if (it != directories.end())
+		{
+			usage = it->second.total;
+			return true;
+		}
+		it = directories.find(parentOf(key));
+		if (it == directories.end())
+			return false;
+		std::map<std::string, uint64_t>::iterator file = it->second.files.find(nameOf(key));
+		if (file == it->second.files.end())
+			return false;
+		usage = Usage();
+		usage.bytes = file->second;
+		usage.files = 1;
+		return true;
+	}
+
+	void TinyFTPSizeIndex::refresh(const std::string& path)
+	{
+		if (!enabled)
+			return;
+		std::string key = keyFor(path);
+		if (key != rootKey && key.compare(0, rootKey.size() + 1, rootKey + "\\"))
+			return;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			// the scan may have read it before the change, or not
+			if (scanning)
+			{
+				missed.push_back(path);
+				return;
+			}
+		}
+
+		TinyFTPFileInfo info;
+		if (!fileSystem.stat(path, info))
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			removeEntry(key);
+			return;
+		}
+		if (!info.isDirectory)
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			setFile(key, info.size);
+			return;
+		}
+		// a new junction stays out of the index, as in a full scan
+		if (info.isReparsePoint)
+			return;
+		{
+			// a directory already in the index hears about its content one change at a time
+			std::lock_guard<std::mutex> guard(mutex);
+			if (directories.count(key))
+				return;
+		}
+		Directories scanned;
+		if (!scan(path, key, scanned))
+			return;
+		std::lock_guard<std::mutex> guard(mutex);
+		addDirectory(key, scanned);
+	}
+
+	bool TinyFTPSizeIndex::fitsQuota(const std::string& path, long long uploadBytes)
+	{
+		// nothing to check against until the first scan is in
+		if (!enabled || quotaLimits.empty() || !ready)
+			return true;
+		std::string key = keyFor(path);
+		std::lock_guard<std::mutex> guard(mutex);
+		uint64_t replaced = 0;
+		Directories::iterator parent = directories.find(parentOf(key));
+		if (parent != directories.end())
+		{
+			std::map<std::string, uint64_t>::iterator file = parent->second.files.find(nameOf(key));
+			if (file != parent->second.files.end())
+				replaced = file->second;
+		}
+		for (const std::pair<std::string, uint64_t>& quota : quotaLimits)
+		{
+			if (key.compare(0, quota.first.size() + 1, quota.first + "\\"))
+				continue;
+			Directories::iterator it = directories.find(quota.first);
+			uint64_t used = it == directories.end() ? 0 : it->second.total.bytes;
+			used -= std::min(used, replaced);
+			if (uploadBytes < 0 ? used >= quota.second : used + (uint64_t)uploadBytes > quota.second)
+				return false;
+		}
+		return true;
+	}
+
+	void TinyFTPSizeIndex::addDirectory(const std::string& key, Directories& scanned)
+	{
+		// the parent's totals are what a new directory is added to, without it it'll come with the parent's scan
+		if (key != rootKey && !directories.count(parentOf(key)))
+			return;
+		removeEntry(key);
+		Usage total = scanned[key].total;
+		for (Directories::value_type& scannedDirectory : scanned)
+			directories[scannedDirectory.first] = std::move(scannedDirectory.second);
+		if (key != rootKey)
+			addToAncestors(parentOf(key), total.bytes, total.files, total.directories + 1);
+	}
+
+	void TinyFTPSizeIndex::removeEntry(const std::string& key)
+	{
+		Directories::iterator it = directories.find(key);
+		if (it != directories.end())
+		{
+			Usage total = it->second.total;
+			directories.erase(it);
+			// everything below sorts right after its prefix
+			std::string prefix = key + "\\";
+			it = directories.lower_bound(prefix);
+			while (it != directories.end() && !it->first.compare(0, prefix.size(), prefix))
+				directories.erase(it++);
+			if (key != rootKey)
+				addToAncestors(parentOf(key), -(int64_t)total.bytes, -(int64_t)total.files, -(int64_t)total.directories - 1);
+			return;
+		}
+		it = directories.find(parentOf(key));
+		if (it == directories.end())
+			return;
+		std::map<std::string, uint64_t>::iterator file = it->second.files.find(nameOf(key));
+		if (file == it->second.files.end())
+			return;
+		int64_t size = (int64_t)file->second;
+		it->second.files.erase(file);
+		addToAncestors(it->first, -size, -1, 0);
+	}
+
+	void TinyFTPSizeIndex::setFile(const std::string& key, uint64_t size)
+	{
+		// was a directory before
+		if (directories.count(key))
+			removeEntry(key);
+		Directories::iterator it = directories.find(parentOf(key));
+		if (it == directories.end())
+			return;
+		std::pair<std::map<std::string, uint64_t>::iterator, bool> file = it->second.files.insert(std::make_pair(nameOf(key), size));
+		int64_t delta = file.second ? (int64_t)size : (int64_t)size - (int64_t)file.first->second;
+		file.first->second = size;
+		addToAncestors(it->first, delta, file.second ? 1 : 0, 0);
+	}
+
+	void TinyFTPSizeIndex::addToAncestors(const std::string& key, int64_t bytes, int64_t files, int64_t subdirectories)
+	{
+		for (std::string ancestor = key; ; ancestor = parentOf(ancestor))
+		{
+			Directories::iterator it = directories.find(ancestor);
+			if (it != directories.end())
+			{
+				it->second.total.bytes += (uint64_t)bytes;
+				it->second.total.files += (uint64_t)files;
+				it->second.total.directories += (uint64_t)subdirectories;
+			}
+			if (ancestor.size() <= rootKey.size())
+				break;
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef IK80_TINYFTPSIZEINDEX_H_
+#define IK80_TINYFTPSIZEINDEX_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TinyFTPServerConfig.h"
+#include "TinyFTPFileSystem.h"
+#include "TinyFTPDirectoryWatch.h"
+
+namespace TinyWinFTP
+{
+	/// Bytes, files and directories below every directory of docRoot, so SITE DU and the quota check before a
+	/// STOR are lookups instead of a walk over the tree. Built by one scan at startup, then kept current from
+	/// what the server itself changes (refresh) and, on disk, from a directory watch on docRoot for changes made
+	/// behind its back. Lost notifications mean a new scan.
+	class TinyFTPSizeIndex
+	{
+	public:
+		/// enabled false leaves the index empty and every call a no-op.
+		TinyFTPSizeIndex(TinyFTPFileSystem& fileSystem, const std::string& root, bool enabled, bool watchRoot, const std::vector<TinyFTPQuota>& quotas);
+		~TinyFTPSizeIndex();
+
+		bool isEnabled() const
+		{
+			return enabled;
+		}
+		/// False until the first scan is done.
+		bool isReady() const
+		{
+			return ready;
+		}
+
+		struct Usage
+		{
+			uint64_t bytes = 0;
+			uint64_t files = 0;
+			uint64_t directories = 0;
+		};
+		/// Totals below path, or for a file just itself. False if the index doesn't know path.
+		bool getUsage(const std::string& path, Usage& usage);
+
+		/// Looks at path again after the server changed it (STOR, DELE, MKD, RMD, both names of a RNTO, ...).
+		/// Stats and, for a new directory, scans it: call from the blocking pool, not an io thread.
+		void refresh(const std::string& path);
+
+		/// Whether writing uploadBytes to path keeps every quota above it. An upload of unknown size (-1) only has
+		/// to find room left, an existing file at path counts as freed.
+		bool fitsQuota(const std::string& path, long long uploadBytes);
+
+	private:
+		struct Directory
+		{
+			// everything below, this directory not counted
+			Usage total;
+			// lower case names and sizes of the files right in it
+			std::map<std::string, uint64_t> files;
+		};
+		typedef std::map<std::string, Directory> Directories;
+
+		// lower case, without \\?\ and trailing backslashes, like the file cache compares names
+		static std::string keyFor(const std::string& path);
+		static std::string parentOf(const std::string& key);
+		static std::string nameOf(const std::string& key);
+		// reads the tree below path into directories, false if stopped
+		bool scan(const std::string& path, const std::string& key, Directories& directories);
+		void rebuild();
+		// caller holds mutex
+		void addDirectory(const std::string& key, Directories& scanned);
+		void removeEntry(const std::string& key);
+		void setFile(const std::string& key, uint64_t size);
+		void addToAncestors(const std::string& key, int64_t bytes, int64_t files, int64_t subdirectories);
+
+		TinyFTPFileSystem& fileSystem;
+		std::string root;
+		std::string rootKey;
+		bool enabled;
+		std::vector<std::pair<std::string, uint64_t>> quotaLimits;
+
+		std::mutex mutex;
+		Directories directories;
+		std::atomic_bool ready;
+		// changes reported while a scan runs, looked at again once it is in
+		std::vector<std::string> missed;
+		bool scanning;
+
+		std::atomic_bool stopping;
+		std::thread builder;
+		std::unique_ptr<TinyFTPDirectoryWatch> watch;
+
+		TinyFTPSizeIndex(const TinyFTPSizeIndex& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPSIZEINDEX_H_
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <iostream>
+
+#include <mstcpip.h>
+
+#include "TinyFTPSocketTuning.h"
+
+namespace TinyWinFTP
+{
+	TinyFTPBufferTuner::TinyFTPBufferTuner(int in_maxBuffer)
+		: maxBuffer(in_maxBuffer),
+		lastSample(),
+		startBytesOut(0),
+		startBytesIn(0)
+	{
+	}
+
+	namespace
+	{
+		// SIO_TCP_INFO, Windows 10 1703 and later; older stacks just don't get tuned
+		bool queryTcpInfo(asio::ip::tcp::socket& socket, TCP_INFO_v0& info)
+		{
+			DWORD version = 0;
+			DWORD bytesReturned = 0;
+			return WSAIoctl(socket.native_handle(), SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &bytesReturned, 0, 0) == 0;
+		}
+	}
+
+	bool readTcpByteCounters(asio::ip::tcp::socket& socket, uint64_t& bytesOut, uint64_t& bytesIn)
+	{
+		TCP_INFO_v0 info;
+		if (!queryTcpInfo(socket, info))
+			return false;
+		bytesOut = info.BytesOut;
+		bytesIn = info.BytesIn;
+		return true;
+	}
+
+	bool TinyFTPBufferTuner::takeSample(asio::ip::tcp::socket& socket, Sample& sample)
+	{
+		TCP_INFO_v0 info;
+		if (!queryTcpInfo(socket, info))
+			return false;
+
+		stats.rttUs = info.RttUs;
+		stats.minRttUs = info.MinRttUs;
+		stats.cwndBytes = info.Cwnd;
+		sample.bytesOut = info.BytesOut;
+		sample.bytesIn = info.BytesIn;
+		sample.tickMs = GetTickCount64();
+		return true;
+	}
+
+	void TinyFTPBufferTuner::start(asio::ip::tcp::socket& socket)
+	{
+		stats = TinyFTPTransferStats();
+		asio::error_code ec;
+		asio::socket_base::send_buffer_size sendBuffer;
+		asio::socket_base::receive_buffer_size receiveBuffer;
+		socket.get_option(sendBuffer, ec);
+		socket.get_option(receiveBuffer, ec);
+		stats.sendBuffer = sendBuffer.value();
+		stats.receiveBuffer = receiveBuffer.value();
+
+		if (!enabled() || !takeSample(socket, lastSample))
+			lastSample = Sample();
+		startBytesOut = lastSample.bytesOut;
+		startBytesIn = lastSample.bytesIn;
+	}
+
+	void TinyFTPBufferTuner::update(asio::ip::tcp::socket& socket)
+	{
+		Sample sample;
+		if (!enabled() || !lastSample.tickMs || !takeSample(socket, sample))
+			return;
+		uint64_t elapsedMs = sample.tickMs - lastSample.tickMs;
+		if (!elapsedMs)
+			return;
+
+		// one direction carries the transfer, the other only ACKs
+		uint64_t bytesOut = sample.bytesOut - lastSample.bytesOut;
+		uint64_t bytesIn = sample.bytesIn - lastSample.bytesIn;
+		bool sending = bytesOut >= bytesIn;
+		stats.bytesTransferred = sending ? sample.bytesOut - startBytesOut : sample.bytesIn - startBytesIn;
+		stats.bytesPerSecond = std::max(bytesOut, bytesIn) * 1000 / elapsedMs;
+		lastSample = sample;
+
+		// the window in flight is a lower bound when the rate sample is short
+		stats.bdpBytes = std::max(stats.bytesPerSecond * stats.rttUs / 1000000, sending ? stats.cwndBytes : 0);
+		uint64_t target = std::min<uint64_t>(std::max<uint64_t>(stats.bdpBytes * 2, MIN_BUFFER), maxBuffer);
+		target = (target + MIN_BUFFER - 1) / MIN_BUFFER * MIN_BUFFER;
+
+		asio::error_code ec;
+		if (sending && (int)target > stats.sendBuffer)
+		{
+			socket.set_option(asio::socket_base::send_buffer_size((int)target), ec);
+			if (ec)
+				return;
+			stats.sendBuffer = (int)target;
+		}
+		else if (!sending && (int)target > stats.receiveBuffer)
+		{
+			socket.set_option(asio::socket_base::receive_buffer_size((int)target), ec);
+			if (ec)
+				return;
+			stats.receiveBuffer = (int)target;
+		}
+		else
+			return;
+		++stats.adjustments;
+		std::cout << "Data channel: rtt " << stats.rttUs << "us, " << stats.bytesPerSecond << " B/s, bdp " << stats.bdpBytes
+			<< ", " << (sending ? "SO_SNDBUF " : "SO_RCVBUF ") << target << std::endl;
+	}
+}
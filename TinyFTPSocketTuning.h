@@ -0,0 +1,72 @@
+#ifndef IK80_TINYFTPSOCKETTUNING_H_
+#define IK80_TINYFTPSOCKETTUNING_H_
+
+#include <stdint.h>
+
+#include <asio/ip/tcp.hpp>
+
+namespace TinyWinFTP
+{
+	/// What the tuner measured on a data connection and the buffer sizes it picked, kept for SITE STATS.
+	struct TinyFTPTransferStats
+	{
+		uint64_t bytesTransferred = 0;
+		uint64_t rttUs = 0;
+		uint64_t minRttUs = 0;
+		uint64_t cwndBytes = 0;
+		uint64_t bytesPerSecond = 0;
+		uint64_t bdpBytes = 0;
+		int sendBuffer = 0;
+		int receiveBuffer = 0;
+		unsigned int adjustments = 0;
+	};
+
+	/// Payload bytes the stack has sent and received on socket so far (SIO_TCP_INFO), false where that isn't available.
+	bool readTcpByteCounters(asio::ip::tcp::socket& socket, uint64_t& bytesOut, uint64_t& bytesIn);
+
+	/// Sizes SO_SNDBUF/SO_RCVBUF of a data connection after its bandwidth-delay product.
+	/// update() is called every TUNING_INTERVAL_MS while a transfer runs, it samples SIO_TCP_INFO and
+	/// grows the buffer on the busy side to twice the measured BDP so the window can keep opening.
+	/// Buffers only grow within a transfer, shrinking one under a full send queue would stall it.
+	class TinyFTPBufferTuner
+	{
+	public:
+		static const unsigned int TUNING_INTERVAL_MS = 250;
+		static const int MIN_BUFFER = 64 * 1024;
+
+		/// maxBuffer 0 leaves the sockets to the stack's own autotuning.
+		explicit TinyFTPBufferTuner(int maxBuffer);
+
+		bool enabled() const
+		{
+			return maxBuffer != 0;
+		}
+
+		/// New data connection, takes the first sample (RTT from the handshake) and the current buffer sizes.
+		void start(asio::ip::tcp::socket& socket);
+		void update(asio::ip::tcp::socket& socket);
+
+		const TinyFTPTransferStats& getStats() const
+		{
+			return stats;
+		}
+
+	private:
+		struct Sample
+		{
+			uint64_t bytesOut;
+			uint64_t bytesIn;
+			uint64_t tickMs;
+		};
+
+		bool takeSample(asio::ip::tcp::socket& socket, Sample& sample);
+
+		int maxBuffer;
+		Sample lastSample;
+		uint64_t startBytesOut;
+		uint64_t startBytesIn;
+		TinyFTPTransferStats stats;
+	};
+}
+
+#endif // IK80_TINYFTPSOCKETTUNING_H_
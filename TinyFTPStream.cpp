@@ -0,0 +1,85 @@
+#include <chrono>
+#include <iostream>
+
+#include <asio/steady_timer.hpp>
+
+#include "TinyFTPStream.h"
+
+namespace TinyWinFTP
+{
+	std::unique_ptr<TinyFTPTlsContext> createTlsContext(const std::string& certificateFile, const std::string& keyFile)
+	{
+		if (certificateFile.empty())
+			return nullptr;
+#ifdef TINYFTP_WITH_TLS
+		std::unique_ptr<TinyFTPTlsContext> context(new TinyFTPTlsContext(asio::ssl::context::tls_server));
+		context->set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3
+			| asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1 | asio::ssl::context::single_dh_use);
+		asio::error_code ec;
+		context->use_certificate_chain_file(certificateFile, ec);
+		if (!ec)
+			context->use_private_key_file(keyFile.empty() ? certificateFile : keyFile, asio::ssl::context::pem, ec);
+		if (ec)
+		{
+			std::cout << "TLS: could not load certificate or key: " << ec.message() << std::endl;
+			return nullptr;
+		}
+		// data connections resume the control connection's session, the default server cache does that
+		return context;
+#else
+		std::cout << "TLS: not compiled in, ignoring certificate" << std::endl;
+		return nullptr;
+#endif
+	}
+
+	TinyFTPStream::TinyFTPStream(asio::io_context& io_context)
+		: socket(io_context)
+	{
+	}
+
+	TinyFTPStream::TinyFTPStream(asio::ip::tcp::socket&& in_socket)
+		: socket(std::move(in_socket))
+	{
+	}
+
+	TinyFTPStream::~TinyFTPStream()
+	{
+	}
+
+	bool TinyFTPStream::isTls() const
+	{
+#ifdef TINYFTP_WITH_TLS
+		return tls != nullptr;
+#else
+		return false;
+#endif
+	}
+
+	void TinyFTPStream::close(std::shared_ptr<void> keepAlive)
+	{
+		asio::error_code ignored_ec;
+#ifdef TINYFTP_WITH_TLS
+		if (tls && socket.is_open())
+		{
+			// a peer that never answers the close_notify would hold a synchronous shutdown forever
+			std::shared_ptr<asio::steady_timer> deadline = std::make_shared<asio::steady_timer>(socket.get_executor());
+			deadline->expires_after(std::chrono::milliseconds(TLS_SHUTDOWN_TIMEOUT_MS));
+			deadline->async_wait([this, keepAlive](const asio::error_code& e)
+			{
+				asio::error_code ignored_ec;
+				if (!e)
+					socket.close(ignored_ec);
+			});
+			tls->async_shutdown([this, keepAlive, deadline](const asio::error_code&)
+			{
+				asio::error_code ignored_ec;
+				deadline->cancel();
+				socket.close(ignored_ec);
+			});
+			return;
+		}
+		tls.reset();
+#endif
+		socket.close(ignored_ec);
+	}
+}
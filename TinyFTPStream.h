@@ -0,0 +1,177 @@
+#ifndef IK80_TINYFTPSTREAM_H_
+#define IK80_TINYFTPSTREAM_H_
+
+#include <memory>
+#include <string>
+
+#include <asio/ip/tcp.hpp>
+#include <asio/async_result.hpp>
+#include <asio/post.hpp>
+#ifdef TINYFTP_WITH_TLS
+#include <asio/ssl.hpp>
+#endif
+
+namespace TinyWinFTP
+{
+#ifdef TINYFTP_WITH_TLS
+	typedef asio::ssl::context TinyFTPTlsContext;
+#else
+	/// TLS is compiled out (configure with -DTINYFTP_WITH_TLS=ON), AUTH TLS is refused.
+	struct TinyFTPTlsContext
+	{
+	};
+#endif
+
+	/// Server side TLS context from a PEM certificate chain and key, null when TLS is compiled out or the files don't load.
+	std::unique_ptr<TinyFTPTlsContext> createTlsContext(const std::string& certificateFile, const std::string& keyFile);
+
+	/// A control or data connection, plain TCP until async_handshake() switches it to TLS (AUTH TLS, PROT P).
+	/// Reads and writes go through the TLS layer once it is up, so asio::write/async_read work on either;
+	/// lowest_layer() is the TCP socket for connect/accept, socket options and TransmitFile.
+	class TinyFTPStream
+	{
+	public:
+		typedef asio::ip::tcp::socket::executor_type executor_type;
+		typedef asio::ip::tcp::socket lowest_layer_type;
+
+		// how long close() waits for the peer to answer close_notify
+		static const unsigned int TLS_SHUTDOWN_TIMEOUT_MS = 2000;
+
+		explicit TinyFTPStream(asio::io_context& io_context);
+		explicit TinyFTPStream(asio::ip::tcp::socket&& socket);
+		~TinyFTPStream();
+
+		executor_type get_executor()
+		{
+			return socket.get_executor();
+		}
+
+		lowest_layer_type& lowest_layer()
+		{
+			return socket;
+		}
+
+		/// Server side handshake, reads and writes go through TLS from here on. It has no deadline of its own,
+		/// closing lowest_layer() ends it; after a failure the connection is only good for closing.
+		template <typename HandshakeToken>
+		auto async_handshake(TinyFTPTlsContext& context, HandshakeToken&& token)
+		{
+			return asio::async_initiate<HandshakeToken, void(asio::error_code)>(
+				[this, &context](auto handler)
+			{
+#ifdef TINYFTP_WITH_TLS
+				tls.reset(new asio::ssl::stream<asio::ip::tcp::socket&>(socket, context));
+				tls->async_handshake(asio::ssl::stream_base::server, std::move(handler));
+#else
+				(void)context;
+				asio::post(socket.get_executor(), [handler = std::move(handler)]() mutable
+				{
+					std::move(handler)(asio::error_code(asio::error::operation_not_supported));
+				});
+#endif
+			}, token);
+		}
+		bool isTls() const;
+
+		asio::ip::tcp::endpoint local_endpoint(asio::error_code& ec) const
+		{
+			return socket.local_endpoint(ec);
+		}
+
+		void shutdown(asio::ip::tcp::socket::shutdown_type what, asio::error_code& ec)
+		{
+			socket.shutdown(what, ec);
+		}
+
+		/// Sends close_notify first on TLS, clients treat a bare TCP close as a truncated transfer. That goes
+		/// out asynchronously and the socket closes once the peer answers or after TLS_SHUTDOWN_TIMEOUT_MS;
+		/// keepAlive owns the stream and is held until then.
+		void close(std::shared_ptr<void> keepAlive);
+
+		template <typename ConstBufferSequence>
+		std::size_t write_some(const ConstBufferSequence& buffers, asio::error_code& ec)
+		{
+#ifdef TINYFTP_WITH_TLS
+			if (tls)
+				return tls->write_some(buffers, ec);
+#endif
+			return socket.write_some(buffers, ec);
+		}
+
+		template <typename ConstBufferSequence>
+		std::size_t write_some(const ConstBufferSequence& buffers)
+		{
+			asio::error_code ec;
+			std::size_t bytesWritten = write_some(buffers, ec);
+			if (ec)
+				throw asio::system_error(ec);
+			return bytesWritten;
+		}
+
+		template <typename MutableBufferSequence>
+		std::size_t read_some(const MutableBufferSequence& buffers, asio::error_code& ec)
+		{
+#ifdef TINYFTP_WITH_TLS
+			if (tls)
+				return tls->read_some(buffers, ec);
+#endif
+			return socket.read_some(buffers, ec);
+		}
+
+		template <typename MutableBufferSequence>
+		std::size_t read_some(const MutableBufferSequence& buffers)
+		{
+			asio::error_code ec;
+			std::size_t bytesRead = read_some(buffers, ec);
+			if (ec)
+				throw asio::system_error(ec);
+			return bytesRead;
+		}
+
+		// completion tokens work as on a socket, so coroutines can co_await either layer
+		template <typename MutableBufferSequence, typename ReadToken>
+		auto async_read_some(const MutableBufferSequence& buffers, ReadToken&& token)
+		{
+			return asio::async_initiate<ReadToken, void(asio::error_code, std::size_t)>(
+				[this](auto handler, const MutableBufferSequence& buffers)
+			{
+#ifdef TINYFTP_WITH_TLS
+				if (tls)
+				{
+					tls->async_read_some(buffers, std::move(handler));
+					return;
+				}
+#endif
+				socket.async_read_some(buffers, std::move(handler));
+			}, token, buffers);
+		}
+
+		template <typename ConstBufferSequence, typename WriteToken>
+		auto async_write_some(const ConstBufferSequence& buffers, WriteToken&& token)
+		{
+			return asio::async_initiate<WriteToken, void(asio::error_code, std::size_t)>(
+				[this](auto handler, const ConstBufferSequence& buffers)
+			{
+#ifdef TINYFTP_WITH_TLS
+				if (tls)
+				{
+					tls->async_write_some(buffers, std::move(handler));
+					return;
+				}
+#endif
+				socket.async_write_some(buffers, std::move(handler));
+			}, token, buffers);
+		}
+
+	private:
+		asio::ip::tcp::socket socket;
+#ifdef TINYFTP_WITH_TLS
+		std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket&> > tls;
+#endif
+
+		TinyFTPStream(const TinyFTPStream& other) = delete;
+		TinyFTPStream(TinyFTPStream&& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPSTREAM_H_
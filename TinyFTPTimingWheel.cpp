@@ -0,0 +1,131 @@
+#include "TinyFTPTimingWheel.h"
+
+namespace TinyWinFTP
+{
+	TinyFTPTimingWheel::TinyFTPTimingWheel(asio::io_context& io_context)
+		: ticker(io_context),
+		currentTick(0)
+	{
+		for (auto& level : levels)
+			for (TinyFTPTimeoutLink& head : level)
+				head.prev = head.next = &head;
+	}
+
+	TinyFTPTimingWheel::~TinyFTPTimingWheel()
+	{
+		// owners that outlive the wheel must find their timeouts unscheduled
+		for (auto& level : levels)
+			for (TinyFTPTimeoutLink& head : level)
+				detachAll(head);
+	}
+
+	void TinyFTPTimingWheel::start()
+	{
+		nextTickTime = asio::steady_timer::clock_type::now() + std::chrono::milliseconds(TICK_MS);
+		ticker.expires_at(nextTickTime);
+		ticker.async_wait([this](const asio::error_code& ec) { tick(ec); });
+	}
+
+	void TinyFTPTimingWheel::stop()
+	{
+		ticker.cancel();
+	}
+
+	void TinyFTPTimingWheel::schedule(TinyFTPTimeout& timeout, unsigned int seconds)
+	{
+		cancel(timeout);
+		if (!seconds)
+			return;
+		uint64_t ticks = ((uint64_t)seconds * 1000 + TICK_MS - 1) / TICK_MS;
+		timeout.expiryTick = currentTick + ticks;
+		insert(timeout);
+	}
+
+	void TinyFTPTimingWheel::cancel(TinyFTPTimeout& timeout)
+	{
+		if (timeout.isScheduled())
+			unlink(timeout);
+	}
+
+	void TinyFTPTimingWheel::insert(TinyFTPTimeout& timeout)
+	{
+		// level by distance, slot by the expiry's bits at that level
+		uint64_t delta = timeout.expiryTick > currentTick ? timeout.expiryTick - currentTick : 0;
+		unsigned int level = 0;
+		while (level + 1 < LEVEL_COUNT && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+			++level;
+		if (delta >= ((uint64_t)1 << (SLOT_BITS * LEVEL_COUNT)))
+			timeout.expiryTick = currentTick + ((uint64_t)1 << (SLOT_BITS * LEVEL_COUNT)) - 1;
+		uint64_t expiry = delta ? timeout.expiryTick : currentTick;
+		TinyFTPTimeoutLink& head = levels[level][(expiry >> (SLOT_BITS * level)) & (SLOT_COUNT - 1)];
+		timeout.prev = head.prev;
+		timeout.next = &head;
+		head.prev->next = &timeout;
+		head.prev = &timeout;
+	}
+
+	unsigned int TinyFTPTimingWheel::cascade(unsigned int level)
+	{
+		unsigned int index = (unsigned int)(currentTick >> (SLOT_BITS * level)) & (SLOT_COUNT - 1);
+		TinyFTPTimeoutLink& head = levels[level][index];
+		while (head.next != &head)
+		{
+			TinyFTPTimeout& timeout = static_cast<TinyFTPTimeout&>(*head.next);
+			unlink(timeout);
+			insert(timeout);
+		}
+		return index;
+	}
+
+	void TinyFTPTimingWheel::tick(const asio::error_code& e)
+	{
+		if (e)
+			return;
+
+		// catch up on ticks the thread was too busy for, a blocked io thread doesn't stretch the timeouts
+		asio::steady_timer::time_point now = asio::steady_timer::clock_type::now();
+		while (nextTickTime <= now)
+		{
+			nextTickTime += std::chrono::milliseconds(TICK_MS);
+			++currentTick;
+
+			unsigned int index = (unsigned int)currentTick & (SLOT_COUNT - 1);
+			for (unsigned int level = 1; !index && level < LEVEL_COUNT; ++level)
+				index = cascade(level);
+
+			// detach the whole slot first, callbacks may schedule again
+			TinyFTPTimeoutLink& head = levels[0][currentTick & (SLOT_COUNT - 1)];
+			TinyFTPTimeoutLink expired;
+			if (head.next == &head)
+				continue;
+			expired.next = head.next;
+			expired.prev = head.prev;
+			expired.next->prev = &expired;
+			expired.prev->next = &expired;
+			head.prev = head.next = &head;
+			while (expired.next != &expired)
+			{
+				TinyFTPTimeout& timeout = static_cast<TinyFTPTimeout&>(*expired.next);
+				unlink(timeout);
+				if (timeout.onExpired)
+					timeout.onExpired();
+			}
+		}
+
+		ticker.expires_at(nextTickTime);
+		ticker.async_wait([this](const asio::error_code& ec) { tick(ec); });
+	}
+
+	void TinyFTPTimingWheel::unlink(TinyFTPTimeoutLink& link)
+	{
+		link.prev->next = link.next;
+		link.next->prev = link.prev;
+		link.prev = link.next = nullptr;
+	}
+
+	void TinyFTPTimingWheel::detachAll(TinyFTPTimeoutLink& head)
+	{
+		while (head.next != &head)
+			unlink(*head.next);
+	}
+}
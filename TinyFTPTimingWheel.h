@@ -0,0 +1,80 @@
+#ifndef IK80_TINYFTPTIMINGWHEEL_H_
+#define IK80_TINYFTPTIMINGWHEEL_H_
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <functional>
+
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+namespace TinyWinFTP
+{
+	/// Expiries by kind, server wide, SITE STATS shows them.
+	struct TinyFTPTimeoutStats
+	{
+		std::atomic<uint64_t> idleTimeouts{ 0 };
+		std::atomic<uint64_t> dataConnectTimeouts{ 0 };
+		std::atomic<uint64_t> stallTimeouts{ 0 };
+	};
+
+	struct TinyFTPTimeoutLink
+	{
+		TinyFTPTimeoutLink* prev = nullptr;
+		TinyFTPTimeoutLink* next = nullptr;
+	};
+
+	/// A timeout embedded in its owner, scheduled on at most one wheel slot at a time. The owner sets onExpired once.
+	struct TinyFTPTimeout : TinyFTPTimeoutLink
+	{
+		std::function<void()> onExpired;
+		uint64_t expiryTick = 0;
+
+		bool isScheduled() const
+		{
+			return next != nullptr;
+		}
+	};
+
+	/// Hierarchical timing wheel, one per io_context, driven by a single steady_timer ticking every TICK_MS.
+	/// Scheduling and cancelling are O(1) list operations; a tick expires one slot of the lowest level and every
+	/// SLOT_COUNT ticks moves one slot of the level above down, so the cost per tick doesn't grow with the number of sessions.
+	/// Only touched from its io_context's thread.
+	class TinyFTPTimingWheel
+	{
+	public:
+		static const unsigned int TICK_MS = 1000;
+		static const unsigned int SLOT_BITS = 6;
+		static const unsigned int SLOT_COUNT = 1 << SLOT_BITS;
+		// 64^4 ticks, about 194 days, longer timeouts are clamped
+		static const unsigned int LEVEL_COUNT = 4;
+
+		explicit TinyFTPTimingWheel(asio::io_context& io_context);
+		~TinyFTPTimingWheel();
+
+		void start();
+		void stop();
+
+		/// (Re)arms timeout to fire after seconds, 0 cancels it.
+		void schedule(TinyFTPTimeout& timeout, unsigned int seconds);
+		void cancel(TinyFTPTimeout& timeout);
+
+	private:
+		void tick(const asio::error_code& e);
+		void insert(TinyFTPTimeout& timeout);
+		// re-inserts a slot of an upper level, returns the slot index
+		unsigned int cascade(unsigned int level);
+		static void unlink(TinyFTPTimeoutLink& link);
+		static void detachAll(TinyFTPTimeoutLink& head);
+
+		asio::steady_timer ticker;
+		asio::steady_timer::time_point nextTickTime;
+		uint64_t currentTick;
+		std::array<std::array<TinyFTPTimeoutLink, SLOT_COUNT>, LEVEL_COUNT> levels;
+
+		TinyFTPTimingWheel(const TinyFTPTimingWheel& other) = delete;
+	};
+}
+
+#endif // IK80_TINYFTPTIMINGWHEEL_H_
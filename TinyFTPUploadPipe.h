@@ -0,0 +1,126 @@
+#ifndef IK80_TINYFTPUPLOADPIPE_H_
+#define IK80_TINYFTPUPLOADPIPE_H_
+
+#include <cstddef>
+#include <array>
+#include <tuple>
+#include <utility>
+
+#include <asio/io_context.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/as_tuple.hpp>
+#include <asio/error.hpp>
+#include <asio/bind_allocator.hpp>
+#include <asio/experimental/basic_channel.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
+
+#include "TinyFTPHandlerAllocator.h"
+
+namespace TinyWinFTP
+{
+
+	static const size_t RECV_BUFFER_SIZE = 256*1024;
+	// one buffer fills from the network while the others drain to disk
+	static const size_t UPLOAD_BUFFER_COUNT = 3;
+
+	typedef std::array<char, RECV_BUFFER_SIZE> TinyFTPUploadBuffer;
+	// bytes held and the buffer, a null buffer marks the end of the upload
+	typedef std::pair<size_t, TinyFTPUploadBuffer*> TinyFTPUploadChunk;
+
+	// room for every buffer plus the end/abort marker, kept in place so passing a chunk doesn't allocate
+	typedef asio::experimental::basic_channel<asio::any_io_executor, TinyFTPFixedChannelTraits<UPLOAD_BUFFER_COUNT + 1>,
+		void(asio::error_code, TinyFTPUploadChunk)> TinyFTPUploadChannel;
+
+	/// The buffer round of a STOR, shared by TinyFTPSession and ftpmicrobench: network reads and disk writes run
+	/// side by side, buffers go round between them through two channels.
+	/// read(buffer, e, last) fills a buffer and returns its byte count, setting last on the final one and e
+	/// (without last) to give up. write(chunk) stores a chunk and returns false to give up. The channel waits
+	/// take their memory from the session's handler memory, read and write should do the same.
+	template <typename Reader, typename Writer>
+	class TinyFTPUploadPipe
+	{
+	public:
+		TinyFTPUploadPipe(asio::io_context& io_context, TinyFTPHandlerMemory& in_memory, Reader in_read, Writer in_write)
+			: memory(in_memory),
+			read(std::move(in_read)),
+			write(std::move(in_write)),
+			emptyBuffers(io_context, UPLOAD_BUFFER_COUNT + 1),
+			fullBuffers(io_context, UPLOAD_BUFFER_COUNT + 1)
+		{
+		}
+
+		/// Runs until the last buffer is written, or either side gives up.
+		asio::awaitable<bool> run(const std::array<TinyFTPUploadBuffer*, UPLOAD_BUFFER_COUNT>& buffers)
+		{
+			for (TinyFTPUploadBuffer* pBuffer : buffers)
+				emptyBuffers.try_send(asio::error_code(), TinyFTPUploadChunk(0, pBuffer));
+
+			using namespace asio::experimental::awaitable_operators;
+			std::tuple<bool, bool> result = co_await (readLoop() && writeLoop());
+			co_return std::get<0>(result) && std::get<1>(result);
+		}
+
+	private:
+		// a chunk without a buffer marks the end of the upload, one with an error code tells the other side to give up
+		asio::awaitable<bool> readLoop()
+		{
+			for (;;)
+			{
+				auto [channelError, chunk] = co_await emptyBuffers.async_receive(asio::bind_allocator(TinyFTPHandlerAllocator<void>(memory), asio::as_tuple(asio::use_awaitable)));
+				if (channelError)
+					co_return false;
+
+				asio::error_code e;
+				bool last = false;
+				std::size_t bytes = co_await read(*chunk.second, e, last);
+				if (e && !last)
+				{
+					fullBuffers.try_send(e, TinyFTPUploadChunk());
+					co_return false;
+				}
+				if (bytes)
+					fullBuffers.try_send(asio::error_code(), TinyFTPUploadChunk(bytes, chunk.second));
+				if (last)
+				{
+					fullBuffers.try_send(asio::error_code(), TinyFTPUploadChunk());
+					co_return true;
+				}
+			}
+		}
+
+		// writes full buffers in the order they were read
+		asio::awaitable<bool> writeLoop()
+		{
+			for (;;)
+			{
+				auto [channelError, chunk] = co_await fullBuffers.async_receive(asio::bind_allocator(TinyFTPHandlerAllocator<void>(memory), asio::as_tuple(asio::use_awaitable)));
+				if (channelError)
+					co_return false;
+				if (!chunk.second)
+					co_return true;
+				if (!co_await write(chunk))
+				{
+					// the reader may wait for a free buffer, wake it; write wakes it on the socket
+					emptyBuffers.try_send(asio::error::operation_aborted, TinyFTPUploadChunk());
+					co_return false;
+				}
+				emptyBuffers.try_send(asio::error_code(), TinyFTPUploadChunk(0, chunk.second));
+			}
+		}
+
+		TinyFTPHandlerMemory& memory;
+		Reader read;
+		Writer write;
+		TinyFTPUploadChannel emptyBuffers;
+		TinyFTPUploadChannel fullBuffers;
+	};
+
+	template <typename Reader, typename Writer>
+	TinyFTPUploadPipe<Reader, Writer> makeUploadPipe(asio::io_context& io_context, TinyFTPHandlerMemory& memory, Reader read, Writer write)
+	{
+		return TinyFTPUploadPipe<Reader, Writer>(io_context, memory, std::move(read), std::move(write));
+	}
+}
+
+#endif // IK80_TINYFTPUPLOADPIPE_H_
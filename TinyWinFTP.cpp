@@ -1,25 +1,128 @@
+#include <algorithm>
 #include <iostream>
+#include <string.h>
 
 #include "TinyFTPServer.h"
 
 TinyWinFTP::TinyFTPServer * gpServer;
 
-void consoleHandler() 
+// first Ctrl+C drains, the second one stops right away
+BOOL WINAPI consoleHandler(DWORD)
 {
-	gpServer->stop();
+	if (!gpServer->drain())
+		gpServer->stop();
+	return TRUE;
 }
 
+void printUsage(const char * argv0)
+{
+	std::cout << "Usage " << argv0 << " <Directory> <Port> [--pasv-range <FirstPort>-<LastPort>] [--buffered-uploads]"
+		<< " [--compression-cache <Directory>] [--compression-cache-hits <N>]"
+		<< " [--upload-digest <SHA-256|SHA-1|MD5|CRC32|SHA-512>] [--max-socket-buffer <KB>]"
+		<< " [--tls-cert <PemFile>] [--tls-key <PemFile>]"
+		<< " [--idle-timeout <s>] [--data-connect-timeout <s>] [--stall-timeout <s>]"
+		<< " [--takeover] [--drain-timeout <s>] [--memory-fs]"
+		<< " [--small-file-cache <MB>] [--small-file-max <KB>]"
+		<< " [--tree-scanners <N>] [--fs-threads <N>]"
+		<< " [--size-index] [--quota <Directory>=<MB>]..." << std::endl;
+}
 
 int main(int argc, char * argv[])
 {
-	if (argc != 3) 
+	if (argc < 3) 
 	{
-		std::cout << "Usage " << argv[0] << " <Directory> <Port>" << std::endl;
+		printUsage(argv[0]);
 		return -1;
 	}
 
-	SetConsoleCtrlHandler((PHANDLER_ROUTINE)consoleHandler, TRUE);
-	TinyWinFTP::TinyFTPServer server(argv[1], atoi(argv[2]));
+	TinyWinFTP::TinyFTPServerConfig config;
+	// sessions share this string, so normalize it here once
+	config.docRoot = argv[1];
+	std::replace(config.docRoot.begin(), config.docRoot.end(), '/', '\\');
+	while (*config.docRoot.rbegin() == '\\' && config.docRoot.size() > 1)
+		config.docRoot.pop_back();
+	config.port = atoi(argv[2]);
+	for (int i = 3; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--pasv-range") && i + 1 < argc)
+		{
+			unsigned int first = 0, last = 0;
+			if (sscanf(argv[++i], "%u-%u", &first, &last) != 2 || first == 0 || last > 65535 || first > last)
+			{
+				printUsage(argv[0]);
+				return -1;
+			}
+			config.pasvPortFirst = (unsigned short)first;
+			config.pasvPortLast = (unsigned short)last;
+		}
+		else if (!strcmp(argv[i], "--buffered-uploads"))
+			config.unbufferedUploads = false;
+		else if (!strcmp(argv[i], "--compression-cache") && i + 1 < argc)
+			config.compressionCacheDir = argv[++i];
+		else if (!strcmp(argv[i], "--compression-cache-hits") && i + 1 < argc)
+			config.compressionCacheMinHits = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--upload-digest") && i + 1 < argc)
+		{
+			TinyWinFTP::TinyFTPHashAlgorithm algorithm;
+			if (!TinyWinFTP::hashAlgorithmFromName(argv[++i], algorithm))
+			{
+				printUsage(argv[0]);
+				return -1;
+			}
+			config.uploadDigest = true;
+			config.uploadDigestAlgorithm = algorithm;
+		}
+		else if (!strcmp(argv[i], "--max-socket-buffer") && i + 1 < argc)
+			config.maxSocketBuffer = std::max(0, std::min(atoi(argv[++i]), 1024 * 1024)) * 1024;
+		else if (!strcmp(argv[i], "--tls-cert") && i + 1 < argc)
+			config.tlsCertificateFile = argv[++i];
+		else if (!strcmp(argv[i], "--tls-key") && i + 1 < argc)
+			config.tlsKeyFile = argv[++i];
+		else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc)
+			config.idleTimeout = (unsigned int)std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--data-connect-timeout") && i + 1 < argc)
+			config.dataConnectTimeout = (unsigned int)std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--stall-timeout") && i + 1 < argc)
+			config.stallTimeout = (unsigned int)std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--takeover"))
+			config.takeOver = true;
+		else if (!strcmp(argv[i], "--drain-timeout") && i + 1 < argc)
+			config.drainTimeout = (unsigned int)std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--memory-fs"))
+			config.memoryFileSystem = true;
+		else if (!strcmp(argv[i], "--small-file-cache") && i + 1 < argc)
+			config.smallFileCacheSize = (uint64_t)std::max(0, atoi(argv[++i])) * 1024 * 1024;
+		else if (!strcmp(argv[i], "--small-file-max") && i + 1 < argc)
+			config.smallFileMaxSize = (uint64_t)std::max(0, atoi(argv[++i])) * 1024;
+		else if (!strcmp(argv[i], "--tree-scanners") && i + 1 < argc)
+			config.treeScanners = (unsigned int)std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--fs-threads") && i + 1 < argc)
+			config.blockingThreads = (unsigned int)std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--size-index"))
+			config.sizeIndex = true;
+		else if (!strcmp(argv[i], "--quota") && i + 1 < argc)
+		{
+			const char* argument = argv[++i];
+			const char* separator = strrchr(argument, '=');
+			if (!separator)
+			{
+				printUsage(argv[0]);
+				return -1;
+			}
+			TinyWinFTP::TinyFTPQuota quota;
+			quota.directory.assign(argument, separator - argument);
+			quota.maxBytes = (uint64_t)std::max(0, atoi(separator + 1)) * 1024 * 1024;
+			config.quotas.push_back(quota);
+		}
+		else
+		{
+			printUsage(argv[0]);
+			return -1;
+		}
+	}
+
+	SetConsoleCtrlHandler(consoleHandler, TRUE);
+	TinyWinFTP::TinyFTPServer server(config);
 	gpServer = &server; // nasty all around
 	server.run();
     return 0;